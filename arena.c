@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ALIGN           16
+
+
+void arena_init(arena_t *a)
+{
+        memset(a, 0, sizeof(*a));
+}
+
+
+static chunk_t *newchunk(arena_t *a, size_t n)
+{
+        size_t size = n > ARENACHUNK ? n : ARENACHUNK;
+        chunk_t *c;
+
+        if (!(c = malloc(sizeof(chunk_t) + size)))
+                return NULL;
+        c->next = NULL;
+        c->size = size;
+        a->total += size;
+        return c;
+}
+
+
+/**
+ * @brief Allocate n bytes, aligned for any type. The memory lives until
+ * the arena is reset.
+ *
+ * @return void* : the memory, NULL when out of memory
+ */
+void *arena_alloc(arena_t *a, size_t n)
+{
+        chunk_t *c;
+        void *p;
+
+        n = (n + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+        if (!n)
+                n = ALIGN;
+
+        if (!a->cur) {
+                if (!(a->head = a->cur = newchunk(a, n)))
+                        return NULL;
+                a->off = 0;
+        }
+
+        /* on to the next chunk kept from before, or a new one after cur */
+        while (a->cur->size - a->off < n) {
+                c = a->cur->next;
+                if (!c || c->size < n) {
+                        if (!(c = newchunk(a, n)))
+                                return NULL;
+                        c->next = a->cur->next;
+                        a->cur->next = c;
+                }
+                a->cur = c;
+                a->off = 0;
+        }
+
+        p = a->cur->data + a->off;
+        a->off += n;
+        return p;
+}
+
+
+/**
+ * @brief Resize an allocation. The last allocation grows in place when
+ * its chunk has room; anything else is copied.
+ *
+ * @param p : the allocation, or NULL
+ * @param old : its size
+ * @param n : the size wanted
+ * @return void* : the memory, NULL when out of memory (p is left as it was)
+ */
+void *arena_grow(arena_t *a, void *p, size_t old, size_t n)
+{
+        size_t start, need;
+        void *q;
+
+        if (p && a->cur && (char*) p >= a->cur->data && (char*) p < a->cur->data + a->cur->size) {
+                start = (char*) p - a->cur->data;
+                need = (n + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+                if (start + ((old + ALIGN - 1) & ~(size_t) (ALIGN - 1)) == a->off && start + need <= a->cur->size) {
+                        a->off = start + need;
+                        return p;
+                }
+        }
+
+        if (!(q = arena_alloc(a, n)))
+                return NULL;
+        if (p)
+                memcpy(q, p, old < n ? old : n);
+        return q;
+}
+
+
+char *arena_strdup(arena_t *a, const char *s)
+{
+        size_t len = strlen(s) + 1;
+        char *p = arena_alloc(a, len);
+
+        return p ? memcpy(p, s, len) : NULL;
+}
+
+
+/* forget every allocation; the chunks stay for the next user unless there are too many */
+void arena_reset(arena_t *a)
+{
+        chunk_t *c, *next;
+
+        if (a->total > ARENAKEEP && a->head) {
+                for (c = a->head->next; c; c = next) {
+                        next = c->next;
+                        free(c);
+                }
+                a->head->next = NULL;
+                a->total = a->head->size;
+        }
+        a->cur = a->head;
+        a->off = 0;
+}
+
+
+void arena_free(arena_t *a)
+{
+        chunk_t *c, *next;
+
+        for (c = a->head; c; c = next) {
+                next = c->next;
+                free(c);
+        }
+        memset(a, 0, sizeof(*a));
+}
@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for the memory of one request.
+ *
+ * Allocations are carved in order out of a chain of chunks and are never
+ * freed one by one: the whole arena is reset when the request is done,
+ * which only rewinds to the first chunk. The chunks are kept, so a
+ * recycled arena serves the next request without calling malloc() until
+ * that request needs more than any before it. An arena that grew past
+ * ARENAKEEP gives the excess back on reset.
+ */
+
+#define ARENACHUNK      (64 * 1024)
+#define ARENAKEEP       (4 * 1024 * 1024)
+
+typedef struct chunk {
+        struct chunk *next;
+        size_t size;
+        char data[];
+} chunk_t;
+
+typedef struct {
+        chunk_t *head;
+        chunk_t *cur;
+        size_t off;                     /* first free byte of cur */
+        size_t total;                   /* bytes held in chunks */
+} arena_t;
+
+void arena_init(arena_t *a);
+void *arena_alloc(arena_t *a, size_t n);
+void *arena_grow(arena_t *a, void *p, size_t old, size_t n);
+char *arena_strdup(arena_t *a, const char *s);
+void arena_reset(arena_t *a);
+void arena_free(arena_t *a);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * Deterministic synthetic file tree for the benchmarks.
+ *
+ * The same options and seed always give the same names, directories,
+ * sizes and contents. Text-like extensions get text that compresses
+ * about as well as prose; the others get random bytes, like media that
+ * is already compressed. Creation times cannot be set, so the manifest
+ * records the ones the files got.
+ *
+ * Build from the repository root:
+ *      gcc -O2 -o gentree bench/gentree.c -lm
+ *
+ * Usage: gentree [-n files] [-d depth] [-w width] [-s median[:sigma]]
+ *                [-x ext:weight,...] [-S seed] [-l manifest] <root>
+ *
+ * The manifest, "name<TAB>ext<TAB>size<TAB>ctime" per file, goes to
+ * stdout unless -l names a file; bench/loadgen draws its requests from it.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAXEXT          16
+#define MAXSIZE         (64 * 1024 * 1024)
+#define CHUNK           65536
+
+typedef struct {
+        char name[16];
+        double weight;
+        int binary;             /* random bytes rather than text */
+} ext_t;
+
+static const char *words[] = {
+        "the", "of", "and", "to", "in", "file", "server", "mirror", "client", "request",
+        "archive", "data", "tree", "size", "date", "return", "int", "char", "static", "void",
+        "buffer", "length", "socket", "send", "receive", "connection", "error", "status", "list", "path",
+        "directory", "name", "time", "count", "value", "node", "cache", "index", "query", "match",
+};
+
+#define NWORDS          (sizeof(words) / sizeof(words[0]))
+
+static const char *binaries[] = { "jpg", "png", "gz", "zip", "pdf", "mp3", "mp4", "bin", NULL };
+
+
+/* splitmix64: small, fast, and the same everywhere */
+static uint64_t next(uint64_t *s)
+{
+        uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+/* uniform in [0, 1) */
+static double uniform(uint64_t *s)
+{
+        return (next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* "txt:40,c:20,jpg:10" */
+static int parse_mix(char *spec, ext_t *exts)
+{
+        char *tok, *save, *colon;
+        int n = 0;
+
+        for (tok = strtok_r(spec, ",", &save); tok && n < MAXEXT; tok = strtok_r(NULL, ",", &save)) {
+                if ((colon = strchr(tok, ':')))
+                        *colon++ = '\0';
+                snprintf(exts[n].name, sizeof(exts[n].name), "%s", tok);
+                exts[n].weight = colon ? atof(colon) : 1;
+                exts[n].binary = 0;
+                for (int i = 0; binaries[i]; ++i) {
+                        if (!strcmp(tok, binaries[i]))
+                                exts[n].binary = 1;
+                }
+                if (exts[n].weight > 0)
+                        ++n;
+        }
+        return n;
+}
+
+
+/* mkdir -p */
+static int makedirs(char *path)
+{
+        for (char *p = path + 1; *p; ++p) {
+                if (*p != '/')
+                        continue;
+                *p = '\0';
+                if (mkdir(path, 0755) < 0 && errno != EEXIST)
+                        return -1;
+                *p = '/';
+        }
+        return mkdir(path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+
+static int fill(FILE *fp, long size, int binary, uint64_t *s)
+{
+        static char buf[CHUNK];
+        long n;
+        int len;
+
+        while (size > 0) {
+                n = size < CHUNK ? size : CHUNK;
+                if (binary) {
+                        for (long i = 0; i < n; i += 8) {
+                                uint64_t v = next(s);
+                                memcpy(buf + i, &v, n - i < 8 ? n - i : 8);
+                        }
+                } else {
+                        for (long i = 0; i < n; i += len) {
+                                const char *w = words[next(s) % NWORDS];
+                                len = strlen(w) + 1;
+                                if (len > n - i)
+                                        len = n - i;
+                                memcpy(buf + i, w, len - 1);
+                                buf[i + len - 1] = next(s) % 12 ? ' ' : '\n';
+                        }
+                }
+                if (fwrite(buf, 1, n, fp) != (size_t) n)
+                        return -1;
+                size -= n;
+        }
+        return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+        long nfiles = 10000, size;
+        int depth = 3, width = 8, e, opt, nexts;
+        double median = 4096, sigma = 1.5, total, r;
+        uint64_t seed = 1, s;
+        char mix[256] = "txt:40,c:20,h:10,md:10,pdf:10,jpg:10";
+        char path[PATH_MAX], dirpath[PATH_MAX - 64], part[PATH_MAX], name[48], *colon, *root;
+        long ndirs, dir;
+        ext_t exts[MAXEXT];
+        FILE *manifest = stdout, *fp;
+        struct stat st;
+
+        while ((opt = getopt(argc, argv, "n:d:w:s:x:S:l:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        nfiles = atol(optarg);
+                        break;
+                case 'd':
+                        depth = atoi(optarg);
+                        break;
+                case 'w':
+                        width = atoi(optarg);
+                        break;
+                case 's':
+                        median = atof(optarg);
+                        sigma = (colon = strchr(optarg, ':')) ? atof(colon + 1) : 0;
+                        break;
+                case 'x':
+                        snprintf(mix, sizeof(mix), "%s", optarg);
+                        break;
+                case 'S':
+                        seed = strtoull(optarg, NULL, 0);
+                        break;
+                case 'l':
+                        if (!(manifest = fopen(optarg, "w"))) {
+                                perror(optarg);
+                                return 1;
+                        }
+                        break;
+                default:
+                        fprintf(stderr, "Invalid arguments!\n");
+                        return 1;
+                }
+        }
+        if (argc - optind != 1 || nfiles < 0 || depth < 0 || width < 1 || median < 0 ||
+            !(nexts = parse_mix(mix, exts))) {
+                fprintf(stderr, "Invalid arguments!\n");
+                return 1;
+        }
+        root = argv[optind];
+
+        total = 0;
+        for (int i = 0; i < nexts; ++i)
+                total += exts[i].weight;
+
+        /* directories are numbered breadth first: dir k has children k*width+1 .. k*width+width */
+        ndirs = 1;
+        for (int d = 0, level = 1; d < depth; ++d)
+                ndirs += (level *= width);
+
+        for (long i = 0; i < nfiles; ++i) {
+                /* each file has its own stream: any one of them can be made again alone */
+                s = seed * 0x100000001b3ULL + i;
+
+                dir = next(&s) % ndirs;
+                for (e = 0, r = uniform(&s) * total; e < nexts - 1; ++e) {
+                        if ((r -= exts[e].weight) < 0)
+                                break;
+                }
+                /* log-normal sizes, from Box-Muller */
+                size = (long) (median * exp(sigma * sqrt(-2 * log(1 - uniform(&s))) * cos(2 * M_PI * uniform(&s))));
+                if (size > MAXSIZE)
+                        size = MAXSIZE;
+
+                /* dir k lives at root/d<ancestor>/.../d<k> */
+                path[0] = '\0';
+                for (long k = dir; k; k = (k - 1) / width) {
+                        if (snprintf(part, sizeof(part), "/d%ld%s", k, path) >= (int) sizeof(part))
+                                goto toolong;
+                        strcpy(path, part);
+                }
+                snprintf(name, sizeof(name), "f%07ld.%s", i, exts[e].name);
+                if (snprintf(dirpath, sizeof(dirpath), "%s%s", root, path) >= (int) sizeof(dirpath))
+                        goto toolong;
+                if (makedirs(dirpath) < 0) {
+                        perror(dirpath);
+                        return 2;
+                }
+                snprintf(path, sizeof(path), "%s/%s", dirpath, name);
+
+                if (!(fp = fopen(path, "w")) || fill(fp, size, exts[e].binary, &s) < 0 || fclose(fp)) {
+                        perror(path);
+                        return 2;
+                }
+                stat(path, &st);
+                fprintf(manifest, "%s\t%s\t%ld\t%lld\n", name, exts[e].name, size, (long long) st.st_ctime);
+        }
+
+        if (manifest != stdout && fclose(manifest)) {
+                perror("manifest");
+                return 2;
+        }
+        return 0;
+
+toolong:
+        fprintf(stderr, "paths under %s too long, use fewer levels (-d)\n", root);
+        return 2;
+}
@@ -0,0 +1,513 @@
+/*
+ * Closed-loop load driver: each of -c connections says HELLO, follows
+ * the server to the mirror when it is told to, then sends one request at
+ * a time, drawn from a weighted mix, for -d seconds after a -W second
+ * warm-up. The arguments come from the manifest bench/gentree wrote for
+ * the tree being served, so every request selects real files:
+ *
+ *      findfile        a random file
+ *      getfiles        one to six random files
+ *      sgetfiles       the sizes within 5% of a random file's
+ *      dgetfiles       the day a random file was created, to the next
+ *      gettargz        the extension of a random file
+ *
+ * The run is reported on stdout as one JSON object: throughput, bytes
+ * received per second, and latency percentiles overall and per command.
+ *
+ * With -s, connections are TLS, trusting the certificates in the given
+ * PEM file; -k keeps the record layer in user space. With -r, archives
+ * are asked for uncompressed, streamed from the files (FL_STORED).
+ *
+ * Build from the repository root with ``make bench``, or:
+ *      gcc -O2 -pthread -iquote . -o loadgen bench/loadgen.c proto.c arena.c tls.c -lssl -lcrypto
+ *
+ * Usage: loadgen [-c connections] [-d seconds] [-W seconds] [-S seed]
+ *                [-m command:weight,...] [-s pem [-k]] [-r] -l manifest <host> <port>
+ */
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "proto.h"
+#include "tls.h"
+
+#define MAXLINE         128
+#define SIZESPAN        0.05            /* sgetfiles: the sizes this close to the drawn one */
+
+typedef struct {
+        char name[48];
+        char ext[16];
+        long size;
+        time_t ctime;
+} entry_t;
+
+/* what the requests of one command did */
+typedef struct {
+        uint64_t requests;
+        uint64_t errors;
+        uint64_t retries;
+        uint64_t bytes;
+        double *lat;                    /* milliseconds */
+        size_t nlat, maxlat;
+} tally_t;
+
+static const char *commands[] = { "findfile", "sgetfiles", "dgetfiles", "getfiles", "gettargz" };
+
+#define NCMD            (sizeof(commands) / sizeof(commands[0]))
+
+typedef struct {
+        pthread_t tid;
+        uint64_t rng;
+        int mirror;                     /* sent to the mirror at HELLO */
+        tally_t tally[NCMD];
+} conn_t;
+
+static entry_t *entries;
+static size_t nentries;
+static double weights[NCMD];
+static double totalweight;
+static char *host, *port;
+static double warm, until;             /* end of the warm-up, end of the run */
+static pthread_barrier_t ready;
+static int reqflags;                    /* sent with every request */
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint64_t next(uint64_t *s)
+{
+        uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+static int relayedconns;                /* TLS connections not taken by the kernel */
+
+static int connect_to(const char *h, const char *p)
+{
+        struct addrinfo hints, *list, *ai;
+        int fd = -1;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(h, p, &hints, &list))
+                return -1;
+        for (ai = list; ai; ai = ai->ai_next) {
+                if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+                        continue;
+                if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+                        break;
+                close(fd);
+                fd = -1;
+        }
+        freeaddrinfo(list);
+        if (fd < 0 || (fd = tls_connect(fd, h)) < 0)
+                return -1;
+        if (tls_relayed(fd))
+                __sync_add_and_fetch(&relayedconns, 1);
+        return fd;
+}
+
+
+/* the NUL terminated answer to a text command */
+static int text_reply(int fd, char *buf, size_t size)
+{
+        size_t n = 0;
+        long nrecv;
+
+        while (n < size - 1 && (nrecv = recv(fd, buf + n, size - 1 - n, 0)) > 0) {
+                n += nrecv;
+                if (memchr(buf, '\0', n))
+                        return 0;
+        }
+        return -1;
+}
+
+
+/* say HELLO, and go to the mirror if the server is busy: the connection, -1 on error */
+static int hello(conn_t *c)
+{
+        char buf[MAXLINE], *sp;
+        int fd;
+
+        if ((fd = connect_to(host, port)) < 0)
+                return -1;
+        if (send(fd, "HELLO\n", 6, 0) < 0 || text_reply(fd, buf, sizeof(buf)) < 0) {
+                close(fd);
+                return -1;
+        }
+        if (strncmp(buf, "BUSY:", 5))
+                return fd;
+
+        /* BUSY:host port */
+        send(fd, "quit\n", 5, 0);
+        close(fd);
+        if (!(sp = strchr(buf + 5, ' ')))
+                return -1;
+        *sp = '\0';
+        c->mirror = 1;
+        return connect_to(buf + 5, sp + 1);
+}
+
+
+/* the next request: its command, and the line for it in line */
+static int draw(conn_t *c, char *line, size_t size)
+{
+        double r = (next(&c->rng) >> 11) * (1.0 / 9007199254740992.0) * totalweight;
+        entry_t *e = &entries[next(&c->rng) % nentries];
+        struct tm tm;
+        char day[16], after[16];
+        size_t len;
+        int cmd, n;
+
+        for (cmd = 0; cmd < (int) NCMD - 1 && (r -= weights[cmd]) >= 0; ++cmd)
+                ;
+        for (; !weights[cmd]; --cmd)
+                ;
+
+        switch (cmd) {
+        case 0:
+                snprintf(line, size, "findfile %s", e->name);
+                break;
+        case 1:
+                snprintf(line, size, "sgetfiles %ld %ld", (long) (e->size * (1 - SIZESPAN)),
+                         (long) (e->size * (1 + SIZESPAN)));
+                break;
+        case 2:
+                localtime_r(&e->ctime, &tm);
+                strftime(day, sizeof(day), "%Y-%m-%d", &tm);
+                tm.tm_mday++;
+                mktime(&tm);
+                strftime(after, sizeof(after), "%Y-%m-%d", &tm);
+                snprintf(line, size, "dgetfiles %s %s", day, after);
+                break;
+        case 3:
+                len = snprintf(line, size, "getfiles %s", e->name);
+                for (n = next(&c->rng) % 6; n > 0 && len < size; --n)
+                        len += snprintf(line + len, size - len, " %s", entries[next(&c->rng) % nentries].name);
+                break;
+        default:
+                snprintf(line, size, "gettargz %s", e->ext);
+                break;
+        }
+        return cmd;
+}
+
+
+/* read the response to request id: its opcode and the bytes it carried, -1 if the connection broke */
+static int response(rbuf_t *rb, uint32_t id, uint64_t *bytes, char *text, size_t size)
+{
+        static __thread char sink[65536];
+        frame_t f;
+        uint32_t left, n;
+
+        *bytes = 0;
+        text[0] = '\0';
+        while (rb_frame(rb, &f) > 0) {
+                *bytes += FRAME_HDRLEN + f.len;
+                for (left = f.len; left; left -= n) {
+                        n = left < sizeof(sink) ? left : sizeof(sink);
+                        if (rb_readn(rb, sink, n) <= 0)
+                                return -1;
+                }
+                if (f.id != id)
+                        continue;
+                if (f.op == OP_RETRY) {
+                        n = f.len < size - 1 ? f.len : size - 1;
+                        memcpy(text, sink, n);
+                        text[n] = '\0';
+                }
+                /* an archive ends with its checksum, or an error half way */
+                if (f.op != OP_FILE && f.op != OP_DATA)
+                        return f.op == OP_SUM ? OP_FILE : f.op;
+        }
+        return -1;
+}
+
+
+static void record(tally_t *t, double ms)
+{
+        if (t->nlat == t->maxlat) {
+                t->maxlat = t->maxlat ? t->maxlat * 2 : 1024;
+                if (!(t->lat = realloc(t->lat, t->maxlat * sizeof(double)))) {
+                        fprintf(stderr, "out of memory\n");
+                        exit(1);
+                }
+        }
+        t->lat[t->nlat++] = ms;
+}
+
+
+static void *run(void *arg)
+{
+        conn_t *c = arg;
+        char line[MAXLINE * 4], text[MAXLINE];
+        uint64_t bytes;
+        uint32_t id = 0;
+        double start, end;
+        buf_t frame;
+        rbuf_t rb;
+        tally_t *t;
+        int fd, cmd, op;
+
+        fd = hello(c);
+        pthread_barrier_wait(&ready);
+        pthread_barrier_wait(&ready);   /* the clock is set */
+        if (fd < 0 || rb_init(&rb, fd) < 0) {
+                fprintf(stderr, "cannot connect to %s:%s\n", host, port);
+                exit(2);
+        }
+        buf_init(&frame);
+
+        while ((start = now()) < until) {
+                cmd = draw(c, line, sizeof(line));
+                frame.len = 0;
+                if (proto_encode_line(&frame, line, ++id, reqflags) < 0) {
+                        fprintf(stderr, "out of memory\n");
+                        exit(1);
+                }
+                if (send(fd, frame.data, frame.len, 0) < 0 || (op = response(&rb, id, &bytes, text, sizeof(text))) < 0) {
+                        fprintf(stderr, "connection lost\n");
+                        exit(2);
+                }
+                end = now();
+
+                /* the warm-up fills the caches; it is not counted */
+                if (start < warm)
+                        continue;
+                t = &c->tally[cmd];
+                ++t->requests;
+                t->bytes += bytes;
+                if (op == OP_ERR)
+                        ++t->errors;
+                if (op == OP_RETRY)
+                        ++t->retries;
+                record(t, (end - start) * 1e3);
+
+                /* do as a client would when the node is overloaded */
+                if (op == OP_RETRY && atoi(text) > 0)
+                        sleep(atoi(text));
+        }
+
+        buf_free(&frame);
+        rb_free(&rb);
+        close(fd);
+        return NULL;
+}
+
+
+static int cmpdouble(const void *a, const void *b)
+{
+        double x = *(const double*) a, y = *(const double*) b;
+
+        return (x > y) - (x < y);
+}
+
+
+/* nearest rank */
+static double percentile(const tally_t *t, double q)
+{
+        size_t i = (size_t) (q * t->nlat + 0.999999);
+
+        return t->nlat ? t->lat[i ? i - 1 : 0] : 0;
+}
+
+
+static void merge(tally_t *into, const tally_t *t)
+{
+        into->requests += t->requests;
+        into->errors += t->errors;
+        into->retries += t->retries;
+        into->bytes += t->bytes;
+        for (size_t i = 0; i < t->nlat; ++i)
+                record(into, t->lat[i]);
+}
+
+
+static void report(const tally_t *t, double secs)
+{
+        double sum = 0;
+
+        for (size_t i = 0; i < t->nlat; ++i)
+                sum += t->lat[i];
+        printf("\"requests\":%llu,\"errors\":%llu,\"retries\":%llu,\"bytes\":%llu,"
+               "\"throughput_rps\":%.3f,\"bytes_per_s\":%.1f,"
+               "\"latency_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+               (unsigned long long) t->requests, (unsigned long long) t->errors,
+               (unsigned long long) t->retries, (unsigned long long) t->bytes,
+               t->requests / secs, t->bytes / secs, t->nlat ? sum / t->nlat : 0,
+               percentile(t, 0.5), percentile(t, 0.99), percentile(t, 0.999),
+               t->nlat ? t->lat[t->nlat - 1] : 0);
+}
+
+
+/* "findfile:50,getfiles:20" */
+static int parse_mix(char *spec)
+{
+        char *tok, *save, *colon;
+        size_t i;
+
+        for (tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                if ((colon = strchr(tok, ':')))
+                        *colon++ = '\0';
+                for (i = 0; i < NCMD && strcmp(tok, commands[i]); ++i)
+                        ;
+                if (i == NCMD)
+                        return -1;
+                totalweight += (weights[i] = colon ? atof(colon) : 1);
+        }
+        return totalweight > 0 ? 0 : -1;
+}
+
+
+static int load(const char *path)
+{
+        char line[256];
+        size_t cap = 0;
+        long long ctime;
+        FILE *fp;
+
+        if (!(fp = fopen(path, "r")))
+                return -1;
+        while (fgets(line, sizeof(line), fp)) {
+                if (nentries == cap && !(entries = realloc(entries, (cap = cap ? cap * 2 : 4096) * sizeof(entry_t))))
+                        return -1;
+                if (sscanf(line, "%47s %15s %ld %lld", entries[nentries].name, entries[nentries].ext,
+                           &entries[nentries].size, &ctime) == 4) {
+                        entries[nentries].ctime = ctime;
+                        ++nentries;
+                }
+        }
+        fclose(fp);
+        return nentries ? 0 : -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+        int nconn = 4, opt;
+        double duration = 10, warmup = 2, secs;
+        uint64_t seed = 1;
+        char mix[256] = "findfile:50,getfiles:20,sgetfiles:10,dgetfiles:5,gettargz:15", spec[256];
+        char *manifest = NULL, *pem = NULL;
+        tally_t all, cmd[NCMD];
+        conn_t *conns;
+        int mirrored = 0, ktls = 1;
+
+        while ((opt = getopt(argc, argv, "c:d:W:S:m:l:s:kr")) != -1) {
+                switch (opt) {
+                case 'c':
+                        nconn = atoi(optarg);
+                        break;
+                case 'd':
+                        duration = atof(optarg);
+                        break;
+                case 'W':
+                        warmup = atof(optarg);
+                        break;
+                case 'S':
+                        seed = strtoull(optarg, NULL, 0);
+                        break;
+                case 'm':
+                        snprintf(mix, sizeof(mix), "%s", optarg);
+                        break;
+                case 'l':
+                        manifest = optarg;
+                        break;
+                case 's':
+                        pem = optarg;
+                        break;
+                case 'k':
+                        ktls = 0;
+                        break;
+                case 'r':
+                        reqflags = FL_STORED;
+                        break;
+                default:
+                        fprintf(stderr, "Invalid arguments!\n");
+                        return 1;
+                }
+        }
+        snprintf(spec, sizeof(spec), "%s", mix);
+        if (argc - optind != 2 || nconn < 1 || duration <= 0 || warmup < 0 || !manifest || parse_mix(spec) < 0) {
+                fprintf(stderr, "Invalid arguments!\n");
+                return 1;
+        }
+        host = argv[optind];
+        port = argv[optind + 1];
+        if (pem && tls_init(pem, 0, ktls) < 0) {
+                fprintf(stderr, "can't use %s for TLS\n", pem);
+                return 1;
+        }
+        if (load(manifest) < 0) {
+                fprintf(stderr, "can't read %s\n", manifest);
+                return 1;
+        }
+
+        if (!(conns = calloc(nconn, sizeof(conn_t)))) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+        }
+
+        /* the clock starts once every connection has said HELLO */
+        pthread_barrier_init(&ready, NULL, nconn + 1);
+        for (int i = 0; i < nconn; ++i) {
+                conns[i].rng = seed * 0x100000001b3ULL + i;
+                if (pthread_create(&conns[i].tid, NULL, run, &conns[i])) {
+                        fprintf(stderr, "pthread_create failed\n");
+                        return 1;
+                }
+        }
+        pthread_barrier_wait(&ready);
+        warm = now() + warmup;
+        until = warm + duration;
+        pthread_barrier_wait(&ready);
+        for (int i = 0; i < nconn; ++i)
+                pthread_join(conns[i].tid, NULL);
+        secs = now() - warm;
+
+        memset(&all, 0, sizeof(all));
+        memset(cmd, 0, sizeof(cmd));
+        for (int i = 0; i < nconn; ++i) {
+                mirrored += conns[i].mirror;
+                for (size_t k = 0; k < NCMD; ++k) {
+                        merge(&cmd[k], &conns[i].tally[k]);
+                        merge(&all, &conns[i].tally[k]);
+                }
+        }
+
+        printf("{\"host\":\"%s\",\"port\":\"%s\",\"connections\":%d,\"mirrored\":%d,\"tls\":\"%s\",\"archive\":\"%s\",\"seed\":%llu,"
+               "\"mix\":\"%s\",\"files\":%zu,\"warmup_s\":%.3f,\"elapsed_s\":%.3f,",
+               host, port, nconn, mirrored, !pem ? "off" : relayedconns ? "user" : "kernel",
+               reqflags & FL_STORED ? "stored" : "gzip", (unsigned long long) seed, mix, nentries, warmup, secs);
+        qsort(all.lat, all.nlat, sizeof(double), cmpdouble);
+        report(&all, secs);
+        printf(",\"commands\":{");
+        for (size_t k = 0, first = 1; k < NCMD; ++k) {
+                if (!weights[k])
+                        continue;
+                qsort(cmd[k].lat, cmd[k].nlat, sizeof(double), cmpdouble);
+                printf("%s\"%s\":{", first ? "" : ",", commands[k]);
+                report(&cmd[k], secs);
+                printf("}");
+                first = 0;
+        }
+        printf("}}\n");
+        return 0;
+}
@@ -0,0 +1,532 @@
+/*
+ * Microbenchmarks of the helpers that run once per file or per request:
+ * the command parser, the selection tests of the tree walks and their
+ * ftw() callbacks, the headers of stored archives, and, over a real tree, the index lookups and searches
+ * that stand in for the walks.
+ *
+ * Each benchmark is calibrated to batches of at least 10 ms, warmed up,
+ * then timed over -n batches on one pinned CPU. The median time per call
+ * is the figure to compare; min, mean and standard deviation say how far
+ * it can be trusted. The inputs come from a fixed seed, so builds of two
+ * commits measure the same work:
+ *
+ *      micro_bench -j > before.json
+ *      (change, rebuild)
+ *      micro_bench -b before.json
+ *
+ * server.c is compiled in whole, its main() renamed, to reach its static
+ * helpers as they are.
+ *
+ * Build from the repository root with ``make bench``, or:
+ *      gcc -O2 -pthread -iquote . -o micro_bench bench/micro_bench.c proto.c net.c cache.c hash.c \
+ *              index.c search.c bitmap.c query.c arena.c sched.c throttle.c metrics.c trace.c tune.c tls.c \
+ *              tar.c -lm -lssl -lcrypto
+ *
+ * (-iquote rather than -I: the sched.h of this tree would hide the system one.)
+ *
+ * Usage: micro_bench [-c cpu] [-n batches] [-j] [-b baseline] [-t dir] [filter]
+ *
+ * -t runs the tree benchmarks too, over dir/data (say a tree from
+ * bench/gentree); only the benchmarks whose name contains filter run.
+ */
+#define _GNU_SOURCE                     /* sched_setaffinity() */
+#define main server_main
+#include "server.c"
+#undef main
+#undef FILE                             /* a status of server.c, and stdio's type */
+
+#include <math.h>
+#include <sched.h>
+
+#define NFILES          4096            /* synthetic paths and stats */
+#define MINBATCH        0.01            /* seconds */
+#define WARMUP          3               /* batches */
+#define MAXBENCH        64
+
+typedef struct {
+        const char *name;
+        long (*fn)(long n);             /* n calls: something derived from them, so they are not optimized out */
+        int tree;                       /* needs -t */
+} bench_t;
+
+typedef struct {
+        const char *name;
+        double median;
+} base_t;
+
+static char paths[NFILES][64];
+static struct stat stats[NFILES];
+static const char *lines[] = {
+        "findfile t1.txt",
+        "sgetfiles 1240 12450",
+        "dgetfiles 2023-01-16 2023-03-04",
+        "getfiles new.txt ex1.c ex4.pdf report-2023-final.docx notes.md main.c",
+        "gettargz c txt pdf",
+};
+
+#define NLINES          (sizeof(lines) / sizeof(lines[0]))
+
+static char *names[] = { "f0000017.c", "f0001234.txt", "notes.md", "main.c", "f0004095.pdf", "x.h", NULL };
+static char *exts[] = { "c", "txt", "pdf", NULL };
+static char *findargs[] = { "findfile", "f0002048.txt", NULL };
+static char *sizeargs[] = { "sgetfiles", "1240", "12450", NULL };
+static char *dateargs[] = { "dgetfiles", "2023-01-16", "2023-03-04", NULL };
+
+/* over the tree */
+static index_t ix;
+static uint32_t *picks;                 /* random records */
+static uint32_t npicks;
+static ctx_t bench_ctx;
+
+static base_t base[MAXBENCH];
+static int nbase;
+
+
+static uint64_t next(uint64_t *s)
+{
+        uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+/* the same synthetic files on every run */
+static void setup(void)
+{
+        static const char *extlist[] = { "txt", "c", "h", "md", "pdf", "jpg" };
+        uint64_t s = 1;
+
+        for (int i = 0; i < NFILES; ++i) {
+                snprintf(paths[i], sizeof(paths[i]), "data/d%d/d%d/f%07d.%s", (int) (next(&s) % 8),
+                         (int) (next(&s) % 64), i, extlist[next(&s) % 6]);
+                memset(&stats[i], 0, sizeof(struct stat));
+                stats[i].st_size = next(&s) % 65536;
+                stats[i].st_ctime = 1672531200 + next(&s) % (365 * 86400);
+                stats[i].st_mode = S_IFREG | 0644;
+        }
+}
+
+
+static void request(char **argv)
+{
+        int argc = 0;
+
+        while (argv[argc])
+                ++argc;
+        cur = &bench_ctx;
+        cur->req.argv = argv;
+        cur->req.argc = argc;
+        plist_free(&cur->matches);
+}
+
+
+static long b_parse(long n)
+{
+        char buf[256], *argv[MAXARG];
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i) {
+                strcpy(buf, lines[i % NLINES]);
+                sink += proto_parse(buf, argv, MAXARG);
+        }
+        return sink;
+}
+
+
+static long b_compare_size(long n)
+{
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i)
+                sink += compare(&stats[i % NFILES], sizeargs[1], sizeargs[2], sizeargs[0]);
+        return sink;
+}
+
+
+static long b_compare_date(long n)
+{
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i)
+                sink += compare(&stats[i % NFILES], dateargs[1], dateargs[2], dateargs[0]);
+        return sink;
+}
+
+
+static long b_contains(long n)
+{
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i)
+                sink += contains(names, basename(paths[i % NFILES]));
+        return sink;
+}
+
+
+static long b_get_file_ext(long n)
+{
+        char ext[MAXLINE];
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i)
+                sink += get_file_ext(paths[i % NFILES], ext) + ext[0];
+        return sink;
+}
+
+
+static long b_match(long n)
+{
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i)
+                sink += match(exts, paths[i % NFILES]);
+        return sink;
+}
+
+
+static long b_findfile(long n)
+{
+        long sink = 0;
+
+        request(findargs);
+        for (long i = 0; i < n; ++i)
+                sink += findfile(paths[i % NFILES], &stats[i % NFILES], FTW_F);
+        return sink;
+}
+
+
+static long b_sdgetfiles(long n)
+{
+        long sink;
+
+        request(sizeargs);
+        for (long i = 0; i < n; ++i)
+                sdgetfiles(paths[i % NFILES], &stats[i % NFILES], FTW_F);
+        sink = cur->matches.n;
+        plist_free(&cur->matches);
+        return sink;
+}
+
+
+/* findfile of a random file: through the index, then by walking the tree */
+static long b_index_findfile(long n)
+{
+        char *argv[3] = { "findfile", NULL, NULL };
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i) {
+                argv[1] = (char*) index_name(&ix, picks[i % npicks]);
+                request(argv);
+                sink += walk_names(findfile, argv + 1);
+        }
+        return sink;
+}
+
+
+static long b_walk_findfile(long n)
+{
+        const index_t saved = fileindex;
+        long sink;
+
+        memset(&fileindex, 0, sizeof(fileindex));
+        sink = b_index_findfile(n);
+        fileindex = saved;
+        return sink;
+}
+
+
+/* sgetfiles of the sizes within 5% of a random file's */
+static long b_index_sgetfiles(long n)
+{
+        char lo[32], hi[32], *argv[4] = { "sgetfiles", lo, hi, NULL };
+        struct stat st;
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i) {
+                index_stat(&ix, picks[i % npicks], &st);
+                snprintf(lo, sizeof(lo), "%lld", (long long) (st.st_size * 0.95));
+                snprintf(hi, sizeof(hi), "%lld", (long long) (st.st_size * 1.05));
+                request(argv);
+                walk(sdgetfiles);
+                sink += cur->matches.n;
+        }
+        plist_free(&cur->matches);
+        return sink;
+}
+
+
+static long b_walk_sgetfiles(long n)
+{
+        const index_t saved = fileindex;
+        long sink;
+
+        memset(&fileindex, 0, sizeof(fileindex));
+        sink = b_index_sgetfiles(n);
+        fileindex = saved;
+        return sink;
+}
+
+
+static long b_index_exts(long n)
+{
+        uint32_t first;
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i)
+                sink += index_exts(&ix, index_ext(&ix, picks[i % npicks]), &first);
+        return sink;
+}
+
+
+/* the searches, with the index: one literal run long enough for the trigrams, and one without */
+static long search(long n, int re, const char *pattern)
+{
+        plist_t out;
+        char err[MAXLINE];
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i) {
+                memset(&out, 0, sizeof(out));
+                if (re)
+                        search_re(&ix, PATH, pattern, &out, err, sizeof(err));
+                else
+                        search_glob(&ix, PATH, pattern, &out);
+                sink += out.n;
+                plist_free(&out);
+        }
+        return sink;
+}
+
+
+static long b_glob_literal(long n)
+{
+        return search(n, 0, "f00012*.txt");
+}
+
+
+static long b_glob_wild(long n)
+{
+        return search(n, 0, "*.md");
+}
+
+
+static long b_re_literal(long n)
+{
+        return search(n, 1, "f00012[0-9]+\\.c$");
+}
+
+
+static long b_query(long n)
+{
+        plist_t out;
+        char err[MAXLINE];
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i) {
+                memset(&out, 0, sizeof(out));
+                query_run(&ix, PATH, "ext=c and size>8K and size<64K", &out, err, sizeof(err));
+                sink += out.n;
+                plist_free(&out);
+        }
+        return sink;
+}
+
+
+static long b_tar_header(long n)
+{
+        char th[TARHDRMAX];
+        long sink = 0;
+
+        for (long i = 0; i < n; ++i)
+                sink += tar_header(th, paths[i % NFILES], &stats[i % NFILES]) + th[148];
+        return sink;
+}
+
+
+static const bench_t benches[] = {
+        { "parse", b_parse, 0 },
+        { "compare_size", b_compare_size, 0 },
+        { "compare_date", b_compare_date, 0 },
+        { "contains", b_contains, 0 },
+        { "get_file_ext", b_get_file_ext, 0 },
+        { "match", b_match, 0 },
+        { "findfile_cb", b_findfile, 0 },
+        { "sdgetfiles_cb", b_sdgetfiles, 0 },
+        { "tar_header", b_tar_header, 0 },
+        { "index_findfile", b_index_findfile, 1 },
+        { "walk_findfile", b_walk_findfile, 1 },
+        { "index_sgetfiles", b_index_sgetfiles, 1 },
+        { "walk_sgetfiles", b_walk_sgetfiles, 1 },
+        { "index_exts", b_index_exts, 1 },
+        { "glob_literal", b_glob_literal, 1 },
+        { "glob_wild", b_glob_wild, 1 },
+        { "re_literal", b_re_literal, 1 },
+        { "query", b_query, 1 },
+};
+
+#define NBENCH          (sizeof(benches) / sizeof(benches[0]))
+
+
+/* build and map the index of dir/data, and draw the records the tree benchmarks ask for */
+static int tree(const char *dir)
+{
+        char file[PATH_MAX];
+        uint64_t s = 2;
+
+        snprintf(file, sizeof(file), "/tmp/micro_bench.%d.index", getpid());
+        if (chdir(dir) < 0 || index_build(PATH, file) < 0 || index_open(&ix, file) < 0 || !ix.n) {
+                unlink(file);
+                return -1;
+        }
+        unlink(file);                   /* the mapping stays */
+        fileindex = ix;
+        if (!access(INDEXFILE, F_OK))
+                fprintf(stderr, "%s/%s exists: the walk benchmarks map it instead of walking\n", dir, INDEXFILE);
+
+        npicks = 1024;
+        if (!(picks = malloc(npicks * sizeof(uint32_t))))
+                return -1;
+        for (uint32_t i = 0; i < npicks; ++i)
+                picks[i] = next(&s) % ix.n;
+        return 0;
+}
+
+
+static int cmpdouble(const void *a, const void *b)
+{
+        double x = *(const double*) a, y = *(const double*) b;
+
+        return (x > y) - (x < y);
+}
+
+
+/* the medians of an earlier run, from its -j output */
+static int load(const char *path)
+{
+        char line[512], *p, *q;
+        FILE *fp;
+
+        if (!(fp = fopen(path, "r")))
+                return -1;
+        while (nbase < MAXBENCH && fgets(line, sizeof(line), fp)) {
+                if (!(p = strstr(line, "\"bench\":\"")) || !(q = strchr(p += 9, '"')) ||
+                    !(base[nbase].name = strndup(p, q - p)) || !(p = strstr(line, "\"ns_median\":")))
+                        continue;
+                base[nbase++].median = atof(p + 12);
+        }
+        fclose(fp);
+        return 0;
+}
+
+
+static double baseline(const char *name)
+{
+        for (int i = 0; i < nbase; ++i) {
+                if (!strcmp(base[i].name, name))
+                        return base[i].median;
+        }
+        return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+        int cpu = -1, reps = 21, json = 0, opt;
+        char *dir = NULL, *filter = NULL;
+        double *ns, t0, secs, sum, var, was;
+        volatile long sink = 0;
+        cpu_set_t set;
+        long n;
+
+        while ((opt = getopt(argc, argv, "c:n:jb:t:")) != -1) {
+                switch (opt) {
+                case 'c':
+                        cpu = atoi(optarg);
+                        break;
+                case 'n':
+                        reps = atoi(optarg);
+                        break;
+                case 'j':
+                        json = 1;
+                        break;
+                case 'b':
+                        if (load(optarg) < 0) {
+                                fprintf(stderr, "can't read %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                case 't':
+                        dir = optarg;
+                        break;
+                default:
+                        fprintf(stderr, "Invalid arguments!\n");
+                        return 1;
+                }
+        }
+        if (argc - optind > 1 || reps < 1) {
+                fprintf(stderr, "Invalid arguments!\n");
+                return 1;
+        }
+        filter = argv[optind];
+
+        /* one CPU for the whole run: no migrations, one cache */
+        CPU_ZERO(&set);
+        CPU_SET(cpu < 0 ? sched_getcpu() : cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+                perror("sched_setaffinity");
+
+        setup();
+        if (dir && tree(dir) < 0) {
+                fprintf(stderr, "can't index %s/%s\n", dir, PATH);
+                return 1;
+        }
+        if (!(ns = malloc(reps * sizeof(double))))
+                return 1;
+
+        for (size_t b = 0; b < NBENCH; ++b) {
+                if ((benches[b].tree && !dir) || (filter && !strstr(benches[b].name, filter)))
+                        continue;
+
+                /* calibrate: the calls it takes to fill a batch */
+                for (n = 1; ; n *= 2) {
+                        t0 = now();
+                        sink += benches[b].fn(n);
+                        if ((secs = now() - t0) >= MINBATCH)
+                                break;
+                }
+                for (int w = 0; w < WARMUP; ++w)
+                        sink += benches[b].fn(n);
+
+                sum = var = 0;
+                for (int r = 0; r < reps; ++r) {
+                        t0 = now();
+                        sink += benches[b].fn(n);
+                        sum += (ns[r] = (now() - t0) * 1e9 / n);
+                }
+                for (int r = 0; r < reps; ++r)
+                        var += (ns[r] - sum / reps) * (ns[r] - sum / reps);
+                qsort(ns, reps, sizeof(double), cmpdouble);
+
+                was = baseline(benches[b].name);
+                if (json) {
+                        printf("{\"bench\":\"%s\",\"ns_median\":%.3f,\"ns_min\":%.3f,\"ns_mean\":%.3f,"
+                               "\"ns_stddev\":%.3f,\"batches\":%d,\"calls\":%ld", benches[b].name, ns[reps / 2],
+                               ns[0], sum / reps, sqrt(var / reps), reps, n);
+                        if (was > 0)
+                                printf(",\"baseline_ns\":%.3f,\"change\":%.4f", was, ns[reps / 2] / was - 1);
+                        printf("}\n");
+                } else {
+                        printf("%-16s %12.1f ns/call  (min %.1f, mean %.1f, sd %.1f%%)", benches[b].name,
+                               ns[reps / 2], ns[0], sum / reps, sqrt(var / reps) / (sum / reps) * 100);
+                        if (was > 0)
+                                printf("  %+6.1f%% vs %.1f", (ns[reps / 2] / was - 1) * 100, was);
+                        printf("\n");
+                }
+                fflush(stdout);
+        }
+
+        free(ns);
+        return sink == 42;
+}
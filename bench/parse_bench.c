@@ -0,0 +1,100 @@
+/*
+ * Parse throughput of the text protocol against the binary framing.
+ *
+ * Build from the repository root:
+ *      gcc -O2 -I. -o parse_bench bench/parse_bench.c proto.c arena.c
+ *
+ * Usage: parse_bench [requests]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "proto.h"
+
+#define NREQ            1000000
+
+static const char *commands[] = {
+        "findfile t1.txt\n",
+        "sgetfiles 1240 12450\n",
+        "dgetfiles 2023-01-16 2023-03-04\n",
+        "getfiles new.txt ex1.c ex4.pdf report-2023-final.docx notes.md main.c\n",
+        "gettargz c txt pdf\n",
+        "findfile some/rather/deeply/nested/directory/with/a/long-file-name.tar.gz\n",
+};
+
+#define NCMD            (sizeof(commands) / sizeof(commands[0]))
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void report(const char *name, double secs, long n, size_t bytes)
+{
+        printf("%-8s %10.1f ns/req %10.2f Mreq/s %10.1f MB/s\n", name,
+               secs * 1e9 / n, n / secs / 1e6, bytes / secs / 1e6);
+}
+
+
+int main(int argc, char *argv[])
+{
+        long n = argc > 1 ? atol(argv[1]) : NREQ;
+        char line[256], *copy;
+        size_t textbytes = 0, framebytes = 0;
+        long sink = 0;
+        double start;
+        buf_t frames;
+        size_t off[NCMD];
+        request_t req;
+        frame_t f;
+
+        /* encode each command once; decoding is what we measure */
+        buf_init(&frames);
+        for (size_t i = 0; i < NCMD; ++i) {
+                off[i] = frames.len;
+                strcpy(line, commands[i]);
+                if (proto_encode_line(&frames, line, i, 0) < 0) {
+                        fprintf(stderr, "encode failed\n");
+                        return 1;
+                }
+        }
+
+        start = now();
+        for (long i = 0; i < n; ++i) {
+                const char *cmd = commands[i % NCMD];
+                size_t len = strlen(cmd);
+
+                /* the reader hands the line over without its newline */
+                copy = memcpy(line, cmd, len);
+                copy[len - 1] = '\0';
+                if (proto_decode_text(copy, &req) < 0)
+                        return 1;
+                sink += req.argc;
+                request_free(&req);
+                textbytes += len;
+        }
+        report("text", now() - start, n, textbytes);
+
+        start = now();
+        for (long i = 0; i < n; ++i) {
+                const char *hdr = frames.data + off[i % NCMD];
+
+                frame_unpack(hdr, &f);
+                if (proto_decode(&f, hdr + FRAME_HDRLEN, &req) < 0)
+                        return 1;
+                sink += req.argc;
+                request_free(&req);
+                framebytes += FRAME_HDRLEN + f.len;
+        }
+        report("binary", now() - start, n, framebytes);
+
+        buf_free(&frames);
+        return sink == 0;
+}
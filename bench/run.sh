@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Build everything with make (or take the binaries in $BIN, e.g.
+# build/release), generate a tree, start a server and its mirror on
+# localhost, drive them with loadgen, and print its JSON report.
+#
+# Usage: bench/run.sh [workdir]
+#
+# Any of these can be set in the environment:
+#      FILES DEPTH WIDTH SIZE EXTS SEED     the tree, see bench/gentree.c
+#      CONNS DURATION WARMUP MIX            the load, see bench/loadgen.c
+#      PORT MIRRORPORT
+#      TLS                                  kernel or user: TLS with a self-signed
+#                                           certificate, its records done by kTLS
+#                                           where the kernel has it, or in user space
+#      STORED                               1: archives uncompressed, streamed from
+#                                           the files (loadgen -r)
+#      BUILD                                the make profile to build, default if unset
+#      BIN                                  prebuilt server, mirror, gentree, loadgen
+#
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mkdir -p "${1:-/tmp/ftpbench}" && cd "${1:-/tmp/ftpbench}" && pwd)
+port=${PORT:-9750}
+mport=${MIRRORPORT:-9751}
+
+cd "$top"
+if [ -z "$BIN" ]; then
+        make -s all bench BUILD="${BUILD:-default}" >&2
+        BIN=build/${BUILD:-default}
+fi
+for b in server mirror gentree loadgen; do
+        cp "$BIN/$b" "$work/$b"
+done
+
+nodetls= clienttls=
+if [ -n "$TLS" ]; then
+        openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 \
+                -subj /CN=localhost -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" \
+                -keyout "$work/node.pem" -out "$work/cert.pem" 2>/dev/null
+        cat "$work/cert.pem" >> "$work/node.pem"
+        nodetls="-s $work/node.pem"
+        clienttls="-s $work/cert.pem"
+        if [ "$TLS" = user ]; then
+                nodetls="$nodetls -k"
+                clienttls="$clienttls -k"
+        fi
+fi
+
+stored=
+if [ -n "$STORED" ] && [ "$STORED" != 0 ]; then
+        stored=-r
+fi
+
+# the same tree every time
+rm -rf "$work/server.d" "$work/mirror.d"
+mkdir -p "$work/server.d" "$work/mirror.d"
+"$work/gentree" -n "${FILES:-20000}" -d "${DEPTH:-3}" -w "${WIDTH:-8}" -s "${SIZE:-4096:1.5}" \
+        -x "${EXTS:-txt:40,c:20,h:10,md:10,pdf:10,jpg:10}" -S "${SEED:-1}" \
+        -l "$work/manifest" "$work/server.d/data"
+
+cd "$work/server.d"
+"$work/server" $nodetls "$port" > "$work/server.log" 2>&1 &
+server=$!
+sleep 1
+cd "$work/mirror.d"
+"$work/mirror" $nodetls "$mport" localhost "$port" > "$work/mirror.log" 2>&1 &
+mirror=$!
+trap 'pkill -f "^$work/(server|mirror) " || true' EXIT
+
+# the mirror listens right after it has copied the tree
+while ! grep -q "All files received" "$work/mirror.log"; do
+        if ! kill -0 $mirror 2>/dev/null; then
+                echo "mirror failed, see $work/mirror.log" >&2
+                exit 1
+        fi
+        sleep 1
+done
+sleep 1
+
+"$work/loadgen" $clienttls $stored -c "${CONNS:-8}" -d "${DURATION:-10}" -W "${WARMUP:-2}" -S "${SEED:-1}" \
+        -m "${MIX:-findfile:50,getfiles:20,sgetfiles:10,dgetfiles:5,gettargz:15}" \
+        -l "$work/manifest" localhost "$port"
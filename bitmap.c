@@ -0,0 +1,406 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#define WORDS           1024            /* 64-bit words in a bit set */
+
+
+void bitmap_init(bitmap_t *b)
+{
+        memset(b, 0, sizeof(*b));
+}
+
+
+void bitmap_free(bitmap_t *b)
+{
+        for (uint32_t i = 0; i < b->n; ++i)
+                free(b->c[i].array);
+        free(b->c);
+        memset(b, 0, sizeof(*b));
+}
+
+
+/* append an empty container, keys must come in ascending order */
+static container_t *append(bitmap_t *b, uint16_t key)
+{
+        container_t *c;
+
+        if (b->n == b->cap) {
+                b->cap = b->cap ? b->cap * 2 : 16;
+                if (!(c = realloc(b->c, b->cap * sizeof(container_t))))
+                        return NULL;
+                b->c = c;
+        }
+        c = &b->c[b->n++];
+        memset(c, 0, sizeof(*c));
+        c->key = key;
+        return c;
+}
+
+
+/* drop the container last appended, when it came out empty */
+static void unappend(bitmap_t *b)
+{
+        free(b->c[--b->n].array);
+}
+
+
+static int has(const container_t *c, uint16_t v)
+{
+        uint32_t lo = 0, hi = c->card, mid;
+
+        if (c->bitset)
+                return c->bits[v >> 6] >> (v & 63) & 1;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (c->array[mid] < v)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo < c->card && c->array[lo] == v;
+}
+
+
+static uint32_t popcount(const uint64_t *bits)
+{
+        uint32_t n = 0;
+
+        for (int i = 0; i < WORDS; ++i)
+                n += __builtin_popcountll(bits[i]);
+        return n;
+}
+
+
+/* store a bit set as an array, or the other way, whichever its size calls for */
+static int settle(container_t *c)
+{
+        uint16_t *array;
+        uint64_t *bits, w;
+        uint32_t k = 0;
+
+        if (c->bitset && c->card <= BITMAP_ARRAYMAX) {
+                if (!(array = malloc((c->card ? c->card : 1) * sizeof(uint16_t))))
+                        return -1;
+                for (int i = 0; i < WORDS; ++i) {
+                        for (w = c->bits[i]; w; w &= w - 1)
+                                array[k++] = i * 64 + __builtin_ctzll(w);
+                }
+                free(c->bits);
+                c->array = array;
+                c->bitset = 0;
+        } else if (!c->bitset && c->card > BITMAP_ARRAYMAX) {
+                if (!(bits = calloc(WORDS, sizeof(uint64_t))))
+                        return -1;
+                for (uint32_t i = 0; i < c->card; ++i)
+                        bits[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+                free(c->array);
+                c->bits = bits;
+                c->bitset = 1;
+        }
+        return 0;
+}
+
+
+/* the members of c as a bit set, in a new allocation */
+static uint64_t *tobits(const container_t *c)
+{
+        uint64_t *bits;
+
+        if (c->bitset) {
+                if (!(bits = malloc(WORDS * sizeof(uint64_t))))
+                        return NULL;
+                return memcpy(bits, c->bits, WORDS * sizeof(uint64_t));
+        }
+        if (!(bits = calloc(WORDS, sizeof(uint64_t))))
+                return NULL;
+        for (uint32_t i = 0; i < c->card; ++i)
+                bits[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+        return bits;
+}
+
+
+static int copy(container_t *dst, const container_t *src)
+{
+        size_t len = src->bitset ? WORDS * sizeof(uint64_t) : src->card * sizeof(uint16_t);
+
+        dst->bitset = src->bitset;
+        dst->card = src->card;
+        if (!(dst->array = malloc(len ? len : 1)))
+                return -1;
+        memcpy(dst->array, src->array, len);
+        return 0;
+}
+
+
+static int cand(container_t *out, const container_t *a, const container_t *b)
+{
+        const container_t *t;
+
+        /* an array on the left, if there is one: only its members can stay */
+        if (a->bitset && !b->bitset) {
+                t = a;
+                a = b;
+                b = t;
+        }
+
+        if (!a->bitset) {
+                if (!(out->array = malloc((a->card ? a->card : 1) * sizeof(uint16_t))))
+                        return -1;
+                for (uint32_t i = 0; i < a->card; ++i) {
+                        if (has(b, a->array[i]))
+                                out->array[out->card++] = a->array[i];
+                }
+                return 0;
+        }
+
+        if (!(out->bits = malloc(WORDS * sizeof(uint64_t))))
+                return -1;
+        out->bitset = 1;
+        for (int i = 0; i < WORDS; ++i)
+                out->bits[i] = a->bits[i] & b->bits[i];
+        out->card = popcount(out->bits);
+        return settle(out);
+}
+
+
+static int cor(container_t *out, const container_t *a, const container_t *b)
+{
+        uint32_t i = 0, j = 0;
+
+        if (!a->bitset && !b->bitset && a->card + b->card <= BITMAP_ARRAYMAX) {
+                if (!(out->array = malloc((a->card + b->card ? a->card + b->card : 1) * sizeof(uint16_t))))
+                        return -1;
+                while (i < a->card || j < b->card) {
+                        if (j == b->card || (i < a->card && a->array[i] < b->array[j]))
+                                out->array[out->card++] = a->array[i++];
+                        else if (i == a->card || b->array[j] < a->array[i])
+                                out->array[out->card++] = b->array[j++];
+                        else {
+                                out->array[out->card++] = a->array[i++];
+                                ++j;
+                        }
+                }
+                return 0;
+        }
+
+        if (!(out->bits = tobits(a)))
+                return -1;
+        out->bitset = 1;
+        if (b->bitset) {
+                for (int k = 0; k < WORDS; ++k)
+                        out->bits[k] |= b->bits[k];
+        } else {
+                for (uint32_t k = 0; k < b->card; ++k)
+                        out->bits[b->array[k] >> 6] |= 1ULL << (b->array[k] & 63);
+        }
+        out->card = popcount(out->bits);
+        return settle(out);
+}
+
+
+static int candnot(container_t *out, const container_t *a, const container_t *b)
+{
+        if (!a->bitset) {
+                if (!(out->array = malloc((a->card ? a->card : 1) * sizeof(uint16_t))))
+                        return -1;
+                for (uint32_t i = 0; i < a->card; ++i) {
+                        if (!has(b, a->array[i]))
+                                out->array[out->card++] = a->array[i];
+                }
+                return 0;
+        }
+
+        if (!(out->bits = tobits(a)))
+                return -1;
+        out->bitset = 1;
+        if (b->bitset) {
+                for (int k = 0; k < WORDS; ++k)
+                        out->bits[k] &= ~b->bits[k];
+        } else {
+                for (uint32_t k = 0; k < b->card; ++k)
+                        out->bits[b->array[k] >> 6] &= ~(1ULL << (b->array[k] & 63));
+        }
+        out->card = popcount(out->bits);
+        return settle(out);
+}
+
+
+/**
+ * @brief Make a bitmap of a set of record numbers.
+ *
+ * @param b : an empty bitmap
+ * @param ids : the numbers, in ascending order
+ * @param n : how many there are
+ * @return int : 0 on success, -1 on error
+ */
+int bitmap_from(bitmap_t *b, const uint32_t *ids, uint32_t n)
+{
+        container_t *c;
+        uint32_t i = 0, j;
+
+        while (i < n) {
+                for (j = i; j < n && ids[j] >> 16 == ids[i] >> 16; ++j)
+                        ;
+                if (!(c = append(b, ids[i] >> 16)) ||
+                    !(c->array = malloc((j - i) * sizeof(uint16_t))))
+                        return -1;
+                for (; i < j; ++i) {
+                        if (!c->card || c->array[c->card - 1] != (uint16_t) ids[i])
+                                c->array[c->card++] = ids[i];
+                }
+                if (settle(c) < 0)
+                        return -1;
+        }
+        return 0;
+}
+
+
+/* make a bitmap of the numbers in [lo, hi) */
+int bitmap_range(bitmap_t *b, uint32_t lo, uint32_t hi)
+{
+        container_t *c;
+        uint32_t end;
+
+        for (; lo < hi; lo = end) {
+                end = ((lo >> 16) + 1) << 16;
+                if (!end || end > hi)
+                        end = hi;
+                if (!(c = append(b, lo >> 16)))
+                        return -1;
+                c->card = end - lo;
+                if (c->card <= BITMAP_ARRAYMAX) {
+                        if (!(c->array = malloc(c->card * sizeof(uint16_t))))
+                                return -1;
+                        for (uint32_t v = lo; v < end; ++v)
+                                c->array[v - lo] = v;
+                } else {
+                        if (!(c->bits = calloc(WORDS, sizeof(uint64_t))))
+                                return -1;
+                        c->bitset = 1;
+                        for (uint32_t v = lo; v < end; ++v)
+                                c->bits[(v & 0xffff) >> 6] |= 1ULL << (v & 63);
+                }
+        }
+        return 0;
+}
+
+
+/**
+ * @brief Intersect two bitmaps, container by container.
+ *
+ * @param dst : an empty bitmap, set to a & b
+ * @return int : 0 on success, -1 on error
+ */
+int bitmap_and(bitmap_t *dst, const bitmap_t *a, const bitmap_t *b)
+{
+        container_t *c;
+        uint32_t i = 0, j = 0;
+
+        while (i < a->n && j < b->n) {
+                if (a->c[i].key < b->c[j].key) {
+                        ++i;
+                } else if (a->c[i].key > b->c[j].key) {
+                        ++j;
+                } else {
+                        if (!(c = append(dst, a->c[i].key)) || cand(c, &a->c[i], &b->c[j]) < 0)
+                                return -1;
+                        if (!c->card)
+                                unappend(dst);
+                        ++i;
+                        ++j;
+                }
+        }
+        return 0;
+}
+
+
+/* dst, an empty bitmap, is set to a | b */
+int bitmap_or(bitmap_t *dst, const bitmap_t *a, const bitmap_t *b)
+{
+        container_t *c;
+        uint32_t i = 0, j = 0;
+        int ret;
+
+        while (i < a->n || j < b->n) {
+                if (j == b->n || (i < a->n && a->c[i].key < b->c[j].key)) {
+                        c = append(dst, a->c[i].key);
+                        ret = c ? copy(c, &a->c[i++]) : -1;
+                } else if (i == a->n || b->c[j].key < a->c[i].key) {
+                        c = append(dst, b->c[j].key);
+                        ret = c ? copy(c, &b->c[j++]) : -1;
+                } else {
+                        c = append(dst, a->c[i].key);
+                        ret = c ? cor(c, &a->c[i++], &b->c[j++]) : -1;
+                }
+                if (ret < 0)
+                        return -1;
+        }
+        return 0;
+}
+
+
+/* dst, an empty bitmap, is set to the members of a not in b */
+int bitmap_andnot(bitmap_t *dst, const bitmap_t *a, const bitmap_t *b)
+{
+        container_t *c;
+        uint32_t j = 0;
+        int ret;
+
+        for (uint32_t i = 0; i < a->n; ++i) {
+                while (j < b->n && b->c[j].key < a->c[i].key)
+                        ++j;
+                if (!(c = append(dst, a->c[i].key)))
+                        return -1;
+                if (j < b->n && b->c[j].key == a->c[i].key)
+                        ret = candnot(c, &a->c[i], &b->c[j]);
+                else
+                        ret = copy(c, &a->c[i]);
+                if (ret < 0)
+                        return -1;
+                if (!c->card)
+                        unappend(dst);
+        }
+        return 0;
+}
+
+
+uint32_t bitmap_card(const bitmap_t *b)
+{
+        uint32_t n = 0;
+
+        for (uint32_t i = 0; i < b->n; ++i)
+                n += b->c[i].card;
+        return n;
+}
+
+
+/**
+ * @brief List the members of a bitmap.
+ *
+ * @param ids : set to the members in ascending order, room for bitmap_card()
+ * @return uint32_t : number of members
+ */
+uint32_t bitmap_ids(const bitmap_t *b, uint32_t *ids)
+{
+        const container_t *c;
+        uint32_t n = 0, high;
+        uint64_t w;
+
+        for (uint32_t i = 0; i < b->n; ++i) {
+                c = &b->c[i];
+                high = (uint32_t) c->key << 16;
+                if (!c->bitset) {
+                        for (uint32_t k = 0; k < c->card; ++k)
+                                ids[n++] = high | c->array[k];
+                        continue;
+                }
+                for (int k = 0; k < WORDS; ++k) {
+                        for (w = c->bits[k]; w; w &= w - 1)
+                                ids[n++] = high | (k * 64 + __builtin_ctzll(w));
+                }
+        }
+        return n;
+}
@@ -0,0 +1,45 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+/*
+ * Compressed sets of record numbers, in the manner of roaring bitmaps.
+ *
+ * The 32-bit numbers are grouped by their high 16 bits. Each group is a
+ * container holding the low 16 bits of its members, either as a sorted
+ * array while there are at most BITMAP_ARRAYMAX of them, or as a 65536
+ * bit set past that. Sparse sets then cost two bytes a member, dense
+ * ones an eighth of a byte, and set operations work a container at a
+ * time, on words where both sides are bit sets.
+ */
+
+#define BITMAP_ARRAYMAX 4096
+
+typedef struct {
+        uint16_t key;                   /* high 16 bits of the members */
+        uint16_t bitset;                /* 1 if bits, 0 if array */
+        uint32_t card;
+        union {
+                uint16_t *array;
+                uint64_t *bits;
+        };
+} container_t;
+
+typedef struct {
+        container_t *c;                 /* in ascending key order */
+        uint32_t n;
+        uint32_t cap;
+} bitmap_t;
+
+void bitmap_init(bitmap_t *b);
+void bitmap_free(bitmap_t *b);
+int bitmap_from(bitmap_t *b, const uint32_t *ids, uint32_t n);
+int bitmap_range(bitmap_t *b, uint32_t lo, uint32_t hi);
+int bitmap_and(bitmap_t *dst, const bitmap_t *a, const bitmap_t *b);
+int bitmap_or(bitmap_t *dst, const bitmap_t *a, const bitmap_t *b);
+int bitmap_andnot(bitmap_t *dst, const bitmap_t *a, const bitmap_t *b);
+uint32_t bitmap_card(const bitmap_t *b);
+uint32_t bitmap_ids(const bitmap_t *b, uint32_t *ids);
+
+#endif
@@ -0,0 +1,447 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <utime.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "sched.h"
+#include "throttle.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define FNV_OFFSET      0xcbf29ce484222325ULL
+#define FNV_PRIME       0x100000001b3ULL
+
+typedef struct {
+        char name[NAME_MAX + 1];
+        time_t mtime;
+        off_t size;
+} entry_t;
+
+/* the files of one content id, ent[first] to ent[last] once sorted */
+typedef struct {
+        int first, last;
+        time_t mtime;                   /* of its latest archive */
+        int archived;                   /* not only lists */
+} group_t;
+
+
+int plist_add(plist_t *l, const char *path)
+{
+        char **p;
+        int cap;
+
+        if (l->n == l->cap) {
+                cap = l->cap ? l->cap * 2 : 64;
+                if (l->arena)
+                        p = arena_grow(l->arena, l->paths, l->cap * sizeof(char*), cap * sizeof(char*));
+                else
+                        p = realloc(l->paths, cap * sizeof(char*));
+                if (!p)
+                        return -1;
+                l->paths = p;
+                l->cap = cap;
+        }
+        l->paths[l->n] = l->arena ? arena_strdup(l->arena, path) : strdup(path);
+        if (!l->paths[l->n])
+                return -1;
+        ++l->n;
+        return 0;
+}
+
+
+/* the list is empty afterwards, and still draws from the same arena */
+void plist_free(plist_t *l)
+{
+        if (!l->arena) {
+                for (int i = 0; i < l->n; ++i)
+                        free(l->paths[i]);
+                free(l->paths);
+        }
+        l->paths = NULL;
+        l->n = l->cap = 0;
+}
+
+
+static int cmpstr(const void *a, const void *b)
+{
+        return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+
+/**
+ * @brief Drop from a list the files a client already holds. The manifest
+ * has one "path<TAB>size<TAB>mtime" line per file; a file is dropped when
+ * the copy here has the same size and modification time.
+ *
+ * @param l : the files to send
+ * @param manifest : what the client holds, modified in place
+ * @return int : number of files dropped, -1 on error
+ */
+int plist_skip(plist_t *l, char *manifest)
+{
+        char **held, *line, *tab, *save;
+        int nheld = 0, nskip = 0, n = 0;
+        long long size, mtime;
+        struct stat st;
+
+        for (line = manifest; (line = strchr(line, '\n')); ++line)
+                ++nheld;
+        if (!(held = malloc((nheld + 1) * sizeof(char*))))
+                return -1;
+
+        /* keep the path of each line, with size and mtime after its NUL */
+        nheld = 0;
+        for (line = strtok_r(manifest, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+                if (!(tab = strchr(line, '\t')))
+                        continue;
+                *tab = '\0';
+                held[nheld++] = line;
+        }
+        qsort(held, nheld, sizeof(char*), cmpstr);
+
+        for (int i = 0; i < l->n; ++i) {
+                char **h = bsearch(&l->paths[i], held, nheld, sizeof(char*), cmpstr);
+
+                if (h && sscanf(*h + strlen(*h) + 1, "%lld\t%lld", &size, &mtime) == 2 &&
+                    !stat(l->paths[i], &st) && st.st_size == size && st.st_mtime == mtime) {
+                        if (!l->arena)
+                                free(l->paths[i]);
+                        ++nskip;
+                        continue;
+                }
+                l->paths[n++] = l->paths[i];
+        }
+        l->n = n;
+
+        free(held);
+        return nskip;
+}
+
+
+static uint64_t fnv(uint64_t h, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+
+        while (len--) {
+                h ^= *p++;
+                h *= FNV_PRIME;
+        }
+        return h;
+}
+
+
+/*
+ * tar the n files named in list into path, through a temporary name; see cache_archive() for the result.
+ * A list of this builder's own is renamed to keep, if given, once the archive is complete.
+ */
+static int build(const char *list, const char *keep, const char *path, int n)
+{
+        char tmp[PATH_MAX], cmd[PATH_MAX * 3];
+        struct timespec t0, t1;
+        struct stat st;
+        int ret, wait;
+
+        /* tar opens every member */
+        throttle_opens(n);
+        if ((wait = sched_enter()) > 0) {
+                if (keep)
+                        unlink(list);
+                return wait;
+        }
+
+        snprintf(tmp, sizeof(tmp), "%s.%d.%lx", path, getpid(), (unsigned long) pthread_self());
+        snprintf(cmd, sizeof(cmd), "tar -czf %s -T %s", tmp, list);
+
+        trace_mark(TR_ARCHIVE_START, n);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ret = system(cmd);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        sched_leave();
+        trace_mark(TR_ARCHIVE_END, ret || stat(tmp, &st) ? 0 : st.st_size);
+        metrics_time(H_BUILD, t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+        if (ret) {
+                fprintf(stderr, "tar cmd failed!\n");
+                unlink(tmp);
+                if (keep)
+                        unlink(list);
+                return -1;
+        }
+
+        /*
+         * Concurrent builders of the same content all rename the same bytes,
+         * each from a list of its own; the list goes first, so that an
+         * archive in place always has its list.
+         */
+        if ((keep && rename(list, keep) < 0) || rename(tmp, path) < 0) {
+                unlink(tmp);
+                if (keep)
+                        unlink(list);
+                return -1;
+        }
+
+        cache_trim();
+        return 0;
+}
+
+
+/**
+ * @brief Get the archive of a set of files, building it unless the same
+ * set (same paths, sizes and modification times) is already cached.
+ *
+ * @param l : the files, sorted in place; those that no longer exist are dropped
+ * @param cid : set to the content id, CIDLEN + 1 bytes
+ * @param path : set to the path of the archive, PATH_MAX bytes
+ * @return int : 0 on success, -1 on error or if no file is left, or the
+ * seconds to wait before asking again when too many archives are being built
+ */
+int cache_archive(plist_t *l, char *cid, char *path)
+{
+        char list[PATH_MAX], tmp[PATH_MAX + 32];
+        uint64_t h = FNV_OFFSET, raw = 0;
+        struct stat st;
+        FILE *fp;
+        int n, ret;
+
+        qsort(l->paths, l->n, sizeof(char*), cmpstr);
+
+        /* the list may come from a stale index: drop what is gone */
+        for (int i = n = 0; i < l->n; ++i) {
+                if (stat(l->paths[i], &st) < 0) {
+                        if (!l->arena)
+                                free(l->paths[i]);
+                        continue;
+                }
+                h = fnv(h, l->paths[i], strlen(l->paths[i]) + 1);
+                h = fnv(h, &st.st_size, sizeof(st.st_size));
+                h = fnv(h, &st.st_mtime, sizeof(st.st_mtime));
+                raw += st.st_size;
+                l->paths[n++] = l->paths[i];
+        }
+        if (!(l->n = n))
+                return -1;
+        sprintf(cid, "%016llx", (unsigned long long) h);
+
+        snprintf(path, PATH_MAX, "%s/%s.tar.gz", CACHEDIR, cid);
+        if (!access(path, R_OK)) {
+                utime(path, NULL);      /* keep hot archives out of cache_trim() */
+                return 0;
+        }
+
+        mkdir(CACHEDIR, 0755);
+
+        /* the member list is kept next to the archive for cache_shard(), and only ever replaced whole */
+        snprintf(list, sizeof(list), "%s/%s.list", CACHEDIR, cid);
+        if (!access(list, R_OK)) {
+                ret = build(list, NULL, path, l->n);
+        } else {
+                snprintf(tmp, sizeof(tmp), "%s.%d.%lx", list, getpid(), (unsigned long) pthread_self());
+                if (!(fp = fopen(tmp, "w")))
+                        return -1;
+                for (int i = 0; i < l->n; ++i)
+                        fprintf(fp, "%s\n", l->paths[i]);
+                if (fclose(fp)) {
+                        unlink(tmp);
+                        return -1;
+                }
+                ret = build(tmp, list, path, l->n);
+        }
+
+        if (!ret && !stat(path, &st)) {
+                metrics_add(M_RAWBYTES, raw);
+                metrics_add(M_ARCHIVEBYTES, st.st_size);
+        }
+        return ret;
+}
+
+
+/**
+ * @brief Get the archive of every n-th member of a cached archive,
+ * starting at member i, so that n shards can travel and be extracted
+ * independently.
+ *
+ * @param path : set to the path of the shard, PATH_MAX bytes
+ * @return int : 0 on success, -1 if cid is unknown or on error, or the
+ * seconds to wait before asking again as for cache_archive()
+ */
+int cache_shard(const char *cid, int i, int n, char *path)
+{
+        char list[PATH_MAX], shard[PATH_MAX], tmp[PATH_MAX + 32], line[PATH_MAX];
+        FILE *in, *out;
+        int k = 0, m = 0;
+
+        if (i < 0 || n <= 0 || i >= n || strlen(cid) != CIDLEN || strchr(cid, '/'))
+                return -1;
+
+        snprintf(path, PATH_MAX, "%s/%s.%d-%d.tar.gz", CACHEDIR, cid, i, n);
+        if (!access(path, R_OK))
+                return 0;
+
+        snprintf(list, sizeof(list), "%s/%s.list", CACHEDIR, cid);
+        snprintf(shard, sizeof(shard), "%s/%s.%d-%d.list", CACHEDIR, cid, i, n);
+        if (!(in = fopen(list, "r")))
+                return -1;
+        if (!access(shard, R_OK)) {
+                while (fgets(line, sizeof(line), in))
+                        m += k++ % n == i;
+                fclose(in);
+                return build(shard, NULL, path, m);
+        }
+
+        snprintf(tmp, sizeof(tmp), "%s.%d.%lx", shard, getpid(), (unsigned long) pthread_self());
+        if (!(out = fopen(tmp, "w"))) {
+                fclose(in);
+                return -1;
+        }
+
+        while (fgets(line, sizeof(line), in)) {
+                if (k++ % n == i) {
+                        fputs(line, out);
+                        ++m;
+                }
+        }
+        fclose(in);
+        if (fclose(out)) {
+                unlink(tmp);
+                return -1;
+        }
+
+        return build(tmp, shard, path, m);
+}
+
+
+/* path of the archive for cid: 0 if it is cached, -1 otherwise */
+int cache_lookup(const char *cid, char *path)
+{
+        if (strlen(cid) != CIDLEN || strchr(cid, '/'))
+                return -1;
+
+        snprintf(path, PATH_MAX, "%s/%s.tar.gz", CACHEDIR, cid);
+        return access(path, R_OK);
+}
+
+
+/* number of members of the cached archive cid, -1 if unknown */
+int cache_count(const char *cid)
+{
+        char list[PATH_MAX], line[PATH_MAX];
+        FILE *fp;
+        int n = 0;
+
+        snprintf(list, sizeof(list), "%s/%s.list", CACHEDIR, cid);
+        if (!(fp = fopen(list, "r")))
+                return -1;
+        while (fgets(line, sizeof(line), fp))
+                ++n;
+        fclose(fp);
+        return n;
+}
+
+
+static int cmpname(const void *a, const void *b)
+{
+        return strcmp(((const entry_t *) a)->name, ((const entry_t *) b)->name);
+}
+
+
+static int cmpgroup(const void *a, const void *b)
+{
+        const group_t *x = a, *y = b;
+
+        return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+
+/* an archive of the cache or one of its lists: "<cid>.tar.gz", "<cid>.list", "<cid>.<i>-<n>.tar.gz"... */
+static int cached(const char *name)
+{
+        size_t len = strlen(name);
+
+        if (len <= CIDLEN || name[CIDLEN] != '.' || strspn(name, "0123456789abcdef") != CIDLEN)
+                return 0;
+        return (len > 7 && !strcmp(name + len - 7, ".tar.gz")) ||
+               (len > 5 && !strcmp(name + len - 5, ".list"));
+}
+
+
+/**
+ * @brief Remove the least recently used archives until the cache holds
+ * at most CACHEMAX bytes. An archive goes with its shards and their
+ * lists, and is as recent as the last time cache_archive() served it.
+ * The index and the archives still being built are never touched.
+ */
+void cache_trim(void)
+{
+        DIR *dir;
+        struct dirent *d;
+        struct stat st;
+        char path[PATH_MAX];
+        entry_t *ent = NULL, *p;
+        group_t *grp = NULL;
+        int n = 0, cap = 0, ngrp = 0;
+        long long total = 0;
+
+        if (!(dir = opendir(CACHEDIR)))
+                return;
+
+        while ((d = readdir(dir))) {
+                snprintf(path, sizeof(path), "%s/%s", CACHEDIR, d->d_name);
+                if (!cached(d->d_name) || stat(path, &st) || !S_ISREG(st.st_mode))
+                        continue;
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        if (!(p = realloc(ent, cap * sizeof(entry_t))))
+                                break;
+                        ent = p;
+                }
+                strcpy(ent[n].name, d->d_name);
+                ent[n].mtime = st.st_mtime;
+                ent[n].size = st.st_size;
+                total += st.st_size;
+                ++n;
+        }
+        closedir(dir);
+
+        /* the files of one content id sort next to each other */
+        qsort(ent, n, sizeof(entry_t), cmpname);
+        if (n && !(grp = malloc(n * sizeof(group_t))))
+                goto out;
+        for (int i = 0; i < n; ++i) {
+                if (!ngrp || strncmp(ent[i].name, ent[grp[ngrp - 1].first].name, CIDLEN)) {
+                        grp[ngrp].first = i;
+                        grp[ngrp].mtime = 0;
+                        grp[ngrp].archived = 0;
+                        ++ngrp;
+                }
+                grp[ngrp - 1].last = i;
+                if (strstr(ent[i].name, ".tar.gz")) {
+                        grp[ngrp - 1].archived = 1;
+                        if (ent[i].mtime > grp[ngrp - 1].mtime)
+                                grp[ngrp - 1].mtime = ent[i].mtime;
+                }
+        }
+
+        qsort(grp, ngrp, sizeof(group_t), cmpgroup);
+
+        for (int g = 0; g < ngrp && total > CACHEMAX; ++g) {
+                /* lists alone: an archive is being built from them */
+                if (!grp[g].archived)
+                        continue;
+                for (int i = grp[g].first; i <= grp[g].last; ++i) {
+                        snprintf(path, sizeof(path), "%s/%s", CACHEDIR, ent[i].name);
+                        if (!unlink(path))
+                                total -= ent[i].size;
+                }
+        }
+
+out:
+        free(grp);
+        free(ent);
+}
@@ -0,0 +1,38 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "arena.h"
+
+/*
+ * Archive cache shared by the requests of a node.
+ *
+ * Every archive is stored under .cache/<cid>.tar.gz, where the content id
+ * is a hash of the sorted member paths with their sizes and modification
+ * times: the same result set always maps to the same archive, which can
+ * then be served again, in byte ranges or in per-file shards.
+ */
+
+#define CACHEDIR        ".cache"
+#define CIDLEN          16              /* hex digits in a content id */
+#define CACHEMAX        (1LL << 30)     /* bytes kept before the oldest go */
+
+typedef struct {
+        char **paths;
+        int n;
+        int cap;
+        arena_t *arena;                 /* where paths come from, NULL for malloc() */
+} plist_t;
+
+int plist_add(plist_t *l, const char *path);
+void plist_free(plist_t *l);
+int plist_skip(plist_t *l, char *manifest);
+
+int cache_archive(plist_t *l, char *cid, char *path);
+int cache_shard(const char *cid, int i, int n, char *path);
+int cache_lookup(const char *cid, char *path);
+int cache_count(const char *cid);
+void cache_trim(void);
+
+#endif
@@ -6,46 +6,168 @@
 #include <netdb.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <setjmp.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <ftw.h>
+#include <limits.h>
+
+#include "proto.h"
+#include "net.h"
+#include "tune.h"
+#include "tls.h"
+#include "hash.h"
 
 #define BUSY            2
 #define ERR             -1
 #define OK              0
-#define FILE            1
+#define TARFILE         1       /* not FILE: that would shadow stdio */
+#define RETRY           3
 #define MAXLINE         128
-#define MAXSLEEP        128
-#define MAXARG          8
+#define MAXARG          32              /* words of a command line, a query needs a few */
 #define MAXFILESIZE     4096
+#define SPECWAIT        3000            /* ms to wait for a speculative connect */
+#define MIRRORCACHE     ".ftp_mirrors"  /* under $HOME */
+#define WINDOW          16              /* default requests in flight in batch mode */
+#define MINRANGE        (64 * 1024)     /* smallest byte range worth its own connection */
+#define PATH            "data"          /* the server's tree, as extracted here */
+#define CIDLEN          16              /* hex digits in a content id, as in cache.h */
+
+/* a request sent to the server whose response has not fully arrived */
+typedef struct {
+        uint32_t id;
+        int zip;
+        int ordered;            /* sent with FL_ORDERED */
+        int fd;                 /* archive being received, -1 until OP_FILE */
+        uint64_t left;          /* archive bytes still to come */
+        int done;
+        int op;                 /* OP_OK, OP_ERR, OP_META, OP_RETRY or OP_FILE once done */
+        char *text;             /* result of OP_OK, OP_ERR, OP_META and OP_RETRY */
+        uint64_t bytes;         /* payload received */
+        uint64_t got;           /* archive bytes on disk, where a resume starts */
+        char *req;              /* the request line, to send again after a reconnect */
+        char cid[32];           /* content id of the archive, "" if not resumable */
+        char part[MAXLINE];     /* the archive while it is arriving */
+        hash_state_t sum;       /* of the archive bytes of this response */
+        double start;           /* when the request was sent */
+        char *cmd;              /* the command, for batch reports */
+        char name[MAXLINE];
+} pending_t;
+
+/* one data connection of a parallel fetch */
+typedef struct {
+        rbuf_t rb;
+        int out;                /* where the bytes go */
+        off_t off;              /* ... and at which offset */
+        uint64_t left;          /* bytes still to come, once OP_FILE is in */
+        int started;            /* OP_FILE received */
+        hash_state_t sum;       /* checked against the OP_SUM trailer */
+        char name[MAXLINE];     /* shard file, extracted on its own */
+} stream_t;
 
 char new_host[MAXLINE], new_port[MAXLINE];
+int textmode;           /* -t: speak the legacy text protocol */
+int nstream = 1;        /* -n: connections an archive is fetched over */
+int fullcopy;           /* -F: extract every file, even those already here */
+int stored;             /* -r: archives uncompressed, made from the files as they go out */
+buf_t manifest;         /* files under PATH, while encode() lists them */
+char data_host[MAXLINE];        /* host serving this session, for data connections */
+char data_port[MAXLINE];        /* its port, to reconnect to after a drop */
 
-static int open_clientfd(char *hostname, char *port);
-static int connect_retry(int domain, int type, int protocol, const struct sockaddr *addr, socklen_t alen);
 static void handle_termination(int signum);
-static int parse(char *buf, char *argv[]);
 static char *packmsg(int argc, char *argv[], int *zip);
 static void waitmsg(int clientfd, int zip);
+static pending_t *recvframe(rbuf_t *rb, pending_t *pend, int npend);
+static void show(pending_t *p, int pos, int multi);
+static void collect(rbuf_t *rb, pending_t *pend, int npend);
+static void fetch(pending_t *p, int multi);
+static void track(pending_t *p, char *msg);
+static int reconnect(rbuf_t *rb, pending_t *pend, int npend);
+static int archival(const char *cmd);
+static int encode(buf_t *frame, char *msg, uint32_t id, int zip, int ordered);
+static int then(int *argc, char *argv[]);
+static int held(const char *fpath, const struct stat *st, int type);
+static int batch(rbuf_t *rb, FILE *in, int window);
+static double now(void);
+static int cmpdouble(const void *a, const void *b);
 static int hello(int clientfd);
+static int cache_lookup(char *host, char *port, char *mhost, char *mport, char *maddr);
+static void cache_store(char *host, char *port, int mirrorfd);
+static int speculate(char *host, char *port);
+static int redirect(char *host, char *port, int specfd);
 
 int main(int argc, char *argv[])
 {       
-        int i, clientfd;
+        int opt, clientfd;
         char *host, *port;
-        char cmdline[MAXLINE];
-        int argnum, zip;
+        char *cmdline = NULL;
+        size_t cmdsize = 0;
+        int argnum, zip, specfd, quit, npend, maxpend = 0, ordered;
         char *arglist[MAXARG];
-        char *msg;
+        char *msg, *cmd, *save;
+        uint32_t reqid = 0;
+        pending_t *pend = NULL;
+        buf_t frame;
+        rbuf_t rb;
+        char *script = NULL, *pem = NULL;
+        int window = WINDOW, ktls = 1;
+        FILE *in = stdin;
+
+        while ((opt = getopt(argc, argv, "tf:w:n:Fs:kr")) != -1) {
+                switch (opt) {
+                case 't':
+                        textmode = 1;
+                        break;
+                case 'f':
+                        script = optarg;
+                        break;
+                case 'w':
+                        window = atoi(optarg);
+                        break;
+                case 'n':
+                        nstream = atoi(optarg);
+                        break;
+                case 'F':
+                        fullcopy = 1;
+                        break;
+                case 's':
+                        pem = optarg;
+                        break;
+                case 'k':
+                        ktls = 0;
+                        break;
+                case 'r':
+                        stored = 1;
+                        break;
+                default:
+                        fprintf(stderr, "Invalid arguments!\n");
+                        return 1;
+                }
+        }
 
-        if (argc != 3) {
+        if (argc - optind != 2 || window < 1 || nstream < 1 || (script && textmode) || (nstream > 1 && textmode)) {
                 fprintf(stderr, "Invalid arguments!\n");
                 return 1;
         }
 
-        host = argv[1];
-        port = argv[2];
+        if (script && strcmp(script, "-") && !(in = fopen(script, "r"))) {
+                fprintf(stderr, "can't open %s\n", script);
+                return 1;
+        }
+
+        host = argv[optind];
+        port = argv[optind + 1];
 
         
+        if (tune_init("client") < 0)
+                fprintf(stderr, "some of %s ignored\n", TUNEFILE);
+        if (pem && tls_init(pem, 0, ktls) < 0) {
+                fprintf(stderr, "can't use %s for TLS\n", pem);
+                return 1;
+        }
+
         /* Register signal handler for termination signals. */
         signal(SIGINT, handle_termination);
         signal(SIGTERM, handle_termination);
@@ -58,53 +180,120 @@ int main(int argc, char *argv[])
         fprintf(stdout, "-----------------------------------------------------\n");
         fprintf(stdout, "Connected to the server (%s, %s) ; clientfd: %d\n", host, port, clientfd);
 
+        /* race a connection to the mirror we were sent to last time */
+        specfd = speculate(host, port);
+
+        strncpy(data_host, host, MAXLINE - 1);
+        strncpy(data_port, port, MAXLINE - 1);
         if (!hello(clientfd)){
                 printf("Connect to mirror (%s, %s)\n", new_host, new_port);
-                if ((clientfd = open_clientfd(new_host, new_port)) < 0) {
+                if ((clientfd = redirect(host, port, specfd)) < 0) {
                         return 2;
                 }
+                strcpy(data_host, new_host);
+                strcpy(data_port, new_port);
+        } else if (specfd >= 0) {
+                close(specfd);
+        }
+
+        if (rb_init(&rb, clientfd) < 0) {
+                fprintf(stderr, "out of memory\n");
+                return 2;
+        }
+        buf_init(&frame);
+
+        /* batch mode: run the script and report */
+        if (script) {
+                int failed = batch(&rb, in, window);
+                close(clientfd);
+                return failed ? 4 : 0;
         }
         
         /* Read command line arguments */
         while (1) {
-                memset(cmdline, 0, MAXLINE);
-                
                 fprintf(stdout, "$ ");
-                if (!fgets(cmdline, MAXLINE, stdin)) {
+                if (getline(&cmdline, &cmdsize, stdin) < 0) {
                         fprintf(stderr, "Read command line failed!\n");
                         return 3;
                 }
 
-                /* Parse command */
-                if ((argnum = parse(cmdline, arglist)) < 0) {
-                        fprintf(stderr, "parse from client %d: command not found.\n", clientfd);
-                        continue;
-                }
+                /* commands separated by ';' are sent back to back */
+                npend = quit = 0;
+                frame.len = 0;
+                for (cmd = strtok_r(cmdline, ";", &save); cmd && !quit; cmd = strtok_r(NULL, ";", &save)) {
 
-                if ((msg = packmsg(argnum, arglist, &zip))) {
+                        /* blank between two ';' */
+                        if (!cmd[strspn(cmd, " \t\r\n")])
+                                continue;
 
-                        /* send command to the server */
-                        if (send(clientfd, msg, strlen(msg), 0) < 0) {
-                                fprintf(stderr, "send failed!\n");
+                        /* Parse command */
+                        if ((argnum = proto_parse(cmd, arglist, MAXARG)) < 0) {
+                                fprintf(stderr, "parse from client %d: command not found.\n", clientfd);
+                                continue;
+                        }
+                        ordered = then(&argnum, arglist);
+
+                        if (!(msg = packmsg(argnum, arglist, &zip))) {
+                                fprintf(stderr, "packmsg: command not found.\n");
+                                continue;
+                        }
+                        quit = !strcmp(msg, "quit\n");
+
+                        if (textmode) {
+                                /* one command per round trip */
+                                if (send(clientfd, msg, strlen(msg), 0) < 0) {
+                                        fprintf(stderr, "send failed!\n");
+                                        free(msg);
+                                        close(clientfd);
+                                        exit(1);
+                                }
+                                if (!quit)
+                                        waitmsg(clientfd, zip);
                                 free(msg);
-                                close(clientfd);
+                                continue;
+                        }
+
+                        /* encode it as a frame */
+                        if (encode(&frame, msg, ++reqid, zip, ordered) < 0) {
+                                fprintf(stderr, "out of memory\n");
                                 exit(1);
                         }
 
-                        if (!strcmp(msg, "quit\n")) {
-                                fprintf(stdout, "Client %d is quitting.\n", clientfd);
+                        if (quit) {
                                 free(msg);
-                                close(clientfd);
-                                exit(0);        
+                                break;  /* nothing comes back for quit */
                         }
 
-                        free(msg);
-                        
-                        /* waiting for responses */
-                        waitmsg(clientfd, zip);
-                        
-                } else {
-                        fprintf(stderr, "packmsg: command not found.\n", clientfd);
+                        if (npend == maxpend) {
+                                maxpend = maxpend ? maxpend * 2 : 8;
+                                if (!(pend = realloc(pend, maxpend * sizeof(pending_t)))) {
+                                        fprintf(stderr, "out of memory\n");
+                                        exit(1);
+                                }
+                        }
+                        memset(&pend[npend], 0, sizeof(pending_t));
+                        pend[npend].id = reqid;
+                        pend[npend].zip = zip;
+                        pend[npend].ordered = ordered;
+                        pend[npend].fd = -1;
+                        track(&pend[npend], msg);
+                        ++npend;
+                }
+
+                /* send the commands to the server */
+                if (frame.len && send(rb.fd, frame.data, frame.len, 0) < 0) {
+                        fprintf(stderr, "send failed!\n");
+                        close(clientfd);
+                        exit(1);
+                }
+
+                /* waiting for responses, in whatever order they complete */
+                collect(&rb, pend, npend);
+
+                if (quit) {
+                        fprintf(stdout, "Client %d is quitting.\n", clientfd);
+                        close(rb.fd);
+                        exit(0);
                 }
         }
 
@@ -114,89 +303,6 @@ int main(int argc, char *argv[])
 }       
 
 
-/**
- * @brief Create a new client socket and connect to the server
- * 
- * @param hostname : hostname for the server to connect
- * @param port : port number for the server to connect
- */
-static int open_clientfd(char *hostname, char *port) {
-        int clientfd, err;
-        struct addrinfo *p, *listp;
-        struct addrinfo hints;
-
-        memset(&hints, 0, sizeof(struct addrinfo));
-        hints.ai_socktype = SOCK_STREAM;        /* TCP connection */
-        hints.ai_flags = AI_NUMERICSERV;        /* Using numeric port number */
-        hints.ai_flags |= AI_ADDRCONFIG;        /* Query for whichever address type is configured */
-
-        if ((err = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
-                fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(err));
-                exit(1);
-        }
-
-        /* Walk the list for one that we can successfully connect to */
-        for (p = listp; p; p = p->ai_next) {
-                if ((clientfd = connect_retry(p->ai_family, p->ai_socktype, p->ai_protocol, p->ai_addr, p->ai_addrlen)) < 0)
-                        err = errno;    /* Failed! Try the next one */
-                else 
-                        break;          /* Success */
-        }
-
-        freeaddrinfo(listp);
-
-        if (!p) {       /* All connects failed */
-                fprintf(stderr, "can't connect to %s\n", hostname);
-                return -1;
-        }
-
-        return clientfd;
-}
-
-
-
-/**
- * @brief Use the exponential backoff algorithm to keep trying
- * to connect to the server. If the call to connect fails, the
- * process goes to sleep for a short time and then tries again,
- * increasing the delay each time through the loop, up to a 
- * maximum delay of about 2 minutes.
- * 
- * @param domain: communication domain; this selects the protocol 
- * family which will be used for communication.
- * @param type : type of the socket (SOCK_STREAM for TCP protocol)
- * @param protocol : particular protocol if default protocol unused
- * @param addr : socket address of the server
- * @param alen : size of addr
- * @return int : If the connection or binding succeeds, zero is 
- * returned. On error, -1 is returned, and errno is set appropriately.
- * 
- */
-static int connect_retry(int domain, int type, int protocol, const struct sockaddr *addr, socklen_t alen) 
-{
-        int sockfd, numsec;
-
-        /* Try to connect with exponential backoff */
-        for (numsec = 1; numsec <= MAXSLEEP; numsec <<= 1) {
-                if ((sockfd = socket(domain, type, protocol)) < 0)
-                        return -1;
-
-                if (!connect(sockfd, addr, alen))
-                        /* Connection accepted */
-                        return sockfd;
-
-                close(sockfd);
-
-                /* Delay before trying again */
-                if (numsec <= MAXSLEEP / 2)
-                        sleep(numsec);
-        }
-
-        /* Failed! */
-        return -1;
-}
-
-
 static void handle_termination(int signum) {
         fprintf(stdout, "Client terminated!\n");
         exit(0);
@@ -204,48 +310,15 @@ static void handle_termination(int signum) {
 
 
 
-/**
- * @brief parse the command line
- *
- * @param buf : copy of the command line
- * @param argv : arguments list to be set
- * @return int : argc on success -1 otherwise
- */
-static int parse(char *buf, char *argv[])
-{
-        char *delim;        /* points to the first space delimiter */
-        int argc;           /* number of arguments */
-
-        /* replace trailing \n with space */
-        buf[strlen(buf) - 1] = ' ';
-
-        /* skipping leading spaces */
-        while (*buf && (*buf == ' ')) ++buf;
-
-        /* build the argv list */
-        argc = 0;
-        while ((delim = strchr(buf, ' '))) {
-                /* copy argument */
-                argv[argc++] = buf;
-                *delim = '\0';
-                buf = delim + 1;
-
-                /* skipping leading spaces */
-                while (*buf && (*buf == ' ')) ++buf;
-        }
-        argv[argc] = NULL;
-
-        /* blank line */
-        if (!argc) return -1;
-        
-        return argc;
-}
-
-
 static char *packmsg(int argc, char *argv[], int *zip)
 {
         int i;
-        char *msg = malloc(argc * MAXLINE);
+        size_t len = 2;
+        char *msg;
+
+        for (i = 0; i < argc; ++i)
+                len += strlen(argv[i]) + 1;
+        msg = malloc(len);
 
         /* default to zip the files */
         *zip = 1;
@@ -294,6 +367,100 @@ static char *packmsg(int argc, char *argv[], int *zip)
                 }
                 strcat(msg, "\n");
 
+        } else if (!strcmp(*argv, "findglob") || !strcmp(*argv, "findre")) {
+                /* findglob <pattern> | findre <regex> */
+                if (argc != 2)
+                        goto error;
+
+                sprintf(msg, "%s %s\n", argv[0], argv[1]);
+
+        } else if (!strcmp(*argv, "getglob") || !strcmp(*argv, "getre")) {
+                /* getglob <pattern> <-u> | getre <regex> <-u> */
+                if (argc < 2 || argc > 3)
+                        goto error;
+
+                if (argc == 3) {
+                        if (!strcmp(argv[2], "-u"))
+                                *zip = 0;
+                        else
+                                goto error;
+                }
+
+                sprintf(msg, "%s %s\n", argv[0], argv[1]);
+
+        } else if (!strcmp(*argv, "query") || !strcmp(*argv, "getquery")) {
+                /* query <expression> | getquery <expression> <-u> */
+                if (argc < 2)
+                        goto error;
+
+                strcpy(msg, argv[0]);
+                for (i = 1; i < argc; ++i) {
+                        if (i == argc - 1 && i > 1 && !strcmp(argv[0], "getquery") && !strcmp(argv[i], "-u")) {
+                                *zip = 0;
+                                break;
+                        }
+                        strcat(msg, " ");
+                        strcat(msg, argv[i]);
+                }
+                strcat(msg, "\n");
+
+        } else if (!strcmp(*argv, "list")) {
+                /* list <-n limit> <-c cursor> <command> <args>: the files it selects, a page at a time */
+                char *inner;
+
+                strcpy(msg, argv[0]);
+                for (i = 1; i + 1 < argc && (!strcmp(argv[i], "-n") || !strcmp(argv[i], "-c")); i += 2) {
+                        strcat(msg, " ");
+                        strcat(msg, argv[i]);
+                        strcat(msg, " ");
+                        strcat(msg, argv[i + 1]);
+                }
+                if (i == argc || !strcmp(argv[i], "list") || !strcmp(argv[i], "quit") ||
+                    !(inner = packmsg(argc - i, argv + i, zip)))
+                        goto error;
+                strcat(msg, " ");
+                strcat(msg, inner);
+                free(inner);
+
+        } else if (!strcmp(*argv, "hashfile")) {
+                /* hashfile <file1> ... <file6> */
+                if (argc < 2 || argc > 7)
+                        goto error;
+
+                strcpy(msg, argv[0]);
+                for (i = 1; i < argc; ++i) {
+                        strcat(msg, " ");
+                        strcat(msg, argv[i]);
+                }
+                strcat(msg, "\n");
+
+        } else if (!strcmp(*argv, "resume")) {
+                /* resume <cid> <-u>: finish the archive left in temp.<cid>.part */
+                struct stat st;
+                char part[MAXLINE];
+
+                if (textmode || argc < 2 || argc > 3 || strlen(argv[1]) > 31)
+                        goto error;
+                if (argc == 3) {
+                        if (!strcmp(argv[2], "-u"))
+                                *zip = 0;
+                        else
+                                goto error;
+                }
+
+                snprintf(part, sizeof(part), "temp.%s.part", argv[1]);
+                free(msg);
+                if (!(msg = malloc(MAXLINE)))
+                        return NULL;
+                sprintf(msg, "%s %s %lld\n", argv[0], argv[1], stat(part, &st) ? 0LL : (long long) st.st_size);
+
+        } else if (!strcmp(*argv, "stats")) {
+                /* stats: the counters and latency histograms of the node */
+                if (argc != 1)
+                        goto error;
+
+                strcpy(msg, "STATS\n");
+
         } else if (!strcmp(*argv, "quit")) {
                 if (argc != 1)
                         goto error;
@@ -324,7 +491,8 @@ static void waitmsg(int clientfd, int zip)
         int first = 1;
         int fsize = 0;
 
-        while ((nrecv = recv(clientfd, fp, sizeof(buf), 0)) > 0) {                
+        while ((nrecv = recv(clientfd, buf, sizeof(buf), 0)) > 0) {                
+                fp = buf;
                 if (first) {
                         if (nrecv > 3 && !strncmp(buf, "OK:", 3)) {
                                 status = OK;
@@ -332,12 +500,15 @@ static void waitmsg(int clientfd, int zip)
                         } else if (nrecv > 4 && !strncmp(buf, "ERR:", 4)) {
                                 status = ERR;
                                 break;
+                        } else if (nrecv > 12 && !strncmp(buf, "RETRY-AFTER:", 12)) {
+                                status = RETRY;
+                                break;
                         } else if (nrecv > 5) {
                                 char *p;
                                 p = strchr(buf, '\n');
                                 if (p && !strncmp(buf, "SIZE:", 5)) {
                                         *p = '\0';
-                                        status = FILE;
+                                        status = TARFILE;
                                         fsize = atoi(buf + 5);
                                         fp = p + 1;
                                         nrecv -= strlen(buf) + 1;
@@ -348,12 +519,15 @@ static void waitmsg(int clientfd, int zip)
                         }
                 }
 
-                if (status == FILE) {
+                if (status == TARFILE) {
+                        /* the trailer is not part of the archive */
+                        if (nrecv > fsize)
+                                nrecv = fsize;
                         write(fd, fp, nrecv);
                         fsize -= nrecv;
                 }
 
-                if (status == FILE && !fsize)
+                if (status == TARFILE && !fsize)
                         break;
         }
 
@@ -369,12 +543,16 @@ static void waitmsg(int clientfd, int zip)
                         fprintf(stderr, "%s\n", buf + 4);
                         unlink("temp.tar.gz");
                         break;
+                case RETRY:
+                        fprintf(stderr, "Server overloaded, retry after %s s\n", buf + 12);
+                        unlink("temp.tar.gz");
+                        break;
                 case OK:
                         /* print the result to the screen */
                         fprintf(stdout, "%s", buf + 3);
                         unlink("temp.tar.gz");
                         break;
-                case FILE:
+                case TARFILE:
                         if (!zip) {
                                 system("tar -xzf temp.tar.gz -C .");
                                 unlink("temp.tar.gz");
@@ -386,6 +564,723 @@ static void waitmsg(int clientfd, int zip)
         close(fd);
 }
 
+/**
+ * @brief Read one response frame and apply it to the request it belongs
+ * to. Responses to pipelined requests arrive in any order and archives
+ * arrive in pieces, interleaved with other responses. When the connection
+ * drops, the client reconnects and the requests still pending are sent
+ * again, archives being resumed from the bytes already on disk.
+ * 
+ * @param rb : reader over the connection
+ * @param pend : requests waiting for a response
+ * @param npend : number of entries in pend
+ * @return pending_t* : the request the frame completed, NULL if none
+ */
+static pending_t *recvframe(rbuf_t *rb, pending_t *pend, int npend)
+{
+        frame_t f;
+        pending_t *p = NULL;
+        char buf[MAXFILESIZE];
+        uint64_t fsize;
+        long nrecv;
+
+        if (rb_frame(rb, &f) <= 0)
+                goto lost;
+
+        for (int i = 0; i < npend && !p; ++i) {
+                if (pend[i].id == f.id && !pend[i].done)
+                        p = &pend[i];
+        }
+        if (!p) {
+                fprintf(stderr, "response 0x%x to unknown request %u\n", f.op, f.id);
+                goto errout;
+        }
+        p->bytes += f.len;
+
+        switch (f.op) {
+        case OP_OK:
+        case OP_ERR:
+        case OP_META:
+        case OP_RETRY:
+                if (!(p->text = malloc(f.len + 1)))
+                        goto errout;
+                if (rb_readn(rb, p->text, f.len) <= 0) {
+                        free(p->text);
+                        p->text = NULL;
+                        goto lost;
+                }
+                p->text[f.len] = '\0';
+                p->op = f.op;
+                p->done = 1;
+                free(p->req);
+                p->req = NULL;
+                return p;
+
+        case OP_ENTRIES:
+                /* a piece of a listing, printed as it comes in; batch mode only counts bytes */
+                while (f.len) {
+                        if ((nrecv = rb_read(rb, buf, f.len < sizeof(buf) ? f.len : sizeof(buf))) <= 0)
+                                goto lost;
+                        if (!p->cmd)
+                                fwrite(buf, 1, nrecv, stdout);
+                        f.len -= nrecv;
+                }
+                return NULL;
+
+        case OP_FILE:
+                /* the size, then the content id of a cached archive */
+                if (f.len < sizeof(uint64_t) || f.len > CIDLEN + sizeof(uint64_t))
+                        goto errout;
+                if (rb_readn(rb, &fsize, sizeof(uint64_t)) <= 0 ||
+                    (f.len > sizeof(uint64_t) && rb_readn(rb, buf, f.len - sizeof(uint64_t)) <= 0))
+                        goto lost;
+                p->left = be64toh(fsize);
+                memcpy(p->cid, buf, f.len - sizeof(uint64_t));
+                p->cid[f.len - sizeof(uint64_t)] = '\0';
+
+                /* the archive follows in OP_DATA frames */
+                if (npend > 1)
+                        sprintf(p->name, "temp.%u.%s", p->id, stored ? "tar" : "tar.gz");
+                else
+                        strcpy(p->name, stored ? "temp.tar" : "temp.tar.gz");
+
+                /* a resumable archive keeps a name of its own until it is complete */
+                if (p->cid[0])
+                        sprintf(p->part, "temp.%s.part", p->cid);
+                else
+                        strcpy(p->part, p->name);
+                if ((p->fd = open(p->part, O_RDWR | O_CREAT | (p->got ? 0 : O_TRUNC), 0644)) < 0 ||
+                    ftruncate(p->fd, p->got) < 0 || lseek(p->fd, p->got, SEEK_SET) < 0) {
+                        fprintf(stderr, "can't create %s\n", p->part);
+                        goto errout;
+                }
+                hash_reset(&p->sum, 0);
+                return NULL;
+
+        case OP_DATA:
+                if (p->fd < 0 || f.len > p->left)
+                        goto errout;
+                p->left -= f.len;
+                while (f.len) {
+                        if ((nrecv = rb_read(rb, buf, f.len < sizeof(buf) ? f.len : sizeof(buf))) <= 0)
+                                goto lost;
+                        write(p->fd, buf, nrecv);
+                        hash_update(&p->sum, buf, nrecv);
+                        p->got += nrecv;
+                        f.len -= nrecv;
+                }
+                return NULL;
+
+        case OP_SUM:
+                /* the trailer, once every byte is in */
+                if (p->fd < 0 || p->left || f.len != sizeof(uint64_t))
+                        goto errout;
+                if (rb_readn(rb, &fsize, sizeof(uint64_t)) <= 0)
+                        goto lost;
+                break;
+
+        default:
+                fprintf(stderr, "unexpected response 0x%x\n", f.op);
+                goto errout;
+        }
+
+        /* the whole archive is here */
+        close(p->fd);
+        p->fd = -1;
+        p->done = 1;
+        free(p->req);
+        p->req = NULL;
+
+        if (be64toh(fsize) != hash_digest(&p->sum)) {
+                /* corrupt: nothing of it can be trusted, not even for a resume */
+                unlink(p->part);
+                p->text = strdup("Checksum mismatch");
+                p->op = OP_ERR;
+                return p;
+        }
+        p->op = OP_FILE;
+
+        if (strcmp(p->part, p->name))
+                rename(p->part, p->name);
+
+        /* tar tells a stored archive from a compressed one by itself */
+        if (!p->zip) {
+                sprintf(buf, "tar -xf %s -C .", p->name);
+                system(buf);
+                unlink(p->name);
+        }
+        return p;
+
+lost:
+        if (!reconnect(rb, pend, npend))
+                return NULL;
+
+errout:
+        fprintf(stderr, "recv from server error\n");
+        close(rb->fd);
+        exit(1);
+}
+
+
+/**
+ * @brief Remember the request line of a pending request, to be able to
+ * send it again. A resume request also starts from the partial archive
+ * already on disk.
+ * 
+ * @param p : the pending request
+ * @param msg : its request line, owned by p from now on
+ */
+static void track(pending_t *p, char *msg)
+{
+        unsigned long long off;
+
+        p->req = msg;
+        if (sscanf(msg, "resume %31s %llu", p->cid, &off) == 2)
+                p->got = off;
+        else
+                p->cid[0] = '\0';
+}
+
+
+/**
+ * @brief Open a new connection to the node serving this session after the
+ * current one dropped, and send the requests still pending on it again.
+ * Archives that were partly received ask for the rest only, with resume;
+ * anything else starts over.
+ * 
+ * @param rb : reader over the connection, moved to the new one
+ * @param pend : requests waiting for a response
+ * @param npend : number of entries in pend
+ * @return int : 0 on success, -1 if the node can't be reached
+ */
+static int reconnect(rbuf_t *rb, pending_t *pend, int npend)
+{
+        char msg[MAXLINE];
+        buf_t frame;
+        int fd, ret = 0;
+
+        fprintf(stderr, "connection lost, reconnecting to (%s, %s)\n", data_host, data_port);
+        close(rb->fd);
+        rb_free(rb);
+
+        /* open_clientfd() already retries with an exponential backoff */
+        if ((fd = open_clientfd(data_host, data_port)) < 0 || rb_init(rb, fd) < 0)
+                return -1;
+
+        buf_init(&frame);
+        for (int i = 0; i < npend && !ret; ++i) {
+                pending_t *p = &pend[i];
+
+                if (p->done)
+                        continue;
+                if (p->fd >= 0) {
+                        close(p->fd);
+                        p->fd = -1;
+                }
+                p->left = 0;
+
+                if (p->cid[0]) {
+                        /* only the missing bytes */
+                        snprintf(msg, sizeof(msg), "resume %s %llu\n", p->cid, (unsigned long long) p->got);
+                        ret = proto_encode_line(&frame, msg, p->id, p->ordered ? FL_ORDERED : 0);
+                } else {
+                        p->got = 0;
+                        ret = encode(&frame, p->req, p->id, p->zip, p->ordered);
+                }
+        }
+
+        if (!ret && frame.len && send(fd, frame.data, frame.len, 0) < 0)
+                ret = -1;
+        buf_free(&frame);
+        return ret;
+}
+
+
+/**
+ * @brief Print the result of a completed request on the terminal.
+ * 
+ * @param pos : position of the command on its line
+ * @param multi : number the results when several commands were sent
+ */
+static void show(pending_t *p, int pos, int multi)
+{
+        FILE *out = p->op == OP_ERR || p->op == OP_RETRY ? stderr : stdout;
+
+        if (multi)
+                fprintf(out, "#%d ", pos);
+
+        switch (p->op) {
+        case OP_OK:
+                fprintf(out, "%s", p->text);
+                break;
+        case OP_ERR:
+                fprintf(out, "%s\n", p->text);
+                break;
+        case OP_RETRY:
+                fprintf(out, "Server overloaded, retry after %s s\n", p->text);
+                break;
+        case OP_FILE:
+                if (multi)
+                        fprintf(out, p->zip ? "saved %s\n" : "extracted %s\n", p->name);
+                break;
+        }
+
+        free(p->text);
+        p->text = NULL;
+}
+
+
+/* wait until every pending request has been answered */
+static void collect(rbuf_t *rb, pending_t *pend, int npend)
+{
+        pending_t *p;
+        int left = npend;
+
+        while (left) {
+                if ((p = recvframe(rb, pend, npend))) {
+                        if (p->op == OP_META)
+                                fetch(p, npend > 1);
+                        show(p, p - pend + 1, npend > 1);
+                        --left;
+                }
+        }
+}
+
+
+/**
+ * @brief Run the commands read from in without user interaction. Up to
+ * window requests are kept in flight; each result is written as soon as
+ * it completes, as one tab separated line:
+ * 
+ *      id  status  milliseconds  bytes  command  result
+ * 
+ * followed by a summary of the totals and latency percentiles on stderr.
+ * 
+ * @param rb : reader over the connection
+ * @param in : the commands, one per line
+ * @param window : maximum number of requests in flight
+ * @return int : number of commands that failed
+ */
+static int batch(rbuf_t *rb, FILE *in, int window)
+{
+        pending_t *pend, *p;
+        buf_t frame;
+        char *line = NULL, *msg, *arglist[MAXARG];
+        size_t linesize = 0;
+        int argc, zip, eof = 0, inflight = 0, nok = 0, nerr = 0, nfile = 0;
+        uint32_t reqid = 0;
+        uint64_t bytes = 0;
+        double *lat = NULL, begin, ms;
+        size_t nlat = 0, maxlat = 0;
+
+        if (!(pend = calloc(window, sizeof(pending_t)))) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+        }
+        for (int i = 0; i < window; ++i)
+                pend[i].done = 1;       /* free slot */
+
+        buf_init(&frame);
+        begin = now();
+
+        while (!eof || inflight) {
+
+                /* top the window up */
+                while (!eof && inflight < window) {
+                        if (getline(&line, &linesize, in) < 0) {
+                                eof = 1;
+                                break;
+                        }
+
+                        line[strcspn(line, "\r\n")] = '\0';
+                        if (!line[strspn(line, " \t")] || line[strspn(line, " \t")] == '#')
+                                continue;       /* blank or comment */
+
+                        for (p = pend; !p->done; ++p)
+                                ;
+                        memset(p, 0, sizeof(pending_t));
+                        p->fd = -1;
+                        p->cmd = strdup(line);
+
+                        if ((argc = proto_parse(line, arglist, MAXARG)) >= 0)
+                                p->ordered = then(&argc, arglist);
+                        if (argc < 0 || !(msg = packmsg(argc, arglist, &zip)) || !strcmp(msg, "quit\n")) {
+                                if (argc >= 0 && msg)
+                                        free(msg);
+                                fprintf(stdout, "-\terr\t0.000\t0\t%s\tcommand not found\n", p->cmd);
+                                free(p->cmd);
+                                p->done = 1;
+                                ++nerr;
+                                continue;
+                        }
+
+                        p->id = ++reqid;
+                        p->zip = zip;
+                        if (encode(&frame, msg, p->id, zip, p->ordered) < 0) {
+                                fprintf(stderr, "out of memory\n");
+                                exit(1);
+                        }
+                        track(p, msg);
+                        p->start = now();
+                        ++inflight;
+                }
+
+                /* send everything queued since the last round */
+                if (frame.len) {
+                        if (send(rb->fd, frame.data, frame.len, 0) < 0) {
+                                fprintf(stderr, "send failed!\n");
+                                exit(1);
+                        }
+                        frame.len = 0;
+                }
+
+                if (!inflight || !(p = recvframe(rb, pend, window)))
+                        continue;
+
+                /* one more request is complete */
+                if (p->op == OP_META)
+                        fetch(p, 1);
+                --inflight;
+                ms = (now() - p->start) * 1e3;
+                bytes += p->bytes;
+
+                if (nlat == maxlat) {
+                        maxlat = maxlat ? maxlat * 2 : 1024;
+                        if (!(lat = realloc(lat, maxlat * sizeof(double)))) {
+                                fprintf(stderr, "out of memory\n");
+                                exit(1);
+                        }
+                }
+                lat[nlat++] = ms;
+
+                if (p->op == OP_ERR || p->op == OP_RETRY)
+                        ++nerr;
+                else if (p->op == OP_FILE)
+                        ++nfile;
+                else
+                        ++nok;
+
+                if (p->text)
+                        p->text[strcspn(p->text, "\n")] = '\0';
+                fprintf(stdout, "%u\t%s\t%.3f\t%llu\t%s\t%s\n", p->id,
+                        p->op == OP_ERR ? "err" : p->op == OP_RETRY ? "retry" : p->op == OP_FILE ? "file" : "ok",
+                        ms, (unsigned long long) p->bytes, p->cmd,
+                        p->op == OP_FILE ? (p->zip ? p->name : "extracted") : p->text);
+                fflush(stdout);
+
+                free(p->text);
+                free(p->cmd);
+                p->text = p->cmd = NULL;
+        }
+
+        /* summary */
+        ms = (now() - begin) * 1e3;
+        qsort(lat, nlat, sizeof(double), cmpdouble);
+        fprintf(stderr, "commands: %d (ok %d, file %d, err %d)\n", nok + nfile + nerr, nok, nfile, nerr);
+        fprintf(stderr, "elapsed: %.3f ms, %.1f commands/s, %.3f MB received\n", ms,
+                nlat ? nlat / (ms / 1e3) : 0.0, bytes / 1e6);
+        if (nlat) {
+                fprintf(stderr, "latency ms: min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+                        lat[0], lat[nlat / 2], lat[nlat * 90 / 100], lat[nlat * 99 / 100], lat[nlat - 1]);
+        }
+
+        free(lat);
+        free(line);
+        free(pend);
+        buf_free(&frame);
+        return nerr;
+}
+
+
+/* archive commands: fetched over several connections, synced with a manifest */
+static int archival(const char *cmd)
+{
+        return !strncmp(cmd, "sgetfiles ", 10) || !strncmp(cmd, "dgetfiles ", 10) ||
+               !strncmp(cmd, "getfiles ", 9) || !strncmp(cmd, "gettargz ", 9) ||
+               !strncmp(cmd, "getglob ", 8) || !strncmp(cmd, "getre ", 6) ||
+               !strncmp(cmd, "getquery ", 9);
+}
+
+
+/**
+ * @brief Fetch an archive the server has prepared, as described by its
+ * OP_META answer, over up to nstream new connections. Archives that are
+ * kept zipped are cut into byte ranges written in place into one file;
+ * with -u every connection gets a shard of the files instead, a complete
+ * archive of its own that is extracted as soon as it is in. The request
+ * ends up as OP_FILE, or as OP_ERR if any connection failed.
+ * 
+ * @param p : the request answered with OP_META
+ * @param multi : name the archive after the request id
+ */
+static void fetch(pending_t *p, int multi)
+{
+        char cid[32], dport[MAXLINE], msg[MAXLINE], buf[MAXFILESIZE];
+        unsigned long long size;
+        int nfiles, n, fd, failed = 0;
+        uint64_t fsize;
+        off_t span;
+        long nrecv;
+        stream_t *st;
+        struct pollfd *pfd;
+        buf_t frame;
+        frame_t f;
+
+        if (sscanf(p->text, "%31s %llu %d %127s", cid, &size, &nfiles, dport) != 4) {
+                fprintf(stderr, "bad archive description: %s\n", p->text);
+                goto errout;
+        }
+
+        if (multi)
+                sprintf(p->name, "temp.%u.tar.gz", p->id);
+        else
+                strcpy(p->name, "temp.tar.gz");
+
+        /* no more connections than there are shards or ranges worth it */
+        n = nstream;
+        if (!p->zip && n > nfiles)
+                n = nfiles;
+        if (p->zip && (unsigned long long) n * MINRANGE > size)
+                n = size / MINRANGE ? size / MINRANGE : 1;
+        span = (size + n - 1) / n;
+
+        st = calloc(n, sizeof(stream_t));
+        pfd = calloc(n, sizeof(struct pollfd));
+        if (!st || !pfd) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+        }
+
+        for (int i = 0; i < n; ++i)
+                pfd[i].fd = -1;
+
+        fd = -1;
+        if (p->zip) {
+                if ((fd = open(p->name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+                    ftruncate(fd, size) < 0) {
+                        fprintf(stderr, "can't create %s\n", p->name);
+                        goto errout;
+                }
+        }
+
+        /* open the data connections and ask each for its part */
+        buf_init(&frame);
+        for (int i = 0; i < n; ++i) {
+                if ((pfd[i].fd = open_clientfd(data_host, dport)) < 0 || rb_init(&st[i].rb, pfd[i].fd) < 0) {
+                        failed = 1;
+                        break;
+                }
+                pfd[i].events = POLLIN;
+
+                if (p->zip) {
+                        st[i].out = fd;
+                        st[i].off = i * span;
+                        sprintf(msg, "getrange %s %lld %lld\n", cid, (long long) (i * span), (long long) span);
+                } else {
+                        sprintf(st[i].name, "temp.%u.%d.tar.gz", p->id, i);
+                        if ((st[i].out = open(st[i].name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+                                fprintf(stderr, "can't create %s\n", st[i].name);
+                                failed = 1;
+                                break;
+                        }
+                        sprintf(msg, "getshard %s %d %d\n", cid, i, n);
+                }
+
+                frame.len = 0;
+                if (proto_encode_line(&frame, msg, i + 1, 0) < 0 ||
+                    send(pfd[i].fd, frame.data, frame.len, 0) < 0) {
+                        failed = 1;
+                        break;
+                }
+        }
+        buf_free(&frame);
+
+        /* receive the parts in whatever order they come */
+        for (int left = n; left && !failed; ) {
+                if (poll(pfd, n, -1) < 0) {
+                        failed = 1;
+                        break;
+                }
+
+                for (int i = 0; i < n && !failed; ++i) {
+                        if (pfd[i].fd < 0 || !pfd[i].revents)
+                                continue;
+
+                        /* frames already buffered in rb raise no poll event */
+                        do {
+                                if (rb_frame(&st[i].rb, &f) <= 0) {
+                                        failed = 1;
+                                        break;
+                                }
+                                p->bytes += f.len;
+
+                                if (f.op == OP_FILE && !st[i].started && f.len >= sizeof(uint64_t) &&
+                                    f.len <= sizeof(buf) && rb_readn(&st[i].rb, buf, f.len) > 0) {
+                                        memcpy(&fsize, buf, sizeof(uint64_t));
+                                        st[i].left = be64toh(fsize);
+                                        st[i].started = 1;
+                                        hash_reset(&st[i].sum, 0);
+                                } else if (f.op == OP_DATA && st[i].started && f.len <= st[i].left) {
+                                        st[i].left -= f.len;
+                                        while (f.len) {
+                                                if ((nrecv = rb_read(&st[i].rb, buf, f.len < sizeof(buf) ? f.len : sizeof(buf))) <= 0 ||
+                                                    pwrite(st[i].out, buf, nrecv, st[i].off) != nrecv) {
+                                                        failed = 1;
+                                                        break;
+                                                }
+                                                hash_update(&st[i].sum, buf, nrecv);
+                                                st[i].off += nrecv;
+                                                f.len -= nrecv;
+                                        }
+                                } else if (f.op == OP_SUM && st[i].started && !st[i].left &&
+                                           f.len == sizeof(uint64_t) && rb_readn(&st[i].rb, &fsize, f.len) > 0) {
+                                        if (be64toh(fsize) != hash_digest(&st[i].sum)) {
+                                                fprintf(stderr, "checksum mismatch on stream %d\n", i);
+                                                failed = 1;
+                                        }
+                                } else {
+                                        failed = 1;
+                                }
+
+                                if (failed || f.op != OP_SUM)
+                                        continue;       /* next frame, if buffered */
+
+                                /* this part is complete */
+                                rb_free(&st[i].rb);
+                                close(pfd[i].fd);
+                                pfd[i].fd = -1;
+                                --left;
+                                if (!p->zip) {
+                                        close(st[i].out);
+                                        sprintf(buf, "tar -xzf %s -C .", st[i].name);
+                                        system(buf);
+                                        unlink(st[i].name);
+                                        st[i].name[0] = '\0';
+                                }
+                        } while (!failed && pfd[i].fd >= 0 && st[i].rb.end > st[i].rb.start);
+                }
+        }
+
+        for (int i = 0; i < n; ++i) {
+                if (pfd[i].fd >= 0) {
+                        rb_free(&st[i].rb);
+                        close(pfd[i].fd);
+                }
+                if (!p->zip && st[i].name[0]) {
+                        close(st[i].out);
+                        unlink(st[i].name);
+                }
+        }
+        if (fd >= 0)
+                close(fd);
+        free(st);
+        free(pfd);
+
+        if (failed) {
+                if (p->zip)
+                        unlink(p->name);
+                goto errout;
+        }
+
+        free(p->text);
+        p->text = NULL;
+        p->op = OP_FILE;
+        return;
+
+errout:
+        free(p->text);
+        p->text = strdup("Parallel fetch failed");
+        p->op = OP_ERR;
+}
+
+
+/**
+ * @brief Encode a request line as a frame. Archive requests are flagged to
+ * be prepared for a parallel fetch when there are several streams, or to
+ * come uncompressed with -r on a single one, and those that extract carry the manifest of the files already under PATH,
+ * so that only new or changed files are sent.
+ * 
+ * @param frame : the frame is appended here
+ * @param msg : the request line
+ * @param id : request id
+ * @param zip : 0 if the archive gets extracted
+ * @param ordered : the server must answer every earlier request first
+ * @return int : 0 on success, -1 on error
+ */
+static int encode(buf_t *frame, char *msg, uint32_t id, int zip, int ordered)
+{
+        size_t start = frame->len;
+        int flags = ordered ? FL_ORDERED : 0, sync;
+
+        if (!archival(msg))
+                return proto_encode_line(frame, msg, id, flags);
+
+        if (nstream > 1)
+                flags |= FL_PREPARE;
+        else if (stored)
+                flags |= FL_STORED;
+
+        /* list what is here; an empty tree needs no manifest */
+        manifest.len = 0;
+        sync = !zip && !fullcopy && !ftw(PATH, held, 20) && manifest.len;
+        if (sync)
+                flags |= FL_MANIFEST;
+
+        if (proto_encode_line(frame, msg, id, flags) < 0)
+                return -1;
+        if (sync) {
+                if (frame_arg(frame, TLV_BLOB, manifest.data, manifest.len) < 0)
+                        return -1;
+                frame_end(frame, start);
+        }
+        return 0;
+}
+
+
+/* strip a leading "then" off a command: it waits for the ones sent before it */
+static int then(int *argc, char *argv[])
+{
+        if (*argc < 2 || strcmp(argv[0], "then"))
+                return 0;
+        memmove(argv, argv + 1, *argc * sizeof(char*));
+        --*argc;
+        return 1;
+}
+
+
+/* ftw callback: add a file to the manifest, as "path<TAB>size<TAB>mtime" */
+static int held(const char *fpath, const struct stat *st, int type)
+{
+        char line[PATH_MAX + 64];
+        int n;
+
+        if (type != FTW_F)
+                return 0;
+        n = snprintf(line, sizeof(line), "%s\t%lld\t%lld\n", fpath,
+                     (long long) st->st_size, (long long) st->st_mtime);
+        if (n < 0 || n >= (int) sizeof(line))
+                return 0;
+        return buf_put(&manifest, line, n);
+}
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int cmpdouble(const void *a, const void *b)
+{
+        double x = *(const double*) a, y = *(const double*) b;
+
+        return (x > y) - (x < y);
+}
+
+
 static int hello(int clientfd)
 {
         int nrecv;
@@ -431,3 +1326,164 @@ static int hello(int clientfd)
                 exit(1);
         }          
 }
+
+
+/**
+ * @brief Look up the mirror that host:port redirected us to last time.
+ * 
+ * @param mhost, mport : mirror as announced in BUSY:host port
+ * @param maddr : numeric address the mirror name resolved to
+ * @return int : 1 if an entry was found, 0 otherwise.
+ */
+static int cache_lookup(char *host, char *port, char *mhost, char *mport, char *maddr)
+{
+        FILE *fp;
+        char path[MAXLINE * 2], line[MAXLINE * 5];
+        char h[MAXLINE], p[MAXLINE];
+        int found = 0;
+
+        if (!getenv("HOME"))
+                return 0;
+        snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), MIRRORCACHE);
+
+        if (!(fp = fopen(path, "r")))
+                return 0;
+
+        /* each line: host port mirror_host mirror_port mirror_addr */
+        while (!found && fgets(line, sizeof(line), fp)) {
+                if (sscanf(line, "%127s %127s %127s %127s %127s", h, p, mhost, mport, maddr) == 5)
+                        found = !strcmp(h, host) && !strcmp(p, port);
+        }
+
+        fclose(fp);
+        return found;
+}
+
+
+/**
+ * @brief Remember the numeric address of the mirror we are connected to,
+ * so the next redirect from host:port skips DNS and can be raced.
+ * 
+ * @param mirrorfd : socket connected to the mirror
+ */
+static void cache_store(char *host, char *port, int mirrorfd)
+{
+        FILE *in, *out;
+        char path[MAXLINE * 2], tmp[MAXLINE * 2 + 8], line[MAXLINE * 5];
+        char h[MAXLINE], p[MAXLINE], maddr[MAXLINE];
+        struct sockaddr_storage addr;
+        socklen_t alen = sizeof(struct sockaddr_storage);
+
+        if (!getenv("HOME"))
+                return;
+        if (getpeername(mirrorfd, (struct sockaddr*)&addr, &alen) < 0)
+                return;
+        if (getnameinfo((struct sockaddr*)&addr, alen, maddr, MAXLINE, NULL, 0, NI_NUMERICHOST))
+                return;
+
+        snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), MIRRORCACHE);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+        if (!(out = fopen(tmp, "w")))
+                return;
+
+        /* copy every other server's entry, then append ours */
+        if ((in = fopen(path, "r"))) {
+                while (fgets(line, sizeof(line), in)) {
+                        if (sscanf(line, "%127s %127s", h, p) == 2 && !strcmp(h, host) && !strcmp(p, port))
+                                continue;
+                        fputs(line, out);
+                }
+                fclose(in);
+        }
+        fprintf(out, "%s %s %s %s %s\n", host, port, new_host, new_port, maddr);
+
+        fclose(out);
+        rename(tmp, path);
+}
+
+
+/**
+ * @brief Start a non-blocking connect to the mirror cached for host:port,
+ * so that it overlaps the HELLO round trip with the server.
+ * 
+ * @return int : the connecting socket, or -1 if nothing is cached.
+ */
+static int speculate(char *host, char *port)
+{
+        int fd, err;
+        char mhost[MAXLINE], mport[MAXLINE], maddr[MAXLINE];
+        struct addrinfo *listp, hints;
+
+        if (!cache_lookup(host, port, mhost, mport, maddr))
+                return -1;
+
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;       /* never touches DNS */
+
+        if ((err = getaddrinfo(maddr, mport, &hints, &listp)) != 0)
+                return -1;
+
+        if ((fd = socket(listp->ai_family, listp->ai_socktype, listp->ai_protocol)) < 0)
+                goto out;
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+        if (connect(fd, listp->ai_addr, listp->ai_addrlen) < 0 && errno != EINPROGRESS) {
+                close(fd);
+                fd = -1;
+        }
+
+out:
+        freeaddrinfo(listp);
+        return fd;
+}
+
+
+/**
+ * @brief Connect to the mirror announced by the server in BUSY. The
+ * speculative connection is used when it went to the same mirror;
+ * otherwise the cached numeric address, and only then DNS, is tried.
+ * 
+ * @param specfd : socket returned by speculate(), or -1
+ * @return int : socket connected to the mirror, or -1 on error.
+ */
+static int redirect(char *host, char *port, int specfd)
+{
+        int fd = -1, err = 0;
+        char mhost[MAXLINE], mport[MAXLINE], maddr[MAXLINE];
+        socklen_t len = sizeof(int);
+        struct pollfd pfd;
+
+        if (!cache_lookup(host, port, mhost, mport, maddr) ||
+            strcmp(mhost, new_host) || strcmp(mport, new_port)) {
+                /* the mirror moved: the cached entry is useless */
+                maddr[0] = '\0';
+                if (specfd >= 0) {
+                        close(specfd);
+                        specfd = -1;
+                }
+        }
+
+        if (specfd >= 0) {
+                pfd.fd = specfd;
+                pfd.events = POLLOUT;
+                if (poll(&pfd, 1, SPECWAIT) == 1 &&
+                    !getsockopt(specfd, SOL_SOCKET, SO_ERROR, &err, &len) && !err) {
+                        fcntl(specfd, F_SETFL, fcntl(specfd, F_GETFL, 0) & ~O_NONBLOCK);
+                        tune_socket(specfd, maddr);
+                        printf("Reusing the speculative connection to the mirror.\n");
+                        return tls_connect(specfd, maddr);
+                }
+                close(specfd);
+        }
+
+        if (maddr[0])
+                fd = open_clientfd(maddr, new_port);
+        if (fd < 0 && (fd = open_clientfd(new_host, new_port)) < 0)
+                return -1;
+
+        cache_store(host, port, fd);
+        return fd;
+}
@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+
+#define P1              11400714785074694791ULL
+#define P2              14029467366897019727ULL
+#define P3              1609587929392839161ULL
+#define P4              9650029242287828579ULL
+#define P5              2870177450012600261ULL
+
+#define PROBE           8               /* slots tried before one is evicted */
+#define MAPCHUNK        (64L << 20)     /* bytes of a file mapped at a time */
+
+typedef struct {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        uint64_t hash;
+        int used;
+} slot_t;
+
+typedef struct {
+        pthread_mutex_t lock;           /* process shared, robust */
+        slot_t slots[HASHSLOTS];
+} table_t;
+
+/* a set of files hashed by several threads */
+typedef struct {
+        char **paths;
+        uint64_t *h;
+        char *bad;
+        int n;
+        int next;
+        int failed;
+} work_t;
+
+static table_t *table;
+
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+        return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t read64(const unsigned char *p)
+{
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return le64toh(v);
+}
+
+
+static inline uint32_t read32(const unsigned char *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return le32toh(v);
+}
+
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+        acc += input * P2;
+        acc = rotl(acc, 31);
+        return acc * P1;
+}
+
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val)
+{
+        acc ^= round64(0, val);
+        return acc * P1 + P4;
+}
+
+
+/* consume whole stripes; the four lanes do not depend on each other */
+static const unsigned char *stripes(uint64_t v[4], const unsigned char *p, const unsigned char *end)
+{
+        uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+
+        while (p + 32 <= end) {
+                v1 = round64(v1, read64(p));
+                v2 = round64(v2, read64(p + 8));
+                v3 = round64(v3, read64(p + 16));
+                v4 = round64(v4, read64(p + 24));
+                p += 32;
+        }
+
+        v[0] = v1;
+        v[1] = v2;
+        v[2] = v3;
+        v[3] = v4;
+        return p;
+}
+
+
+void hash_reset(hash_state_t *s, uint64_t seed)
+{
+        memset(s, 0, sizeof(*s));
+        s->seed = seed;
+        s->v[0] = seed + P1 + P2;
+        s->v[1] = seed + P2;
+        s->v[2] = seed;
+        s->v[3] = seed - P1;
+}
+
+
+void hash_update(hash_state_t *s, const void *data, size_t len)
+{
+        const unsigned char *p = data, *end = p + len;
+        size_t fill;
+
+        s->total += len;
+
+        /* complete the stripe left over from the last call */
+        if (s->memsize) {
+                fill = 32 - s->memsize;
+                if (len < fill) {
+                        memcpy(s->mem + s->memsize, p, len);
+                        s->memsize += len;
+                        return;
+                }
+                memcpy(s->mem + s->memsize, p, fill);
+                stripes(s->v, s->mem, s->mem + 32);
+                p += fill;
+                s->memsize = 0;
+        }
+
+        p = stripes(s->v, p, end);
+
+        if (p < end) {
+                memcpy(s->mem, p, end - p);
+                s->memsize = end - p;
+        }
+}
+
+
+uint64_t hash_digest(const hash_state_t *s)
+{
+        const unsigned char *p = s->mem, *end = p + s->memsize;
+        uint64_t h;
+
+        if (s->total >= 32) {
+                h = rotl(s->v[0], 1) + rotl(s->v[1], 7) + rotl(s->v[2], 12) + rotl(s->v[3], 18);
+                for (int i = 0; i < 4; ++i)
+                        h = merge64(h, s->v[i]);
+        } else {
+                h = s->seed + P5;
+        }
+        h += s->total;
+
+        for (; p + 8 <= end; p += 8) {
+                h ^= round64(0, read64(p));
+                h = rotl(h, 27) * P1 + P4;
+        }
+        if (p + 4 <= end) {
+                h ^= (uint64_t) read32(p) * P1;
+                h = rotl(h, 23) * P2 + P3;
+                p += 4;
+        }
+        for (; p < end; ++p) {
+                h ^= *p * P5;
+                h = rotl(h, 11) * P1;
+        }
+
+        /* avalanche */
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+}
+
+
+uint64_t hash_buf(const void *data, size_t len, uint64_t seed)
+{
+        hash_state_t s;
+
+        hash_reset(&s, seed);
+        hash_update(&s, data, len);
+        return hash_digest(&s);
+}
+
+
+/**
+ * @brief Set up the table of file hashes shared by this process and the
+ * children it forks afterwards.
+ *
+ * @return int : 0 on success, -1 on error
+ */
+int hash_init(void)
+{
+        pthread_mutexattr_t attr;
+
+        table = mmap(NULL, sizeof(table_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+                table = NULL;
+                return -1;
+        }
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&table->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        return 0;
+}
+
+
+static int same(const slot_t *e, const struct stat *st)
+{
+        return e->used && e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+               e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+static slot_t *find(const struct stat *st, int evict)
+{
+        uint64_t key[2] = { st->st_dev, st->st_ino };
+        size_t first = hash_buf(key, sizeof(key), 0) % HASHSLOTS, i;
+
+        for (int k = 0; k < PROBE; ++k) {
+                i = (first + k) % HASHSLOTS;
+                if (same(&table->slots[i], st) ||
+                    (evict && (!table->slots[i].used || (table->slots[i].dev == st->st_dev &&
+                                                         table->slots[i].ino == st->st_ino))))
+                        return &table->slots[i];
+        }
+        return evict ? &table->slots[first] : NULL;
+}
+
+
+/*
+ * Take the table lock. A process that died holding it may have left a
+ * slot half written, with the hash of another file: the table is only a
+ * cache, so it starts over empty.
+ */
+static void lock(void)
+{
+        if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+                memset(table->slots, 0, sizeof(table->slots));
+                pthread_mutex_consistent(&table->lock);
+        }
+}
+
+
+/* the hash of the file as it is in st, if some process of the node has it: 0, -1 otherwise */
+int hash_known(const struct stat *st, uint64_t *h)
+{
+        slot_t *e;
+
+        if (!table)
+                return -1;
+
+        lock();
+        if ((e = find(st, 0)))
+                *h = e->hash;
+        pthread_mutex_unlock(&table->lock);
+        return e ? 0 : -1;
+}
+
+
+/* remember the hash of the file as it is in st, for every process of the node */
+void hash_remember(const struct stat *st, uint64_t h)
+{
+        slot_t *e;
+
+        if (!table)
+                return;
+
+        lock();
+        e = find(st, 1);
+        e->dev = st->st_dev;
+        e->ino = st->st_ino;
+        e->size = st->st_size;
+        e->mtime = st->st_mtim;
+        e->hash = h;
+        e->used = 1;
+        pthread_mutex_unlock(&table->lock);
+}
+
+
+/**
+ * @brief Add a byte range of an open file to a running hash, read from
+ * the page cache through a mapping rather than copied out.
+ *
+ * @param s : the running hash
+ * @param fd : the file
+ * @param off : first byte
+ * @param len : number of bytes, all of which must be in the file
+ * @return int : 0 on success, -1 on error
+ */
+int hash_update_fd(hash_state_t *s, int fd, off_t off, off_t len)
+{
+        off_t end = off + len, base, pos, n;
+        long pagesize = sysconf(_SC_PAGESIZE);
+        char *map;
+
+        /* map a window at a time, so large files don't need address space */
+        for (pos = off; pos < end; pos += n) {
+                base = pos - pos % pagesize;
+                n = end - pos < MAPCHUNK ? end - pos : MAPCHUNK;
+                map = mmap(NULL, n + (pos - base), PROT_READ, MAP_PRIVATE, fd, base);
+                if (map == MAP_FAILED)
+                        return -1;
+                madvise(map, n + (pos - base), MADV_SEQUENTIAL);
+                hash_update(s, map + (pos - base), n);
+                munmap(map, n + (pos - base));
+        }
+        return 0;
+}
+
+
+/**
+ * @brief Hash a byte range of an open file, through the shared table
+ * when the range is the whole file.
+ *
+ * @param fd : the file
+ * @param off : first byte
+ * @param len : number of bytes, -1 for the rest of the file
+ * @param h : set to the hash
+ * @return int : 0 on success, -1 on error
+ */
+int hash_fd(int fd, off_t off, off_t len, uint64_t *h)
+{
+        struct stat st;
+        hash_state_t s;
+        off_t end;
+
+        if (fstat(fd, &st) < 0)
+                return -1;
+        if (off < 0 || off > st.st_size)
+                off = st.st_size;
+        end = len < 0 || len > st.st_size - off ? st.st_size : off + len;
+
+        if (off == 0 && end == st.st_size && !hash_known(&st, h))
+                return 0;
+
+        hash_reset(&s, 0);
+        if (hash_update_fd(&s, fd, off, end - off) < 0)
+                return -1;
+        *h = hash_digest(&s);
+
+        if (off == 0 && end == st.st_size)
+                hash_remember(&st, *h);
+        return 0;
+}
+
+
+int hash_file(const char *path, uint64_t *h)
+{
+        int fd, ret;
+
+        if ((fd = open(path, O_RDONLY)) < 0)
+                return -1;
+        ret = hash_fd(fd, 0, -1, h);
+        close(fd);
+        return ret;
+}
+
+
+static void *hash_worker(void *arg)
+{
+        work_t *w = arg;
+        int i;
+
+        while ((i = __sync_fetch_and_add(&w->next, 1)) < w->n) {
+                w->bad[i] = hash_file(w->paths[i], &w->h[i]) < 0;
+                if (w->bad[i])
+                        __sync_fetch_and_add(&w->failed, 1);
+        }
+        return NULL;
+}
+
+
+/**
+ * @brief Hash a set of files on up to HASHTHREADS threads, each taking
+ * the next file as it is done with one.
+ *
+ * @param paths : the files
+ * @param n : number of files
+ * @param h : set to the hash of each file
+ * @param bad : set to 1 for each file that could not be read, 0 otherwise
+ * @return int : number of files that could not be read
+ */
+int hash_files(char **paths, int n, uint64_t *h, char *bad)
+{
+        pthread_t tid[HASHTHREADS];
+        work_t w = { paths, h, bad, n, 0, 0 };
+        int nthread = n < HASHTHREADS ? n : HASHTHREADS, started = 0;
+
+        /* the calling thread works too */
+        for (int i = 1; i < nthread; ++i) {
+                if (pthread_create(&tid[started], NULL, hash_worker, &w))
+                        break;
+                ++started;
+        }
+        hash_worker(&w);
+        for (int i = 0; i < started; ++i)
+                pthread_join(tid[i], NULL);
+
+        return w.failed;
+}
@@ -0,0 +1,45 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Content hashing for served files and transfers.
+ *
+ * The checksum is XXH64: four independent 64-bit lanes over 32-byte
+ * stripes, which keeps the multiplier pipelines busy and runs at memory
+ * speed without any instruction set extensions. Whole-file hashes are
+ * remembered in a table shared by every process of a node, keyed by
+ * device, inode, size and modification time, so a file is read again
+ * only after it has changed. The index keeps the hashes known when it is
+ * built, and a node starting over takes them back from it.
+ */
+
+#define HASHSLOTS       65536           /* entries in the shared table */
+#define HASHTHREADS     4               /* threads hashing a set of files */
+
+typedef struct {
+        uint64_t total;
+        uint64_t v[4];
+        unsigned char mem[32];          /* the last partial stripe */
+        size_t memsize;
+        uint64_t seed;
+} hash_state_t;
+
+void hash_reset(hash_state_t *s, uint64_t seed);
+void hash_update(hash_state_t *s, const void *data, size_t len);
+uint64_t hash_digest(const hash_state_t *s);
+uint64_t hash_buf(const void *data, size_t len, uint64_t seed);
+
+int hash_init(void);
+int hash_known(const struct stat *st, uint64_t *h);
+void hash_remember(const struct stat *st, uint64_t h);
+int hash_update_fd(hash_state_t *s, int fd, off_t off, off_t len);
+int hash_fd(int fd, off_t off, off_t len, uint64_t *h);
+int hash_file(const char *path, uint64_t *h);
+int hash_files(char **paths, int n, uint64_t *h, char *bad);
+
+#endif
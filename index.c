@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "index.h"
+#include "hash.h"
+
+/* a file seen by the walk, before it gets its place in the arena */
+typedef struct {
+        char *path;
+        struct stat st;
+} found_t;
+
+/* state of index_build(), which runs in a process of its own */
+static found_t *found, *dirs;
+static size_t nfound, maxfound, ndirs, maxdirs;
+static irec_t *sorting;
+static const char *sortarena;
+
+
+static int add(found_t **list, size_t *n, size_t *max, const char *fpath, const struct stat *st)
+{
+        found_t *f;
+
+        if (*n == *max) {
+                *max = *max ? *max * 2 : 1024;
+                if (!(f = realloc(*list, *max * sizeof(found_t))))
+                        return -1;
+                *list = f;
+        }
+        if (!((*list)[*n].path = strdup(fpath)))
+                return -1;
+        (*list)[(*n)++].st = *st;
+        return 0;
+}
+
+
+static int collect(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+        if (type == FTW_D)
+                return add(&dirs, &ndirs, &maxdirs, fpath, st);
+        if (type == FTW_F)
+                return add(&found, &nfound, &maxfound, fpath, st);
+        return 0;
+}
+
+
+static int cmppath(const void *a, const void *b)
+{
+        return strcmp(((const found_t*) a)->path, ((const found_t*) b)->path);
+}
+
+
+static int cmpname(const void *a, const void *b)
+{
+        const irec_t *x = &sorting[*(const uint32_t*) a], *y = &sorting[*(const uint32_t*) b];
+        int c = strcmp(sortarena + x->name, sortarena + y->name);
+
+        /* ties stay in path order */
+        return c ? c : (x > y) - (x < y);
+}
+
+
+static int cmpu64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+        return (x > y) - (x < y);
+}
+
+
+static int cmpcount(const void *a, const void *b)
+{
+        const itri_t *x = *(const itri_t* const*) a, *y = *(const itri_t* const*) b;
+
+        return (x->count > y->count) - (x->count < y->count);
+}
+
+
+/* trigram of the three bytes at p */
+static inline uint32_t gram(const char *p)
+{
+        return (uint32_t) (unsigned char) p[0] << 16 | (uint32_t) (unsigned char) p[1] << 8 |
+               (unsigned char) p[2];
+}
+
+
+/**
+ * @brief Build the trigram table and the posting lists of the records.
+ * Each (trigram, record) pair is packed in 64 bits, so one sort groups
+ * the pairs by trigram with the records of each group in order.
+ *
+ * @return int : 0 on success, -1 on error
+ */
+static int grams(const irec_t *rec, size_t n, const char *arena, itri_t **tri, uint32_t *ntri,
+                 uint32_t **post, uint64_t *npost)
+{
+        uint64_t *pairs, npair = 0, k;
+        size_t len, maxpair = 0;
+        const char *path;
+        uint32_t t = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+                len = strlen(arena + rec[i].path);
+                maxpair += len > 2 ? len - 2 : 0;
+        }
+
+        *tri = NULL;
+        *post = NULL;
+        if (!(pairs = malloc((maxpair ? maxpair : 1) * sizeof(uint64_t))))
+                return -1;
+
+        for (size_t i = 0; i < n; ++i) {
+                path = arena + rec[i].path;
+                for (len = strlen(path); len > 2; --len, ++path)
+                        pairs[npair++] = (uint64_t) gram(path) << 32 | i;
+        }
+        qsort(pairs, npair, sizeof(uint64_t), cmpu64);
+
+        /* a trigram repeated in a path posts the record once */
+        for (uint64_t i = k = 0; i < npair; ++i) {
+                if (!k || pairs[i] != pairs[k - 1])
+                        pairs[k++] = pairs[i];
+        }
+        npair = k;
+
+        *tri = malloc((npair ? npair : 1) * sizeof(itri_t));
+        *post = malloc((npair ? npair : 1) * sizeof(uint32_t));
+        if (!*tri || !*post) {
+                free(pairs);
+                return -1;
+        }
+
+        for (uint64_t i = 0; i < npair; ++i) {
+                if (!i || pairs[i] >> 32 != pairs[i - 1] >> 32) {
+                        (*tri)[t].key = pairs[i] >> 32;
+                        (*tri)[t].start = i;
+                        (*tri)[t].count = 0;
+                        ++t;
+                }
+                (*tri)[t - 1].count++;
+                (*post)[i] = (uint32_t) pairs[i];
+        }
+
+        *ntri = t;
+        *npost = npair;
+        free(pairs);
+        return 0;
+}
+
+
+static int cmpsize(const void *a, const void *b)
+{
+        const irec_t *x = &sorting[*(const uint32_t*) a], *y = &sorting[*(const uint32_t*) b];
+
+        if (x->size != y->size)
+                return (x->size > y->size) - (x->size < y->size);
+        return (x > y) - (x < y);
+}
+
+
+static int cmpmtime(const void *a, const void *b)
+{
+        const irec_t *x = &sorting[*(const uint32_t*) a], *y = &sorting[*(const uint32_t*) b];
+
+        if (x->mtime != y->mtime)
+                return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+        return (x > y) - (x < y);
+}
+
+
+static int cmpctime(const void *a, const void *b)
+{
+        const irec_t *x = &sorting[*(const uint32_t*) a], *y = &sorting[*(const uint32_t*) b];
+
+        if (x->ctime != y->ctime)
+                return (x->ctime > y->ctime) - (x->ctime < y->ctime);
+        return (x > y) - (x < y);
+}
+
+
+/* extension of a file name: after the last '.', unless that starts the name */
+static const char *extof(const char *name)
+{
+        const char *dot = strrchr(name, '.');
+
+        return dot && dot != name ? dot + 1 : "";
+}
+
+
+static int cmpext(const void *a, const void *b)
+{
+        const irec_t *x = &sorting[*(const uint32_t*) a], *y = &sorting[*(const uint32_t*) b];
+        int c = strcmp(extof(sortarena + x->name), extof(sortarena + y->name));
+
+        return c ? c : (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Walk a tree and write its index, replacing the previous one
+ * only once the new one is complete.
+ *
+ * @param root : the tree
+ * @param file : the index file
+ * @return int : number of files indexed, -1 on error
+ */
+int index_build(const char *root, const char *file)
+{
+        ihdr_t hdr;
+        index_t old;
+        irec_t *rec = NULL;
+        idir_t *dir = NULL;
+        itri_t *tri = NULL;
+        uint32_t *byname = NULL, *bysize = NULL, *bymtime = NULL, *byctime = NULL, *byext = NULL;
+        uint32_t *post = NULL, ntri = 0;
+        uint64_t npost = 0;
+        char *arena = NULL, tmp[PATH_MAX];
+        size_t arenalen = 0, len;
+        FILE *fp = NULL;
+        int ret = -1;
+
+        /* checksums no process of the node has hashed since it started are carried over */
+        index_open(&old, file);
+        nfound = ndirs = 0;
+        if (nftw(root, collect, 32, FTW_PHYS) < 0)
+                goto out;
+        qsort(found, nfound, sizeof(found_t), cmppath);
+
+        for (size_t i = 0; i < nfound; ++i)
+                arenalen += strlen(found[i].path) + 1;
+        for (size_t i = 0; i < ndirs; ++i)
+                arenalen += strlen(dirs[i].path) + 1;
+        if (arenalen > UINT32_MAX || nfound > UINT32_MAX || ndirs > UINT32_MAX)
+                goto out;
+
+        rec = calloc(nfound ? nfound : 1, sizeof(irec_t));
+        byname = malloc((nfound ? nfound : 1) * sizeof(uint32_t));
+        bysize = malloc((nfound ? nfound : 1) * sizeof(uint32_t));
+        bymtime = malloc((nfound ? nfound : 1) * sizeof(uint32_t));
+        byctime = malloc((nfound ? nfound : 1) * sizeof(uint32_t));
+        byext = malloc((nfound ? nfound : 1) * sizeof(uint32_t));
+        dir = calloc(ndirs ? ndirs : 1, sizeof(idir_t));
+        arena = malloc(arenalen ? arenalen : 1);
+        if (!rec || !byname || !bysize || !bymtime || !byctime || !byext || !dir || !arena)
+                goto out;
+
+        arenalen = 0;
+        for (size_t i = 0; i < nfound; ++i) {
+                const char *slash = strrchr(found[i].path, '/');
+
+                len = strlen(found[i].path) + 1;
+                memcpy(arena + arenalen, found[i].path, len);
+                rec[i].path = arenalen;
+                rec[i].name = arenalen + (slash ? slash + 1 - found[i].path : 0);
+                rec[i].size = found[i].st.st_size;
+                rec[i].mtime = found[i].st.st_mtime;
+                rec[i].ctime = found[i].st.st_ctime;
+                rec[i].ino = found[i].st.st_ino;
+                rec[i].mode = found[i].st.st_mode;
+                rec[i].mtimensec = found[i].st.st_mtim.tv_nsec;
+                rec[i].dev = found[i].st.st_dev;
+                if (!hash_known(&found[i].st, &rec[i].hash) ||
+                    !index_hash(&old, found[i].path, &found[i].st, &rec[i].hash))
+                        rec[i].flags |= IREC_HASHED;
+                arenalen += len;
+                byname[i] = bysize[i] = bymtime[i] = byctime[i] = byext[i] = i;
+        }
+        for (size_t i = 0; i < ndirs; ++i) {
+                len = strlen(dirs[i].path) + 1;
+                memcpy(arena + arenalen, dirs[i].path, len);
+                dir[i].path = arenalen;
+                dir[i].mtime = dirs[i].st.st_mtime;
+                dir[i].mtimensec = dirs[i].st.st_mtim.tv_nsec;
+                arenalen += len;
+        }
+
+        sorting = rec;
+        sortarena = arena;
+        qsort(byname, nfound, sizeof(uint32_t), cmpname);
+        qsort(bysize, nfound, sizeof(uint32_t), cmpsize);
+        qsort(bymtime, nfound, sizeof(uint32_t), cmpmtime);
+        qsort(byctime, nfound, sizeof(uint32_t), cmpctime);
+        qsort(byext, nfound, sizeof(uint32_t), cmpext);
+        if (grams(rec, nfound, arena, &tri, &ntri, &post, &npost) < 0)
+                goto out;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = INDEXMAGIC;
+        hdr.version = INDEXVERSION;
+        hdr.nrec = nfound;
+        hdr.ndir = ndirs;
+        hdr.ntri = ntri;
+        hdr.npost = npost;
+        hdr.arenalen = arenalen;
+        hdr.built = time(NULL);
+
+        snprintf(tmp, sizeof(tmp), "%s.%d", file, getpid());
+        if (!(fp = fopen(tmp, "w")))
+                goto out;
+        if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            fwrite(rec, sizeof(irec_t), nfound, fp) != nfound ||
+            fwrite(dir, sizeof(idir_t), ndirs, fp) != ndirs ||
+            fwrite(tri, sizeof(itri_t), ntri, fp) != ntri ||
+            fwrite(byname, sizeof(uint32_t), nfound, fp) != nfound ||
+            fwrite(bysize, sizeof(uint32_t), nfound, fp) != nfound ||
+            fwrite(bymtime, sizeof(uint32_t), nfound, fp) != nfound ||
+            fwrite(byctime, sizeof(uint32_t), nfound, fp) != nfound ||
+            fwrite(byext, sizeof(uint32_t), nfound, fp) != nfound ||
+            fwrite(post, sizeof(uint32_t), npost, fp) != npost ||
+            fwrite(arena, 1, arenalen, fp) != arenalen) {
+                fclose(fp);
+                unlink(tmp);
+                goto out;
+        }
+        if (fclose(fp) || rename(tmp, file) < 0) {
+                unlink(tmp);
+                goto out;
+        }
+        ret = nfound;
+
+out:
+        for (size_t i = 0; i < nfound; ++i)
+                free(found[i].path);
+        for (size_t i = 0; i < ndirs; ++i)
+                free(dirs[i].path);
+        nfound = ndirs = 0;
+        index_close(&old);
+        free(rec);
+        free(dir);
+        free(tri);
+        free(post);
+        free(byname);
+        free(bysize);
+        free(bymtime);
+        free(byctime);
+        free(byext);
+        free(arena);
+        return ret;
+}
+
+
+/**
+ * @brief Map an index file. Nothing is read until it is used.
+ *
+ * @param ix : set to the mapped index, or to an empty one on failure
+ * @param file : the index file
+ * @return int : 0 on success, -1 if there is no usable index
+ */
+int index_open(index_t *ix, const char *file)
+{
+        struct stat st;
+        const ihdr_t *hdr;
+        size_t need;
+        int fd;
+
+        memset(ix, 0, sizeof(*ix));
+        if ((fd = open(file, O_RDONLY)) < 0)
+                return -1;
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(ihdr_t)) {
+                close(fd);
+                return -1;
+        }
+
+        ix->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ix->map == MAP_FAILED) {
+                ix->map = NULL;
+                return -1;
+        }
+        ix->len = st.st_size;
+
+        /* the sizes must add up exactly, so that no offset leaves the map */
+        hdr = ix->map;
+        need = sizeof(ihdr_t) + (size_t) hdr->nrec * (sizeof(irec_t) + 5 * sizeof(uint32_t)) +
+               (size_t) hdr->ndir * sizeof(idir_t) +
+               (size_t) hdr->ntri * sizeof(itri_t) + hdr->npost * sizeof(uint32_t) + hdr->arenalen;
+        if (hdr->magic != INDEXMAGIC || hdr->version != INDEXVERSION || need != ix->len ||
+            (hdr->arenalen && ((const char*) ix->map)[ix->len - 1])) {
+                index_close(ix);
+                return -1;
+        }
+
+        ix->hdr = hdr;
+        ix->rec = (const irec_t*) (hdr + 1);
+        ix->dir = (const idir_t*) (ix->rec + hdr->nrec);
+        ix->tri = (const itri_t*) (ix->dir + hdr->ndir);
+        ix->byname = (const uint32_t*) (ix->tri + hdr->ntri);
+        ix->bysize = ix->byname + hdr->nrec;
+        ix->bymtime = ix->bysize + hdr->nrec;
+        ix->byctime = ix->bymtime + hdr->nrec;
+        ix->byext = ix->byctime + hdr->nrec;
+        ix->post = ix->byext + hdr->nrec;
+        ix->arena = (const char*) (ix->post + hdr->npost);
+        ix->n = hdr->nrec;
+        ix->dev = st.st_dev;
+        ix->ino = st.st_ino;
+        return 0;
+}
+
+
+void index_close(index_t *ix)
+{
+        if (ix->map)
+                munmap(ix->map, ix->len);
+        memset(ix, 0, sizeof(*ix));
+}
+
+
+/**
+ * @brief Tell whether the index still lists the files of the tree: no
+ * directory has changed since it was built. The files themselves may
+ * have, so their attributes are to be taken from stat().
+ *
+ * @return int : 1 if it does, 0 if the tree must be walked
+ */
+int index_current(const index_t *ix)
+{
+        const idir_t *d;
+        struct stat st;
+
+        if (!ix->map)
+                return 0;
+        for (uint32_t i = 0; i < ix->hdr->ndir; ++i) {
+                d = &ix->dir[i];
+                if (d->path >= ix->hdr->arenalen || stat(ix->arena + d->path, &st) < 0 ||
+                    st.st_mtime != d->mtime || st.st_mtim.tv_nsec != d->mtimensec)
+                        return 0;
+        }
+        return 1;
+}
+
+
+const char *index_path(const index_t *ix, uint32_t i)
+{
+        return ix->rec[i].path < ix->hdr->arenalen ? ix->arena + ix->rec[i].path : "";
+}
+
+
+const char *index_name(const index_t *ix, uint32_t i)
+{
+        return ix->rec[i].name < ix->hdr->arenalen ? ix->arena + ix->rec[i].name : "";
+}
+
+
+const char *index_ext(const index_t *ix, uint32_t i)
+{
+        return extof(index_name(ix, i));
+}
+
+
+/* fill in the fields of a struct stat the index keeps */
+void index_stat(const index_t *ix, uint32_t i, struct stat *st)
+{
+        const irec_t *r = &ix->rec[i];
+
+        memset(st, 0, sizeof(*st));
+        st->st_size = r->size;
+        st->st_mtime = r->mtime;
+        st->st_ctime = r->ctime;
+        st->st_ino = r->ino;
+        st->st_mode = r->mode;
+        st->st_mtim.tv_nsec = r->mtimensec;
+        st->st_dev = r->dev;
+}
+
+
+/* the content hash the index kept for path, if the file is still as st has it: 0, -1 otherwise */
+int index_hash(const index_t *ix, const char *path, const struct stat *st, uint64_t *h)
+{
+        const irec_t *r;
+        uint32_t i;
+
+        if (!index_prefix(ix, path, &i) || strcmp(index_path(ix, i), path))
+                return -1;
+        r = &ix->rec[i];
+        if (!(r->flags & IREC_HASHED) || r->dev != (uint64_t) st->st_dev || r->ino != (uint64_t) st->st_ino ||
+            r->size != st->st_size || r->mtime != st->st_mtime || r->mtimensec != st->st_mtim.tv_nsec)
+                return -1;
+        *h = r->hash;
+        return 0;
+}
+
+
+/**
+ * @brief Find the files with a given name.
+ *
+ * @param first : set to the position of the first one in byname
+ * @return uint32_t : number of files with that name
+ */
+uint32_t index_lookup(const index_t *ix, const char *name, uint32_t *first)
+{
+        uint32_t lo = 0, hi = ix->n, mid, end;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (strcmp(index_name(ix, ix->byname[mid]), name) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        for (end = lo; end < ix->n && !strcmp(index_name(ix, ix->byname[end]), name); ++end)
+                ;
+
+        *first = lo;
+        return end - lo;
+}
+
+
+static inline int64_t key(const irec_t *r, int k)
+{
+        return k == BYSIZE ? r->size : k == BYMTIME ? r->mtime : r->ctime;
+}
+
+
+/**
+ * @brief Find the files whose size, mtime or ctime is in [lo, hi].
+ *
+ * @param k : BYSIZE, BYMTIME or BYCTIME
+ * @param first : set to the position of the first one in the column of k
+ * @return uint32_t : number of such files
+ */
+uint32_t index_range(const index_t *ix, int k, int64_t lo, int64_t hi, uint32_t *first)
+{
+        const uint32_t *col = k == BYSIZE ? ix->bysize : k == BYMTIME ? ix->bymtime : ix->byctime;
+        uint32_t a = 0, b = ix->n, mid, start;
+
+        while (a < b) {
+                mid = a + (b - a) / 2;
+                if (key(&ix->rec[col[mid]], k) < lo)
+                        a = mid + 1;
+                else
+                        b = mid;
+        }
+        start = a;
+
+        b = ix->n;
+        while (a < b) {
+                mid = a + (b - a) / 2;
+                if (key(&ix->rec[col[mid]], k) <= hi)
+                        a = mid + 1;
+                else
+                        b = mid;
+        }
+
+        *first = start;
+        return a - start;
+}
+
+
+uint32_t index_sizes(const index_t *ix, int64_t lo, int64_t hi, uint32_t *first)
+{
+        return index_range(ix, BYSIZE, lo, hi, first);
+}
+
+
+/**
+ * @brief Find the files with a given extension, "" for none.
+ *
+ * @param first : set to the position of the first one in byext
+ * @return uint32_t : number of such files
+ */
+uint32_t index_exts(const index_t *ix, const char *ext, uint32_t *first)
+{
+        uint32_t lo = 0, hi = ix->n, mid, end;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (strcmp(index_ext(ix, ix->byext[mid]), ext) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        for (end = lo; end < ix->n && !strcmp(index_ext(ix, ix->byext[end]), ext); ++end)
+                ;
+
+        *first = lo;
+        return end - lo;
+}
+
+
+/**
+ * @brief Find the files whose path starts with a prefix. Records are in
+ * path order, so they are consecutive.
+ *
+ * @param first : set to the first such record
+ * @return uint32_t : number of such files
+ */
+uint32_t index_prefix(const index_t *ix, const char *prefix, uint32_t *first)
+{
+        size_t len = strlen(prefix);
+        uint32_t lo = 0, hi = ix->n, mid, start;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (strcmp(index_path(ix, mid), prefix) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        start = lo;
+
+        hi = ix->n;
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (strncmp(index_path(ix, mid), prefix, len) <= 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        *first = start;
+        return lo - start;
+}
+
+
+static const itri_t *findgram(const index_t *ix, uint32_t key)
+{
+        uint32_t lo = 0, hi = ix->hdr->ntri, mid;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (ix->tri[mid].key < key)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo < ix->hdr->ntri && ix->tri[lo].key == key ? &ix->tri[lo] : NULL;
+}
+
+
+/**
+ * @brief Find the records whose path contains every one of a set of
+ * strings, from the posting lists of their trigrams. The lists are
+ * intersected from the shortest one up, so the work is bounded by the
+ * rarest trigram. Strings shorter than three bytes don't narrow anything.
+ *
+ * @param runs : strings a matching path must contain
+ * @param nruns : number of strings
+ * @param ids : set to the candidate records in ascending order, to be freed
+ * @param n : set to the number of candidates
+ * @return int : 0 on success, 1 if no run has a trigram (every record is
+ * a candidate, and ids is not set), -1 on error
+ */
+int index_grams(const index_t *ix, char *runs[], int nruns, uint32_t **ids, uint32_t *n)
+{
+        const itri_t **lists;
+        uint32_t *out, m, j;
+        size_t nlists = 0, max = 0;
+
+        for (int r = 0; r < nruns; ++r)
+                max += strlen(runs[r]) > 2 ? strlen(runs[r]) - 2 : 0;
+        if (!max)
+                return 1;
+        if (!(lists = malloc(max * sizeof(itri_t*))))
+                return -1;
+
+        for (int r = 0; r < nruns; ++r) {
+                for (const char *p = runs[r]; strlen(p) > 2; ++p) {
+                        if (!(lists[nlists] = findgram(ix, gram(p)))) {
+                                /* a trigram no path has */
+                                free(lists);
+                                *ids = NULL;
+                                *n = 0;
+                                return 0;
+                        }
+                        ++nlists;
+                }
+        }
+        qsort(lists, nlists, sizeof(itri_t*), cmpcount);
+
+        if (!(out = malloc((lists[0]->count ? lists[0]->count : 1) * sizeof(uint32_t)))) {
+                free(lists);
+                return -1;
+        }
+        memcpy(out, ix->post + lists[0]->start, lists[0]->count * sizeof(uint32_t));
+        m = lists[0]->count;
+
+        /* keep what every other list has too; both sides are ascending */
+        for (size_t l = 1; l < nlists && m; ++l) {
+                const uint32_t *p = ix->post + lists[l]->start;
+                uint32_t len = lists[l]->count, k = 0, lo, hi, mid;
+
+                j = 0;
+                for (uint32_t i = 0; i < m; ++i) {
+                        /* gallop: the next candidate is often far ahead in a long list */
+                        lo = k;
+                        hi = len;
+                        while (lo < hi) {
+                                mid = lo + (hi - lo) / 2;
+                                if (p[mid] < out[i])
+                                        lo = mid + 1;
+                                else
+                                        hi = mid;
+                        }
+                        k = lo;
+                        if (k < len && p[k] == out[i])
+                                out[j++] = out[i];
+                }
+                m = j;
+        }
+
+        free(lists);
+        *ids = out;
+        *n = m;
+        return 0;
+}
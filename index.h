@@ -0,0 +1,116 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Persistent index of the served tree.
+ *
+ * The file is mapped read-only and used in place, without parsing:
+ *
+ *      header | records, sorted by path | directories | trigrams | byname |
+ *      bysize | bymtime | byctime | byext | postings | string arena
+ *
+ * Records have a fixed width and point into the arena; the by* columns
+ * are arrays of record numbers sorted on those keys, so lookups by file
+ * name, size or time range and extension are binary searches, as are
+ * path prefixes on the records themselves. Every three-byte sequence
+ * of a path is a trigram: the trigram table is sorted by trigram and
+ * points to the ascending list of the records whose path contains it,
+ * so a substring narrows down to the intersection of a few lists. The
+ * sections are laid out so that every field is naturally aligned. The
+ * file is rebuilt in the background and replaced with rename(), so a
+ * mapping is never modified. The directories of the tree are kept with
+ * their modification times: as long as none has changed, no file has
+ * been created, removed or renamed since the index was built. A record
+ * also carries the content hash of
+ * its file when one was known at build time, so checksums outlive a
+ * restart of the node.
+ */
+
+#define INDEXMAGIC      0x58495446      /* "FTIX" */
+#define INDEXVERSION    5
+
+typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nrec;
+        uint32_t ntri;
+        uint64_t npost;
+        uint64_t arenalen;
+        int64_t built;                  /* when the tree was walked */
+        uint32_t ndir;
+        uint32_t pad;
+} ihdr_t;
+
+typedef struct {
+        uint32_t path;                  /* offsets in the arena */
+        uint32_t name;
+        int64_t size;
+        int64_t mtime;
+        int64_t ctime;
+        uint64_t ino;
+        uint32_t mode;
+        uint32_t mtimensec;
+        uint64_t dev;
+        uint64_t hash;                  /* valid with IREC_HASHED */
+        uint32_t flags;
+        uint32_t pad;
+} irec_t;
+
+#define IREC_HASHED     1
+
+typedef struct {
+        uint32_t path;                  /* offset in the arena */
+        uint32_t mtimensec;
+        int64_t mtime;
+} idir_t;
+
+typedef struct {
+        uint32_t key;                   /* the three bytes, first one highest */
+        uint32_t count;
+        uint64_t start;                 /* first posting */
+} itri_t;
+
+typedef struct {
+        void *map;
+        size_t len;
+        const ihdr_t *hdr;
+        const irec_t *rec;
+        const idir_t *dir;
+        const uint32_t *byname;
+        const uint32_t *bysize;
+        const uint32_t *bymtime;
+        const uint32_t *byctime;
+        const uint32_t *byext;
+        const itri_t *tri;
+        const uint32_t *post;
+        const char *arena;
+        uint32_t n;                     /* 0 when no index is mapped */
+        dev_t dev;                      /* the file mapped */
+        ino_t ino;
+} index_t;
+
+/* keys of the range columns */
+enum { BYSIZE, BYMTIME, BYCTIME };
+
+int index_build(const char *root, const char *file);
+int index_open(index_t *ix, const char *file);
+void index_close(index_t *ix);
+int index_current(const index_t *ix);
+
+const char *index_path(const index_t *ix, uint32_t i);
+const char *index_name(const index_t *ix, uint32_t i);
+const char *index_ext(const index_t *ix, uint32_t i);
+void index_stat(const index_t *ix, uint32_t i, struct stat *st);
+int index_hash(const index_t *ix, const char *path, const struct stat *st, uint64_t *h);
+uint32_t index_lookup(const index_t *ix, const char *name, uint32_t *first);
+uint32_t index_sizes(const index_t *ix, int64_t lo, int64_t hi, uint32_t *first);
+uint32_t index_range(const index_t *ix, int key, int64_t lo, int64_t hi, uint32_t *first);
+uint32_t index_exts(const index_t *ix, const char *ext, uint32_t *first);
+uint32_t index_prefix(const index_t *ix, const char *prefix, uint32_t *first);
+int index_grams(const index_t *ix, char *runs[], int nruns, uint32_t **ids, uint32_t *n);
+
+#endif
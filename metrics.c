@@ -0,0 +1,335 @@
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+#define LE_MAX          31              /* histogram bounds exported: 1 us to 2^30 us */
+
+typedef struct {
+        uint64_t count;
+        uint64_t sum;                   /* microseconds */
+        uint64_t buckets[HISTBUCKETS];
+} hist_t;
+
+typedef struct {
+        uint64_t counters[NCOUNTERS];
+        hist_t hists[NHISTS];
+} __attribute__((aligned(64))) shard_t;
+
+/* shared by every process of the node */
+typedef struct {
+        uint32_t nthreads;              /* threads that took a shard so far */
+        int64_t gauges[NGAUGES];
+        shard_t shards[METRICSHARDS];
+} metrics_t;
+
+static metrics_t *metrics;
+static __thread shard_t *mine;
+
+static const char *counters[NCOUNTERS][2] = {
+        { "ftp_connections_total", "Connections accepted" },
+        { "ftp_hello_local_total", "Clients served by this node at HELLO" },
+        { "ftp_hello_redirected_total", "Clients sent to the mirror at HELLO" },
+        { "ftp_sent_bytes_total", "Response bytes sent" },
+        { "ftp_archive_input_bytes_total", "Bytes of the files put into archives" },
+        { "ftp_archive_output_bytes_total", "Bytes of the archives built from them" },
+        { "ftp_build_retries_total", "Archive builds turned away by admission control" },
+};
+
+static const char *gauges[NGAUGES][2] = {
+        { "ftp_sessions", "Client sessions open" },
+};
+
+
+/* set up the shared numbers, before any process is forked: 0 on success, -1 on error */
+int metrics_init(void)
+{
+        metrics = mmap(NULL, sizeof(metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (metrics == MAP_FAILED) {
+                metrics = NULL;
+                return -1;
+        }
+        return 0;
+}
+
+
+static shard_t *shard(void)
+{
+        if (!mine)
+                mine = &metrics->shards[__atomic_fetch_add(&metrics->nthreads, 1, __ATOMIC_RELAXED) % METRICSHARDS];
+        return mine;
+}
+
+
+void metrics_add(int counter, uint64_t n)
+{
+        if (metrics)
+                __atomic_fetch_add(&shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+
+void metrics_gauge(int gauge, int64_t delta)
+{
+        if (metrics)
+                __atomic_fetch_add(&metrics->gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+
+/* bucket of a value in microseconds */
+static int bucket(uint64_t v)
+{
+        int e;
+
+        if (v < 1 << HISTSUB)
+                return v;
+        if (v >= 1ULL << 40)
+                v = (1ULL << 40) - 1;
+        e = 63 - __builtin_clzll(v);
+        return (e - HISTSUB + 1) << HISTSUB | (v >> (e - HISTSUB) & ((1 << HISTSUB) - 1));
+}
+
+
+/* lowest value of bucket i, and its width */
+static uint64_t lowest(int i, uint64_t *width)
+{
+        int k = i >> HISTSUB;
+
+        if (!k) {
+                *width = 1;
+                return i;
+        }
+        *width = 1ULL << (k - 1);
+        return (uint64_t) ((1 << HISTSUB) + (i & ((1 << HISTSUB) - 1))) << (k - 1);
+}
+
+
+/* record how long something took */
+void metrics_time(int hist, double sec)
+{
+        uint64_t us = sec > 0 ? (uint64_t) (sec * 1e6) : 0;
+        hist_t *h;
+
+        if (!metrics)
+                return;
+        h = &shard()->hists[hist];
+        __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&h->buckets[bucket(us)], 1, __ATOMIC_RELAXED);
+}
+
+
+/* the shards of a histogram added up */
+static void total(int i, hist_t *h)
+{
+        hist_t *s;
+
+        memset(h, 0, sizeof(*h));
+        for (int k = 0; k < METRICSHARDS; ++k) {
+                s = &metrics->shards[k].hists[i];
+                h->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+                h->sum += __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+                for (int b = 0; b < HISTBUCKETS; ++b)
+                        h->buckets[b] += __atomic_load_n(&s->buckets[b], __ATOMIC_RELAXED);
+        }
+}
+
+
+/* the value below which a fraction q of the samples fall, in microseconds */
+static double quantile(const hist_t *h, double q)
+{
+        uint64_t seen = 0, low, width;
+
+        for (int b = 0; b < HISTBUCKETS; ++b) {
+                if ((seen += h->buckets[b]) >= q * h->count && h->buckets[b]) {
+                        low = lowest(b, &width);
+                        return low + width / 2.0;
+                }
+        }
+        return 0;
+}
+
+
+static int put(buf_t *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int put(buf_t *out, const char *fmt, ...)
+{
+        char line[512];
+        va_list ap;
+        int n;
+
+        va_start(ap, fmt);
+        n = vsnprintf(line, sizeof(line), fmt, ap);
+        va_end(ap);
+        return n < 0 ? -1 : buf_put(out, line, n < (int) sizeof(line) ? n : (int) sizeof(line) - 1);
+}
+
+
+/* the samples of a histogram with its labels, "" for none, like op="findfile" */
+static int histogram(buf_t *out, const char *name, const char *label, const hist_t *h)
+{
+        const char *sep = *label ? "," : "";
+        char set[80];
+        uint64_t cum = 0;
+        int b = 0;
+
+        snprintf(set, sizeof(set), *label ? "{%s}" : "%s", label);
+
+        /* Prometheus wants cumulative buckets; powers of two of us are bucket edges here */
+        for (int k = 0; k < LE_MAX; ++k) {
+                for (; b < bucket(1ULL << k); ++b)
+                        cum += h->buckets[b];
+                if (put(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, sep, (1ULL << k) / 1e6,
+                        (unsigned long long) cum) < 0)
+                        return -1;
+        }
+        if (put(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep, (unsigned long long) h->count) < 0 ||
+            put(out, "%s_sum%s %g\n", name, set, h->sum / 1e6) < 0 ||
+            put(out, "%s_count%s %llu\n", name, set, (unsigned long long) h->count) < 0)
+                return -1;
+        return 0;
+}
+
+
+/* the finer quantiles the exported buckets lose, as gauges */
+static int quantiles(buf_t *out, const char *name, const char *label, const hist_t *h)
+{
+        static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+        const char *sep = *label ? "," : "";
+
+        for (size_t i = 0; i < sizeof(q) / sizeof(q[0]); ++i) {
+                if (put(out, "%s{%s%squantile=\"%g\"} %g\n", name, label, sep, q[i],
+                        quantile(h, q[i]) / 1e6) < 0)
+                        return -1;
+        }
+        return 0;
+}
+
+
+/* histograms: one family of buckets, then one of quantiles */
+static const struct {
+        const char *name;
+        const char *help;
+        int first, last;                /* histograms in the family */
+} families[] = {
+        { "ftp_request", "Time from reading a request to its last byte sent", 0, OP_MAXREQ },
+        { "ftp_walk", "Time to select the files of a request", H_WALK, H_WALK },
+        { "ftp_build", "Time to build an archive", H_BUILD, H_BUILD },
+};
+
+
+/**
+ * @brief Write every number of the node in the Prometheus text format.
+ *
+ * @param out : the text is appended here, not NUL terminated
+ * @return int : 0 on success, -1 when out of memory
+ */
+int metrics_render(buf_t *out)
+{
+        char name[64], label[64];
+        hist_t h;
+        uint64_t v;
+
+        if (!metrics)
+                return 0;
+
+        for (int c = 0; c < NCOUNTERS; ++c) {
+                v = 0;
+                for (int k = 0; k < METRICSHARDS; ++k)
+                        v += __atomic_load_n(&metrics->shards[k].counters[c], __ATOMIC_RELAXED);
+                if (put(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counters[c][0], counters[c][1],
+                        counters[c][0], counters[c][0], (unsigned long long) v) < 0)
+                        return -1;
+        }
+        for (int g = 0; g < NGAUGES; ++g) {
+                if (put(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauges[g][0], gauges[g][1],
+                        gauges[g][0], gauges[g][0],
+                        (long long) __atomic_load_n(&metrics->gauges[g], __ATOMIC_RELAXED)) < 0)
+                        return -1;
+        }
+
+        for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); ++f) {
+                for (int pass = 0; pass < 2; ++pass) {
+                        snprintf(name, sizeof(name), pass ? "%s_quantile_seconds" : "%s_seconds", families[f].name);
+                        if (put(out, "# HELP %s %s%s\n# TYPE %s %s\n", name, families[f].help,
+                                pass ? ", quantiles" : "", name, pass ? "gauge" : "histogram") < 0)
+                                return -1;
+                        for (int i = families[f].first; i <= families[f].last; ++i) {
+                                total(i, &h);
+                                if (!h.count && families[f].first != families[f].last)
+                                        continue;
+                                if (families[f].first == families[f].last)
+                                        label[0] = '\0';
+                                else
+                                        snprintf(label, sizeof(label), "op=\"%s\"", i ? proto_opname(i) : "unknown");
+                                if ((pass ? quantiles : histogram)(out, name, label, &h) < 0)
+                                        return -1;
+                        }
+                }
+        }
+        return 0;
+}
+
+
+/* a socket listening on the loopback interface only, for the scraper: -1 on error */
+int metrics_listen(const char *port)
+{
+        struct addrinfo hints, *p, *listp;
+        int fd = -1, reuse = 1;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;        /* no AI_PASSIVE: the loopback address */
+
+        if (getaddrinfo(NULL, port, &hints, &listp))
+                return -1;
+        for (p = listp; p; p = p->ai_next) {
+                if ((fd = socket(p->ai_family, p->ai_socktype, 0)) < 0)
+                        continue;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+                if (!bind(fd, p->ai_addr, p->ai_addrlen) && !listen(fd, 8))
+                        break;
+                close(fd);
+                fd = -1;
+        }
+        freeaddrinfo(listp);
+        return fd;
+}
+
+
+/**
+ * @brief Answer every connection to listenfd with the numbers of the node
+ * as a minimal HTTP response, whatever it asks for, as Prometheus scrapes
+ * them. Does not return.
+ */
+void metrics_export(int listenfd)
+{
+        char req[1024];
+        buf_t out;
+        char hdr[160];
+        int fd, n;
+
+        buf_init(&out);
+        while (1) {
+                if ((fd = accept(listenfd, NULL, NULL)) < 0)
+                        continue;
+
+                /* the request itself does not matter */
+                recv(fd, req, sizeof(req), 0);
+
+                out.len = 0;
+                if (metrics_render(&out) < 0) {
+                        close(fd);
+                        continue;
+                }
+                n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n\r\n", out.len);
+                if (send(fd, hdr, n, MSG_MORE) >= 0)
+                        send(fd, out.data, out.len, 0);
+                close(fd);
+        }
+}
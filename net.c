@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net.h"
+#include "tune.h"
+#include "tls.h"
+
+
+/**
+ * @brief Create a new listen socket and start listening for connections.
+ *
+ * @param port : port number for the server to connect
+ */
+int open_listenfd(char *port)
+{
+        int listenfd, err;
+        struct addrinfo *p, *listp;
+        struct addrinfo hints;
+
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;                /* TCP connection */
+        hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;    /* Using any IP addr */
+        hints.ai_flags |= AI_NUMERICSERV;               /* Using port number */
+
+        if ((err = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+                fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(err));
+                exit(1);
+        }
+
+        /* Walk the list for one that we can successfully connect to */
+        for (p = listp; p; p = p->ai_next) {
+                if ((listenfd = server_init(p->ai_socktype, p->ai_addr, p->ai_addrlen, QLEN)) >= 0)
+                        break;          /* Success */
+        }
+
+        freeaddrinfo(listp);
+
+        if (!p) /* All connects failed */
+                return -1;
+
+        return listenfd;
+}
+
+/**
+ * @brief Initialize the server.
+ *
+ * @param type : type of the socket (SOCK_STREAM for TCP protocol)
+ * @param addr : socket address for the server
+ * @param alen : size of addr
+ * @param backlog : number of outstanding connect requests that can be enqueued
+ * @return int : If the server set up succeeds, zero is returned.
+ * On error, -1 is returned, and errno is set appropriately.
+ */
+int server_init(int type, const struct sockaddr *addr, socklen_t alen, int backlog)
+{
+        int sockfd;
+        int err = 0;
+        int reuse = 1;
+
+        if ((sockfd = socket(addr->sa_family, type, 0)) < 0)
+                return -1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0)
+                goto errout;
+        if (bind(sockfd, addr, alen) < 0)
+                goto errout;
+        if (type == SOCK_STREAM || type == SOCK_SEQPACKET) {
+                if (listen(sockfd, backlog) < 0)
+                        goto errout;
+        }
+
+        return sockfd;
+
+errout:
+        perror("server init failed");
+        err = errno;
+        close(sockfd);
+        errno = err;
+        return -1;
+}
+
+/**
+ * @brief Create a new client socket and connect to the server
+ *
+ * @param hostname : hostname for the server to connect
+ * @param port : port number for the server to connect
+ */
+int open_clientfd(char *hostname, char *port)
+{
+        int clientfd, err;
+        struct addrinfo *p, *listp;
+        struct addrinfo hints;
+
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;        /* TCP connection */
+        hints.ai_flags = AI_NUMERICSERV;        /* Using numeric port number */
+        hints.ai_flags |= AI_ADDRCONFIG;        /* Query for whichever address type is configured */
+
+        if ((err = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+                fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(err));
+                exit(1);
+        }
+
+        /* Walk the list for one that we can successfully connect to */
+        for (p = listp; p; p = p->ai_next) {
+                if ((clientfd = connect_retry(p->ai_family, p->ai_socktype, p->ai_protocol, p->ai_addr, p->ai_addrlen)) < 0)
+                        err = errno;    /* Failed! Try the next one */
+                else
+                        break;          /* Success */
+        }
+
+        freeaddrinfo(listp);
+
+        if (!p) {       /* All connects failed */
+                fprintf(stderr, "can't connect to %s\n", hostname);
+                return -1;
+        }
+
+        tune_socket(clientfd, hostname);
+        return tls_connect(clientfd, hostname);
+}
+
+/**
+ * @brief Use the exponential backoff algorithm to keep trying
+ * to connect to the server. If the call to connect fails, the
+ * process goes to sleep for a short time and then tries again,
+ * increasing the delay each time through the loop, up to a
+ * maximum delay of about 2 minutes.
+ *
+ * @param domain: communication domain; this selects the protocol
+ * family which will be used for communication.
+ * @param type : type of the socket (SOCK_STREAM for TCP protocol)
+ * @param protocol : particular protocol if default protocol unused
+ * @param addr : socket address of the server
+ * @param alen : size of addr
+ * @return int : If the connection or binding succeeds, zero is
+ * returned. On error, -1 is returned, and errno is set appropriately.
+ */
+int connect_retry(int domain, int type, int protocol, const struct sockaddr *addr, socklen_t alen)
+{
+        int sockfd, numsec;
+
+        /* Try to connect with exponential backoff */
+        for (numsec = 1; numsec <= MAXSLEEP; numsec <<= 1) {
+                if ((sockfd = socket(domain, type, protocol)) < 0)
+                        return -1;
+
+                if (!connect(sockfd, addr, alen))
+                        /* Connection accepted */
+                        return sockfd;
+
+                close(sockfd);
+
+                /* Delay before trying again */
+                if (numsec <= MAXSLEEP / 2)
+                        sleep(numsec);
+        }
+
+        /* Failed! */
+        return -1;
+}
+
+int set_cloexec(int fd)
+{
+        int val;
+
+        if ((val = fcntl(fd, F_GETFD, 0)) < 0)
+                return -1;
+
+        val |= FD_CLOEXEC;                /* enable close-on-exec */
+
+        return fcntl(fd, F_SETFD, val);
+}
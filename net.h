@@ -0,0 +1,20 @@
+#ifndef NET_H
+#define NET_H
+
+#include <sys/socket.h>
+
+/*
+ * Sockets: what the server, the mirror and the client all open the same
+ * way.
+ */
+
+#define QLEN            5               /* connections waiting to be accepted */
+#define MAXSLEEP        128             /* seconds between the last connect attempts */
+
+int open_listenfd(char *port);
+int server_init(int type, const struct sockaddr *addr, socklen_t alen, int backlog);
+int open_clientfd(char *hostname, char *port);
+int connect_retry(int domain, int type, int protocol, const struct sockaddr *addr, socklen_t alen);
+int set_cloexec(int fd);
+
+#endif
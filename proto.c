@@ -0,0 +1,570 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "proto.h"
+
+#define DELIMS          " \t\r\n"
+#define RBUFSIZE        4096
+
+/* command names indexed by opcode */
+static const char *opnames[] = {
+        NULL,
+        "HELLO",
+        "findfile",
+        "sgetfiles",
+        "dgetfiles",
+        "getfiles",
+        "gettargz",
+        "quit",
+        "MIRROR",
+        "getrange",
+        "getshard",
+        "resume",
+        "hashfile",
+        "findglob",
+        "findre",
+        "getglob",
+        "getre",
+        "query",
+        "getquery",
+        "list",
+        "STATS",
+};
+
+
+const char *proto_opname(int op)
+{
+        if (op <= 0 || op > OP_MAXREQ)
+                return NULL;
+        return opnames[op];
+}
+
+
+int proto_opcode(const char *name)
+{
+        for (int op = 1; op <= OP_MAXREQ; ++op) {
+                if (!strcmp(name, opnames[op]))
+                        return op;
+        }
+        return 0;
+}
+
+
+/**
+ * @brief Split a command line into space separated words, in place.
+ *
+ * @param buf : the command line, it is modified
+ * @param argv : arguments list to be set, NULL terminated
+ * @param max : number of slots in argv, including the NULL
+ * @return int : argc on success, -1 on a blank line or too many words
+ */
+int proto_parse(char *buf, char *argv[], int max)
+{
+        int argc = 0;
+
+        while (1) {
+                /* skipping leading spaces */
+                while (*buf && strchr(DELIMS, *buf)) ++buf;
+                if (!*buf)
+                        break;
+
+                if (argc == max - 1)
+                        return -1;
+
+                /* copy argument */
+                argv[argc++] = buf;
+                buf += strcspn(buf, DELIMS);
+                if (*buf)
+                        *buf++ = '\0';
+        }
+        argv[argc] = NULL;
+
+        /* blank line */
+        if (!argc) return -1;
+
+        return argc;
+}
+
+
+void buf_init(buf_t *b)
+{
+        buf_init_arena(b, NULL);
+}
+
+
+/* a buffer whose memory comes from an arena and goes with it */
+void buf_init_arena(buf_t *b, arena_t *a)
+{
+        b->data = NULL;
+        b->len = 0;
+        b->cap = 0;
+        b->arena = a;
+}
+
+
+void buf_free(buf_t *b)
+{
+        if (!b->arena)
+                free(b->data);
+        buf_init_arena(b, b->arena);
+}
+
+
+int buf_put(buf_t *b, const void *data, size_t len)
+{
+        char *p;
+        size_t cap = b->cap ? b->cap : 256;
+
+        while (cap < b->len + len)
+                cap <<= 1;
+        if (cap != b->cap) {
+                p = b->arena ? arena_grow(b->arena, b->data, b->cap, cap) : realloc(b->data, cap);
+                if (!p)
+                        return -1;
+                b->data = p;
+                b->cap = cap;
+        }
+
+        memcpy(b->data + b->len, data, len);
+        b->len += len;
+        return 0;
+}
+
+
+void frame_pack(char *hdr, int op, int flags, uint32_t id, uint32_t len)
+{
+        uint16_t f = htons(flags);
+
+        hdr[0] = (char) FRAME_MAGIC;
+        hdr[1] = (char) op;
+        memcpy(hdr + 2, &f, 2);
+        id = htonl(id);
+        memcpy(hdr + 4, &id, 4);
+        len = htonl(len);
+        memcpy(hdr + 8, &len, 4);
+}
+
+
+void frame_unpack(const char *hdr, frame_t *f)
+{
+        uint16_t flags;
+        uint32_t id, len;
+
+        memcpy(&flags, hdr + 2, 2);
+        memcpy(&id, hdr + 4, 4);
+        memcpy(&len, hdr + 8, 4);
+
+        f->op = (uint8_t) hdr[1];
+        f->flags = ntohs(flags);
+        f->id = ntohl(id);
+        f->len = ntohl(len);
+}
+
+
+/**
+ * @brief Start a frame at the end of b; its length is filled in by
+ * frame_end().
+ *
+ * @return int : offset of the frame in b, or -1 if out of memory
+ */
+int frame_begin(buf_t *b, int op, int flags, uint32_t id)
+{
+        char hdr[FRAME_HDRLEN];
+        size_t start = b->len;
+
+        frame_pack(hdr, op, flags, id, 0);
+        if (buf_put(b, hdr, FRAME_HDRLEN) < 0)
+                return -1;
+        return start;
+}
+
+
+int frame_arg(buf_t *b, int type, const void *val, uint32_t len)
+{
+        char tl[TLV_HDRLEN];
+        uint32_t n = htonl(len);
+
+        tl[0] = (char) type;
+        memcpy(tl + 1, &n, 4);
+        if (buf_put(b, tl, TLV_HDRLEN) < 0 || buf_put(b, val, len) < 0)
+                return -1;
+        return 0;
+}
+
+
+void frame_end(buf_t *b, size_t start)
+{
+        uint32_t len = htonl(b->len - start - FRAME_HDRLEN);
+
+        memcpy(b->data + start + 8, &len, 4);
+}
+
+
+/**
+ * @brief Encode a text command line as a request frame.
+ *
+ * @param b : the frame is appended here
+ * @param line : the command line, e.g. "gettargz c txt\n"
+ * @param id : request id
+ * @return int : 0 on success, -1 on an empty line or unknown command
+ */
+int proto_encode_line(buf_t *b, char *line, uint32_t id, int flags)
+{
+        char *copy, **argv;
+        int argc, op, start, ret = -1;
+        size_t max = strlen(line) / 2 + 2;      /* at most every other char starts a word */
+
+        copy = strdup(line);
+        argv = malloc(max * sizeof(char*));
+        if (!copy || !argv)
+                goto out;
+
+        if ((argc = proto_parse(copy, argv, max)) < 0 || !(op = proto_opcode(argv[0])))
+                goto out;
+
+        if ((start = frame_begin(b, op, flags, id)) < 0)
+                goto out;
+        for (int i = 1; i < argc; ++i) {
+                if (frame_arg(b, TLV_STR, argv[i], strlen(argv[i])) < 0)
+                        goto out;
+        }
+        frame_end(b, start);
+        ret = 0;
+
+out:
+        free(copy);
+        free(argv);
+        return ret;
+}
+
+
+/*
+ * Lay out argv, argl and the argument bytes in one allocation so that a
+ * request is released with a single free(), or with its arena.
+ */
+static int request_alloc(request_t *req, int argc, size_t bytes)
+{
+        size_t vec = (argc + 1) * sizeof(char*) + argc * sizeof(uint32_t);
+
+        req->mem = req->arena ? arena_alloc(req->arena, vec + bytes) : malloc(vec + bytes);
+        if (!req->mem)
+                return -1;
+
+        req->argc = argc;
+        req->argv = (char**) req->mem;
+        req->argl = (uint32_t*) (req->mem + (argc + 1) * sizeof(char*));
+        req->argv[argc] = NULL;
+        return vec;
+}
+
+
+/**
+ * @brief Decode the TLV payload of a request frame into an argv list.
+ * Every argument is copied and NUL terminated; argv[0] is the command
+ * name for the opcode.
+ *
+ * @return int : 0 on success, -1 on a malformed payload
+ */
+int proto_decode(const frame_t *f, const char *payload, request_t *req)
+{
+        const char *name = proto_opname(f->op);
+        uint32_t pos, len;
+        size_t bytes;
+        char *p;
+        int argc, off;
+
+        if (!name)
+                name = "unknown";
+
+        /* first pass: validate and size */
+        argc = 1;
+        bytes = strlen(name) + 1;
+        for (pos = 0; pos < f->len; pos += TLV_HDRLEN + len) {
+                if (f->len - pos < TLV_HDRLEN)
+                        return -1;
+                memcpy(&len, payload + pos + 1, 4);
+                len = ntohl(len);
+                if (f->len - pos - TLV_HDRLEN < len)
+                        return -1;
+                bytes += len + 1;
+                ++argc;
+        }
+
+        if ((off = request_alloc(req, argc, bytes)) < 0)
+                return -1;
+
+        req->text = 0;
+        req->op = f->op;
+        req->flags = f->flags;
+        req->id = f->id;
+
+        /* second pass: copy */
+        p = req->mem + off;
+        req->argv[0] = strcpy(p, name);
+        req->argl[0] = strlen(name);
+        p += req->argl[0] + 1;
+
+        argc = 1;
+        for (pos = 0; pos < f->len; pos += TLV_HDRLEN + len) {
+                memcpy(&len, payload + pos + 1, 4);
+                len = ntohl(len);
+                memcpy(p, payload + pos + TLV_HDRLEN, len);
+                p[len] = '\0';
+                req->argv[argc] = p;
+                req->argl[argc++] = len;
+                p += len + 1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Decode a legacy text command line into a request.
+ *
+ * @return int : 0 on success, -1 on a blank line
+ */
+int proto_decode_text(char *line, request_t *req)
+{
+        size_t len = strlen(line);
+        int max = len / 2 + 2;
+        int off;
+        char *copy;
+
+        if ((off = request_alloc(req, max - 1, len + 1)) < 0)
+                return -1;
+
+        copy = memcpy(req->mem + off, line, len + 1);
+        if ((req->argc = proto_parse(copy, req->argv, max)) < 0) {
+                request_free(req);
+                return -1;
+        }
+
+        for (int i = 0; i < req->argc; ++i)
+                req->argl[i] = strlen(req->argv[i]);
+
+        req->text = 1;
+        req->op = proto_opcode(req->argv[0]);
+        req->flags = 0;
+        req->id = 0;
+        return 0;
+}
+
+
+void request_free(request_t *req)
+{
+        if (!req->arena)
+                free(req->mem);
+        req->mem = NULL;
+        req->argv = NULL;
+        req->argc = 0;
+}
+
+
+int rb_init(rbuf_t *rb, int fd)
+{
+        rb->fd = fd;
+        rb->start = rb->end = 0;
+        rb->cap = RBUFSIZE;
+        return (rb->data = malloc(RBUFSIZE)) ? 0 : -1;
+}
+
+
+void rb_free(rbuf_t *rb)
+{
+        free(rb->data);
+        rb->data = NULL;
+}
+
+
+/*
+ * Make sure at least n bytes are buffered.
+ * Returns 1 on success, 0 on end of file and -1 on error.
+ */
+static int rb_fill(rbuf_t *rb, size_t n)
+{
+        long nrecv;
+        size_t cap;
+        char *p;
+
+        while (rb->end - rb->start < n) {
+                /* move what is left to the front, then grow if it still doesn't fit */
+                if (rb->start) {
+                        memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+                        rb->end -= rb->start;
+                        rb->start = 0;
+                }
+                for (cap = rb->cap; cap < n; cap <<= 1)
+                        ;
+                if (cap != rb->cap) {
+                        if (!(p = realloc(rb->data, cap)))
+                                return -1;
+                        rb->data = p;
+                        rb->cap = cap;
+                }
+
+                if ((nrecv = recv(rb->fd, rb->data + rb->end, rb->cap - rb->end, 0)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                if (!nrecv)
+                        return 0;
+                rb->end += nrecv;
+        }
+
+        return 1;
+}
+
+
+/**
+ * @brief Read up to n bytes, taking buffered data first. Large reads with
+ * an empty buffer go straight from the socket into dst.
+ *
+ * @return long : number of bytes read, 0 on end of file, -1 on error
+ */
+long rb_read(rbuf_t *rb, void *dst, size_t n)
+{
+        size_t avail = rb->end - rb->start;
+        long nrecv;
+
+        if (avail) {
+                if (n > avail)
+                        n = avail;
+                memcpy(dst, rb->data + rb->start, n);
+                rb->start += n;
+                return n;
+        }
+
+        while ((nrecv = recv(rb->fd, dst, n, 0)) < 0 && errno == EINTR)
+                ;
+        return nrecv;
+}
+
+
+/* read exactly n bytes: 1 on success, 0 on end of file, -1 on error */
+int rb_readn(rbuf_t *rb, void *dst, size_t n)
+{
+        long nread;
+
+        while (n) {
+                if ((nread = rb_read(rb, dst, n)) <= 0)
+                        return nread;
+                dst = (char*) dst + nread;
+                n -= nread;
+        }
+        return 1;
+}
+
+
+/* read a frame header: 1 on success, 0 on end of file, -1 on error */
+int rb_frame(rbuf_t *rb, frame_t *f)
+{
+        char hdr[FRAME_HDRLEN];
+        int ret;
+
+        if ((ret = rb_readn(rb, hdr, FRAME_HDRLEN)) <= 0)
+                return ret;
+        if ((unsigned char) hdr[0] != FRAME_MAGIC)
+                return -1;
+
+        frame_unpack(hdr, f);
+        return 1;
+}
+
+
+/*
+ * Skip a request too long to be read, a frame (f) or a text line, without
+ * buffering it, and leave in req what its answer needs.
+ * Returns -2 once it is skipped, 0 on end of file and -1 on error.
+ */
+static int toolong(rbuf_t *rb, request_t *req, const frame_t *f)
+{
+        uint64_t left = f ? FRAME_HDRLEN + (uint64_t) f->len : 0;
+        char *nl = NULL;
+        size_t n;
+        int ret;
+
+        req->text = !f;
+        req->op = f ? f->op : 0;
+        req->flags = f ? f->flags : 0;
+        req->id = f ? f->id : 0;
+        req->argc = 0;
+        req->argv = NULL;
+        req->argl = NULL;
+        req->mem = NULL;
+
+        while (f ? left > 0 : !nl) {
+                if ((ret = rb_fill(rb, 1)) <= 0)
+                        return ret;
+                n = rb->end - rb->start;
+                if (f) {
+                        if (n > left)
+                                n = left;
+                        left -= n;
+                } else if ((nl = memchr(rb->data + rb->start, '\n', n))) {
+                        n = nl - (rb->data + rb->start) + 1;
+                }
+                rb->start += n;
+        }
+        return -2;
+}
+
+
+/**
+ * @brief Read the next request from the connection, whichever protocol
+ * the peer speaks. Blank text lines are skipped.
+ *
+ * @param rb : reader over the connection
+ * @param req : the decoded request, release it with request_free()
+ * @return int : 1 on success, 0 on end of file, -1 on error, -2 if the
+ * request was too long and skipped: only its text, op, flags and id are set
+ */
+int proto_recv(rbuf_t *rb, request_t *req)
+{
+        frame_t f;
+        size_t scanned;
+        char *line, *nl;
+        int ret;
+
+        while (1) {
+                if ((ret = rb_fill(rb, 1)) <= 0)
+                        return ret;
+
+                if ((unsigned char) rb->data[rb->start] == FRAME_MAGIC) {
+                        if ((ret = rb_fill(rb, FRAME_HDRLEN)) <= 0)
+                                return ret ? ret : -1;
+                        frame_unpack(rb->data + rb->start, &f);
+                        if (f.len > REQ_MAXLEN)
+                                return toolong(rb, req, &f);
+                        if ((ret = rb_fill(rb, FRAME_HDRLEN + f.len)) <= 0)
+                                return ret ? ret : -1;
+
+                        ret = proto_decode(&f, rb->data + rb->start + FRAME_HDRLEN, req);
+                        rb->start += FRAME_HDRLEN + f.len;
+                        return ret < 0 ? -1 : 1;
+                }
+
+                /* text: wait for the end of the line */
+                scanned = 0;
+                while (!(nl = memchr(rb->data + rb->start + scanned, '\n', rb->end - rb->start - scanned))) {
+                        scanned = rb->end - rb->start;
+                        if (scanned > REQ_MAXLINE)
+                                return toolong(rb, req, NULL);
+                        if ((ret = rb_fill(rb, scanned + 1)) <= 0)
+                                return ret;
+                }
+                line = rb->data + rb->start;
+                if (nl - line > REQ_MAXLINE)
+                        return toolong(rb, req, NULL);
+
+                *nl = '\0';
+                rb->start = nl - rb->data + 1;
+                if (strspn(line, DELIMS) == (size_t) (nl - line))
+                        continue;
+                return proto_decode_text(line, req) < 0 ? -1 : 1;
+        }
+}
@@ -0,0 +1,141 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/*
+ * Wire protocol shared by the client, the server and the mirror.
+ *
+ * A request is either a legacy text line ("findfile t1.txt\n") or a
+ * binary frame. Frames start with FRAME_MAGIC, which can never start a
+ * text command, so both kinds can be told apart by their first byte:
+ *
+ *      0      1      2             4             8            12
+ *      +------+------+-------------+-------------+-------------+---------
+ *      | 0xF7 |  op  |    flags    |     id      |     len     | payload
+ *      +------+------+-------------+-------------+-------------+---------
+ *
+ * All integers are in network byte order. The payload of a request is a
+ * sequence of TLV arguments (1 byte type, 4 bytes length, value); the
+ * payload of a response depends on its opcode. The payload of a request
+ * may take up to REQ_MAXLEN bytes, a text request REQ_MAXLINE bytes before
+ * its newline; longer ones are skipped and answered with an error.
+ */
+
+#define FRAME_MAGIC     0xF7
+#define FRAME_HDRLEN    12
+#define TLV_HDRLEN      5
+#define REQ_MAXLEN      (64U << 20)     /* a manifest of a million files or so */
+#define REQ_MAXLINE     128             /* MAXLINE of the legacy client and server */
+
+/* request opcodes, in the same order as the text command names */
+#define OP_HELLO        1
+#define OP_FINDFILE     2
+#define OP_SGETFILES    3
+#define OP_DGETFILES    4
+#define OP_GETFILES     5
+#define OP_GETTARGZ     6
+#define OP_QUIT         7
+#define OP_MIRROR       8
+#define OP_GETRANGE     9
+#define OP_GETSHARD     10
+#define OP_RESUME       11
+#define OP_HASHFILE     12
+#define OP_FINDGLOB     13
+#define OP_FINDRE       14
+#define OP_GETGLOB      15
+#define OP_GETRE        16
+#define OP_QUERY        17
+#define OP_GETQUERY     18
+#define OP_LIST         19
+#define OP_STATS        20
+#define OP_MAXREQ       20
+
+/* response opcodes */
+#define OP_OK           0x40    /* payload: text result */
+#define OP_ERR          0x41    /* payload: text error */
+#define OP_BUSY         0x42    /* payload: "host port" of the mirror */
+#define OP_FILE         0x43    /* payload: 64-bit size, then the content id if cached */
+#define OP_DATA         0x44    /* payload: the next piece of the archive */
+#define OP_META         0x45    /* payload: "cid size nfiles port" of a prepared archive */
+#define OP_SUM          0x46    /* payload: 64-bit XXH64 of the archive bytes just sent */
+#define OP_ENTRIES      0x47    /* payload: entries of a listing, "path\tsize\tctime\n" each */
+#define OP_RETRY        0x48    /* payload: seconds to wait before sending the request again */
+
+/* request flags */
+#define FL_PREPARE      0x0001  /* build the archive but only describe it */
+#define FL_MANIFEST     0x0002  /* the last argument lists the files the client holds */
+#define FL_ORDERED      0x0004  /* start only once every earlier request is answered */
+#define FL_STORED       0x0008  /* an uncompressed tar, streamed from the files themselves */
+
+/* argument types */
+#define TLV_STR         1
+#define TLV_BLOB        2
+
+typedef struct {
+        uint8_t op;
+        uint16_t flags;
+        uint32_t id;
+        uint32_t len;           /* payload length */
+} frame_t;
+
+typedef struct {
+        int text;               /* 1 if it came in as a text line */
+        uint8_t op;             /* 0 for unknown text commands */
+        uint16_t flags;
+        uint32_t id;
+        int argc;
+        char **argv;            /* argv[0] is the command name, NULL terminated */
+        uint32_t *argl;         /* length of each argument */
+        char *mem;              /* one allocation backs all of the above */
+        arena_t *arena;         /* where mem comes from, NULL for malloc() */
+} request_t;
+
+typedef struct {
+        char *data;
+        size_t len;
+        size_t cap;
+        arena_t *arena;         /* where data comes from, NULL for malloc() */
+} buf_t;
+
+/* buffered reader over a connected socket */
+typedef struct {
+        int fd;
+        char *data;
+        size_t start;
+        size_t end;
+        size_t cap;
+} rbuf_t;
+
+const char *proto_opname(int op);
+int proto_opcode(const char *name);
+
+int proto_parse(char *buf, char *argv[], int max);
+
+void buf_init(buf_t *b);
+void buf_init_arena(buf_t *b, arena_t *a);
+void buf_free(buf_t *b);
+int buf_put(buf_t *b, const void *data, size_t len);
+
+int frame_begin(buf_t *b, int op, int flags, uint32_t id);
+int frame_arg(buf_t *b, int type, const void *val, uint32_t len);
+void frame_end(buf_t *b, size_t start);
+void frame_pack(char *hdr, int op, int flags, uint32_t id, uint32_t len);
+void frame_unpack(const char *hdr, frame_t *f);
+
+int proto_encode_line(buf_t *b, char *line, uint32_t id, int flags);
+int proto_decode(const frame_t *f, const char *payload, request_t *req);
+int proto_decode_text(char *line, request_t *req);
+void request_free(request_t *req);
+
+int rb_init(rbuf_t *rb, int fd);
+void rb_free(rbuf_t *rb);
+long rb_read(rbuf_t *rb, void *dst, size_t n);
+int rb_readn(rbuf_t *rb, void *dst, size_t n);
+int rb_frame(rbuf_t *rb, frame_t *f);
+int proto_recv(rbuf_t *rb, request_t *req);
+
+#endif
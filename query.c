@@ -0,0 +1,717 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <ftw.h>
+#include <fnmatch.h>
+
+#include "bitmap.h"
+#include "query.h"
+
+#define MAXTOKEN        1024
+#define MAXDEPTH        64              /* nesting of parentheses and not */
+
+enum { Q_AND, Q_OR, Q_NOT, Q_SIZE, Q_MTIME, Q_CTIME, Q_EXT, Q_NAME, Q_PATH };
+enum { T_END, T_WORD, T_OP, T_LPAREN, T_RPAREN };
+
+typedef struct qnode {
+        int kind;
+        struct qnode *l, *r;            /* operands of and, or, not */
+        int64_t lo, hi;                 /* size and times: the range they must be in */
+        char *str;                      /* ext, name and path */
+        int glob;                       /* the name has wildcards */
+        uint32_t est;                   /* files it is expected to select */
+} qnode_t;
+
+/* a parse in progress, one token ahead */
+typedef struct {
+        const char *p;
+        int type;
+        char tok[MAXTOKEN];
+        int depth;
+        char *err;
+        size_t errlen;
+} parser_t;
+
+/* what a predicate looks at, from the index or from stat() */
+typedef struct {
+        const char *path;
+        const char *name;
+        int64_t size;
+        int64_t mtime;
+        int64_t ctime;
+} file_t;
+
+static const struct {
+        const char *name;
+        int kind;
+} fields[] = {
+        { "size", Q_SIZE }, { "mtime", Q_MTIME }, { "ctime", Q_CTIME },
+        { "ext", Q_EXT }, { "name", Q_NAME }, { "path", Q_PATH },
+};
+
+/* the query of the walk without an index */
+static __thread const qnode_t *walking;
+static __thread plist_t *walkout;
+
+static qnode_t *expr(parser_t *ps);
+
+
+static void next(parser_t *ps)
+{
+        size_t len = 0;
+
+        while (isspace((unsigned char) *ps->p))
+                ++ps->p;
+
+        if (!*ps->p) {
+                ps->type = T_END;
+                strcpy(ps->tok, "end of query");
+                return;
+        }
+        if (*ps->p == '(' || *ps->p == ')') {
+                ps->type = *ps->p == '(' ? T_LPAREN : T_RPAREN;
+                ps->tok[len++] = *ps->p++;
+        } else if (strchr("<>=!", *ps->p)) {
+                ps->type = T_OP;
+                ps->tok[len++] = *ps->p++;
+                if (*ps->p == '=')
+                        ps->tok[len++] = *ps->p++;
+        } else {
+                ps->type = T_WORD;
+                while (*ps->p && !isspace((unsigned char) *ps->p) && !strchr("()<>=!", *ps->p)) {
+                        if (len < MAXTOKEN - 1)
+                                ps->tok[len++] = *ps->p;
+                        ++ps->p;
+                }
+        }
+        ps->tok[len] = '\0';
+}
+
+
+static qnode_t *fail(parser_t *ps, const char *what)
+{
+        if (!ps->err[0])
+                snprintf(ps->err, ps->errlen, "%s, found '%s'", what, ps->tok);
+        return NULL;
+}
+
+
+static qnode_t *node(int kind, qnode_t *l, qnode_t *r)
+{
+        qnode_t *q = calloc(1, sizeof(qnode_t));
+
+        if (q) {
+                q->kind = kind;
+                q->l = l;
+                q->r = r;
+        }
+        return q;
+}
+
+
+static void qfree(qnode_t *q)
+{
+        if (!q)
+                return;
+        qfree(q->l);
+        qfree(q->r);
+        free(q->str);
+        free(q);
+}
+
+
+static int keyword(const parser_t *ps, const char *word)
+{
+        return ps->type == T_WORD && !strcasecmp(ps->tok, word);
+}
+
+
+/* a size: digits with an optional K, M, G or T suffix, in powers of 1024 */
+static int size(const char *s, int64_t *v)
+{
+        char *end;
+        int shift = 0;
+
+        *v = strtoll(s, &end, 10);
+        if (end == s || *v < 0)
+                return -1;
+        switch (toupper((unsigned char) *end)) {
+        case 'K': shift = 10; ++end; break;
+        case 'M': shift = 20; ++end; break;
+        case 'G': shift = 30; ++end; break;
+        case 'T': shift = 40; ++end; break;
+        }
+        if (shift && toupper((unsigned char) *end) == 'B')
+                ++end;
+        if (*end || *v > INT64_MAX >> shift)
+                return -1;
+        *v <<= shift;
+        return 0;
+}
+
+
+/*
+ * A time: YYYY-MM-DD for the whole day, YYYY-MM-DDTHH:MM[:SS] in local
+ * time, or -N followed by s, m, h, d or w for that long ago. Sets the
+ * first and last second it stands for.
+ */
+static int when(const char *s, int64_t *t0, int64_t *t1)
+{
+        struct tm tm;
+        char *end;
+        long long n;
+        int64_t unit;
+
+        if (*s == '-') {
+                n = strtoll(s + 1, &end, 10);
+                if (end == s + 1 || end[0] == '\0' || end[1] != '\0' || n < 0)
+                        return -1;
+                switch (*end) {
+                case 's': unit = 1; break;
+                case 'm': unit = 60; break;
+                case 'h': unit = 3600; break;
+                case 'd': unit = 86400; break;
+                case 'w': unit = 604800; break;
+                default: return -1;
+                }
+                *t0 = *t1 = time(NULL) - n * unit;
+                return 0;
+        }
+
+        memset(&tm, 0, sizeof(tm));
+        if (!(end = strptime(s, "%Y-%m-%d", &tm)))
+                return -1;
+        tm.tm_isdst = -1;
+        if (!*end) {
+                *t0 = mktime(&tm);
+                *t1 = *t0 + 86399;
+                return 0;
+        }
+        if (!(end = strptime(end, "T%H:%M", &tm)))
+                return -1;
+        if (*end == ':' && !(end = strptime(end, ":%S", &tm)))
+                return -1;
+        if (*end)
+                return -1;
+        *t0 = *t1 = mktime(&tm);
+        return 0;
+}
+
+
+/* field op value */
+static qnode_t *predicate(parser_t *ps)
+{
+        qnode_t *q;
+        char op[3];
+        int kind = -1;
+        int64_t v0, v1;
+
+        if (ps->type != T_WORD)
+                return fail(ps, "Expected a field");
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+                if (!strcasecmp(ps->tok, fields[i].name))
+                        kind = fields[i].kind;
+        }
+        if (kind < 0)
+                return fail(ps, "Unknown field (size, mtime, ctime, ext, name, path)");
+
+        next(ps);
+        if (ps->type != T_OP)
+                return fail(ps, "Expected a comparison");
+        strcpy(op, ps->tok);
+        if (!strcmp(op, "!"))
+                return fail(ps, "Unknown comparison");
+
+        next(ps);
+        if (ps->type != T_WORD)
+                return fail(ps, "Expected a value");
+
+        if (!(q = node(kind, NULL, NULL)))
+                return fail(ps, "Out of memory");
+
+        if (kind == Q_EXT || kind == Q_NAME || kind == Q_PATH) {
+                if (strcmp(op, "=") && strcmp(op, "!=")) {
+                        qfree(q);
+                        return fail(ps, "Names only compare with = and !=");
+                }
+                /* ext=.c is ext=c */
+                if (!(q->str = strdup(kind == Q_EXT && ps->tok[0] == '.' ? ps->tok + 1 : ps->tok))) {
+                        qfree(q);
+                        return fail(ps, "Out of memory");
+                }
+                q->glob = kind == Q_NAME && strpbrk(q->str, "*?[") != NULL;
+        } else {
+                if (kind == Q_SIZE ? size(ps->tok, &v0) : when(ps->tok, &v0, &v1)) {
+                        qfree(q);
+                        return fail(ps, kind == Q_SIZE ? "Bad size" : "Bad time");
+                }
+                if (kind == Q_SIZE)
+                        v1 = v0;
+                q->lo = INT64_MIN;
+                q->hi = INT64_MAX;
+                if (op[0] == '<')
+                        q->hi = op[1] ? v1 : v0 - 1;
+                else if (op[0] == '>')
+                        q->lo = op[1] ? v0 : v1 + 1;
+                else {
+                        q->lo = v0;
+                        q->hi = v1;
+                }
+        }
+        next(ps);
+
+        if (!strcmp(op, "!=") && !(q = node(Q_NOT, q, NULL)))
+                return fail(ps, "Out of memory");
+        return q;
+}
+
+
+static qnode_t *factor(parser_t *ps)
+{
+        qnode_t *q, *e;
+
+        if (++ps->depth > MAXDEPTH)
+                return fail(ps, "Query nested too deep");
+
+        if (keyword(ps, "not")) {
+                next(ps);
+                if (!(e = factor(ps)))
+                        return NULL;
+                if (!(q = node(Q_NOT, e, NULL)))
+                        qfree(e);
+        } else if (ps->type == T_LPAREN) {
+                next(ps);
+                if (!(q = expr(ps)))
+                        return NULL;
+                if (ps->type != T_RPAREN) {
+                        qfree(q);
+                        return fail(ps, "Expected ')'");
+                }
+                next(ps);
+        } else {
+                q = predicate(ps);
+        }
+
+        --ps->depth;
+        return q ? q : fail(ps, "Out of memory");
+}
+
+
+/* left associative chain of factor and factor ... */
+static qnode_t *term(parser_t *ps)
+{
+        qnode_t *l, *r, *q;
+
+        if (!(l = factor(ps)))
+                return NULL;
+        while (keyword(ps, "and")) {
+                next(ps);
+                if (!(r = factor(ps)) || !(q = node(Q_AND, l, r))) {
+                        qfree(l);
+                        qfree(r);
+                        return fail(ps, "Out of memory");
+                }
+                l = q;
+        }
+        return l;
+}
+
+
+static qnode_t *expr(parser_t *ps)
+{
+        qnode_t *l, *r, *q;
+
+        if (!(l = term(ps)))
+                return NULL;
+        while (keyword(ps, "or")) {
+                next(ps);
+                if (!(r = term(ps)) || !(q = node(Q_OR, l, r))) {
+                        qfree(l);
+                        qfree(r);
+                        return fail(ps, "Out of memory");
+                }
+                l = q;
+        }
+        return l;
+}
+
+
+static const char *extension(const char *name)
+{
+        const char *dot = strrchr(name, '.');
+
+        return dot && dot != name ? dot + 1 : "";
+}
+
+
+static int test(const qnode_t *q, const file_t *f)
+{
+        int64_t v;
+
+        switch (q->kind) {
+        case Q_AND:
+                return test(q->l, f) && test(q->r, f);
+        case Q_OR:
+                return test(q->l, f) || test(q->r, f);
+        case Q_NOT:
+                return !test(q->l, f);
+        case Q_EXT:
+                return !strcmp(extension(f->name), q->str);
+        case Q_NAME:
+                return q->glob ? !fnmatch(q->str, f->name, 0) : !strcmp(f->name, q->str);
+        case Q_PATH:
+                return !strncmp(f->path, q->str, strlen(q->str));
+        default:
+                v = q->kind == Q_SIZE ? f->size : q->kind == Q_MTIME ? f->mtime : f->ctime;
+                return v >= q->lo && v <= q->hi;
+        }
+}
+
+
+static void record(const index_t *ix, uint32_t i, file_t *f)
+{
+        f->path = index_path(ix, i);
+        f->name = index_name(ix, i);
+        f->size = ix->rec[i].size;
+        f->mtime = ix->rec[i].mtime;
+        f->ctime = ix->rec[i].ctime;
+}
+
+
+/* number of files each node selects, from the index columns */
+static uint32_t estimate(const index_t *ix, qnode_t *q)
+{
+        uint32_t first, l, r;
+
+        switch (q->kind) {
+        case Q_AND:
+                l = estimate(ix, q->l);
+                r = estimate(ix, q->r);
+                q->est = l < r ? l : r;
+                break;
+        case Q_OR:
+                l = estimate(ix, q->l);
+                r = estimate(ix, q->r);
+                q->est = (uint64_t) l + r < ix->n ? l + r : ix->n;
+                break;
+        case Q_NOT:
+                q->est = ix->n - estimate(ix, q->l);
+                break;
+        case Q_EXT:
+                q->est = index_exts(ix, q->str, &first);
+                break;
+        case Q_NAME:
+                q->est = q->glob ? ix->n : index_lookup(ix, q->str, &first);
+                break;
+        case Q_PATH:
+                q->est = index_prefix(ix, q->str, &first);
+                break;
+        default:
+                q->est = index_range(ix, q->kind == Q_SIZE ? BYSIZE : q->kind == Q_MTIME ? BYMTIME : BYCTIME,
+                                     q->lo, q->hi, &first);
+        }
+        return q->est;
+}
+
+
+/* comparisons it takes to test a file against a node */
+static double testcost(const qnode_t *q)
+{
+        switch (q->kind) {
+        case Q_AND:
+        case Q_OR:
+                return testcost(q->l) + testcost(q->r);
+        case Q_NOT:
+                return testcost(q->l);
+        case Q_NAME:
+                return q->glob ? 8 : 2;
+        case Q_EXT:
+        case Q_PATH:
+                return 2;
+        default:
+                return 1;
+        }
+}
+
+
+/* comparisons it takes to fetch the bitmap of a node */
+static double fetchcost(const index_t *ix, const qnode_t *q)
+{
+        switch (q->kind) {
+        case Q_AND:
+        case Q_OR:
+                return fetchcost(ix, q->l) + fetchcost(ix, q->r);
+        case Q_NOT:
+                return fetchcost(ix, q->l) + ix->n / BITMAP_ARRAYMAX;
+        case Q_PATH:
+                /* consecutive records: a few containers */
+                return 1 + q->est / BITMAP_ARRAYMAX;
+        case Q_NAME:
+                if (q->glob)
+                        return ix->n * testcost(q);
+                /* fall through */
+        default:
+                /* a slice of a column, sorted back into record order */
+                return q->est * log2(q->est + 2.0);
+        }
+}
+
+
+static int cmpu32(const void *a, const void *b)
+{
+        uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+
+        return (x > y) - (x < y);
+}
+
+
+static int cmpest(const void *a, const void *b)
+{
+        const qnode_t *x = *(qnode_t* const*) a, *y = *(qnode_t* const*) b;
+
+        return (x->est > y->est) - (x->est < y->est);
+}
+
+
+/* keep the members of b that pass every test in tests */
+static int filter(const index_t *ix, bitmap_t *b, qnode_t **tests, int ntests)
+{
+        uint32_t *ids, n, k = 0;
+        file_t f;
+        int ok, ret;
+
+        if (!(ids = malloc((bitmap_card(b) ? bitmap_card(b) : 1) * sizeof(uint32_t))))
+                return -1;
+        n = bitmap_ids(b, ids);
+        for (uint32_t i = 0; i < n; ++i) {
+                record(ix, ids[i], &f);
+                ok = 1;
+                for (int t = 0; t < ntests && ok; ++t)
+                        ok = test(tests[t], &f);
+                if (ok)
+                        ids[k++] = ids[i];
+        }
+
+        bitmap_free(b);
+        ret = bitmap_from(b, ids, k);
+        free(ids);
+        return ret;
+}
+
+
+static int fetch(const index_t *ix, qnode_t *q, bitmap_t *out);
+
+
+/* the operands of a chain of ands */
+static int conjuncts(qnode_t *q, qnode_t **list, int n)
+{
+        if (q->kind != Q_AND) {
+                list[n] = q;
+                return n + 1;
+        }
+        return conjuncts(q->r, list, conjuncts(q->l, list, n));
+}
+
+
+static int count(const qnode_t *q)
+{
+        return q->kind == Q_AND ? count(q->l) + count(q->r) : 1;
+}
+
+
+/**
+ * @brief Plan and run a conjunction. The most selective operand is
+ * fetched first; each of the others is then either fetched and
+ * intersected with the result, or left to be tested against the files
+ * that remain at the end, whichever the estimates make cheaper.
+ */
+static int conjunction(const index_t *ix, qnode_t *q, bitmap_t *out)
+{
+        qnode_t **list, **tests;
+        bitmap_t b, both;
+        int n = count(q), ntests = 0, ret = -1;
+        uint32_t card;
+
+        list = malloc(n * sizeof(qnode_t*));
+        tests = malloc(n * sizeof(qnode_t*));
+        if (!list || !tests)
+                goto out;
+        conjuncts(q, list, 0);
+        qsort(list, n, sizeof(qnode_t*), cmpest);
+
+        if (fetch(ix, list[0], out) < 0)
+                goto out;
+        for (int i = 1; i < n && (card = bitmap_card(out)); ++i) {
+                if (fetchcost(ix, list[i]) >= card * testcost(list[i])) {
+                        tests[ntests++] = list[i];
+                        continue;
+                }
+                bitmap_init(&b);
+                bitmap_init(&both);
+                if (fetch(ix, list[i], &b) < 0 || bitmap_and(&both, out, &b) < 0) {
+                        bitmap_free(&b);
+                        bitmap_free(&both);
+                        goto out;
+                }
+                bitmap_free(&b);
+                bitmap_free(out);
+                *out = both;
+        }
+        ret = ntests ? filter(ix, out, tests, ntests) : 0;
+
+out:
+        free(list);
+        free(tests);
+        return ret;
+}
+
+
+/* the column slice of a predicate, as a bitmap */
+static int column(const index_t *ix, const uint32_t *col, uint32_t first, uint32_t n, bitmap_t *out)
+{
+        uint32_t *ids;
+        int ret;
+
+        if (!(ids = malloc((n ? n : 1) * sizeof(uint32_t))))
+                return -1;
+        memcpy(ids, col + first, n * sizeof(uint32_t));
+        qsort(ids, n, sizeof(uint32_t), cmpu32);
+        ret = bitmap_from(out, ids, n);
+        free(ids);
+        return ret;
+}
+
+
+/* every file the node selects; out is empty on entry */
+static int fetch(const index_t *ix, qnode_t *q, bitmap_t *out)
+{
+        bitmap_t l, r;
+        uint32_t first, n, *ids;
+        file_t f;
+        int ret;
+
+        switch (q->kind) {
+        case Q_AND:
+                return conjunction(ix, q, out);
+        case Q_OR:
+        case Q_NOT:
+                bitmap_init(&l);
+                bitmap_init(&r);
+                if (q->kind == Q_OR)
+                        ret = fetch(ix, q->l, &l) < 0 || fetch(ix, q->r, &r) < 0 ? -1 : bitmap_or(out, &l, &r);
+                else
+                        ret = bitmap_range(&l, 0, ix->n) < 0 || fetch(ix, q->l, &r) < 0 ? -1 : bitmap_andnot(out, &l, &r);
+                bitmap_free(&l);
+                bitmap_free(&r);
+                return ret;
+        case Q_PATH:
+                n = index_prefix(ix, q->str, &first);
+                return bitmap_range(out, first, first + n);
+        case Q_EXT:
+                n = index_exts(ix, q->str, &first);
+                return column(ix, ix->byext, first, n, out);
+        case Q_NAME:
+                if (!q->glob) {
+                        n = index_lookup(ix, q->str, &first);
+                        return column(ix, ix->byname, first, n, out);
+                }
+                if (!(ids = malloc((ix->n ? ix->n : 1) * sizeof(uint32_t))))
+                        return -1;
+                n = 0;
+                for (uint32_t i = 0; i < ix->n; ++i) {
+                        record(ix, i, &f);
+                        if (test(q, &f))
+                                ids[n++] = i;
+                }
+                ret = bitmap_from(out, ids, n);
+                free(ids);
+                return ret;
+        case Q_SIZE:
+                n = index_range(ix, BYSIZE, q->lo, q->hi, &first);
+                return column(ix, ix->bysize, first, n, out);
+        case Q_MTIME:
+                n = index_range(ix, BYMTIME, q->lo, q->hi, &first);
+                return column(ix, ix->bymtime, first, n, out);
+        default:
+                n = index_range(ix, BYCTIME, q->lo, q->hi, &first);
+                return column(ix, ix->byctime, first, n, out);
+        }
+}
+
+
+static int visit(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+        file_t f = { fpath, fpath + ftw->base, st->st_size, st->st_mtime, st->st_ctime };
+
+        if (type != FTW_F || !test(walking, &f))
+                return 0;
+        return plist_add(walkout, fpath);
+}
+
+
+/**
+ * @brief Find the files a query selects.
+ *
+ * @param ix : the index, or an empty one to walk the tree
+ * @param root : the tree
+ * @param text : the query
+ * @param out : the selected paths are added here, in path order with an index
+ * @param err : set to the reason when the query does not parse
+ * @return int : 0 on success, -1 on error, -2 on a bad query
+ */
+int query_run(const index_t *ix, const char *root, const char *text, plist_t *out,
+              char *err, size_t errlen)
+{
+        parser_t ps = { text, T_END, "", 0, err, errlen };
+        qnode_t *q;
+        bitmap_t b;
+        uint32_t *ids = NULL, n;
+        int ret = -1;
+
+        err[0] = '\0';
+        next(&ps);
+        if (ps.type == T_END) {
+                snprintf(err, errlen, "Empty query");
+                return -2;
+        }
+        if (!(q = expr(&ps)))
+                return -2;
+        if (ps.type != T_END) {
+                fail(&ps, "Expected and, or or the end");
+                qfree(q);
+                return -2;
+        }
+
+        if (!ix->map) {
+                walking = q;
+                walkout = out;
+                ret = nftw(root, visit, 32, FTW_PHYS) < 0 ? -1 : 0;
+                walking = NULL;
+                qfree(q);
+                return ret;
+        }
+
+        estimate(ix, q);
+        bitmap_init(&b);
+        if (fetch(ix, q, &b) < 0 ||
+            !(ids = malloc((bitmap_card(&b) ? bitmap_card(&b) : 1) * sizeof(uint32_t))))
+                goto out;
+
+        n = bitmap_ids(&b, ids);
+        for (uint32_t i = 0; i < n; ++i) {
+                if (plist_add(out, index_path(ix, ids[i])) < 0)
+                        goto out;
+        }
+        ret = 0;
+
+out:
+        free(ids);
+        bitmap_free(&b);
+        qfree(q);
+        return ret;
+}
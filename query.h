@@ -0,0 +1,27 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stddef.h>
+
+#include "cache.h"
+#include "index.h"
+
+/*
+ * Boolean queries over the files of the served tree, such as
+ *
+ *      ext=c and size>1M and mtime>=2026-10-01
+ *      (name=*report* or path=data/docs) and not ext=tmp
+ *
+ * A predicate compares size, mtime, ctime, ext, name or path with a
+ * value, and predicates combine with and, or, not and parentheses. Each
+ * predicate maps to an index column, so the planner can tell how many
+ * files it selects before it selects any. Of a conjunction it fetches the
+ * most selective predicate first, then either intersects the bitmap of
+ * the next one with the result so far or tests the few candidates left
+ * directly, whichever costs less. Without an index every file is tested.
+ */
+
+int query_run(const index_t *ix, const char *root, const char *text, plist_t *out,
+              char *err, size_t errlen);
+
+#endif
@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "sched.h"
+
+/* a client with builds queued or running */
+typedef struct {
+        uint64_t key;                   /* hash of the host, 0 for a free entry */
+        int weight;
+        int queued;
+        int running;
+        double vtime;                   /* seconds of build time so far, over weight */
+} client_t;
+
+/* a build, waiting or running */
+typedef struct {
+        pid_t pid;                      /* 0 for a free entry */
+        int client;
+        uint64_t ticket;                /* order of arrival */
+} job_t;
+
+/* shared by every process of the node */
+typedef struct {
+        pthread_mutex_t lock;
+        pthread_cond_t freed;
+        int nslots;
+        int busy;
+        int nwait;
+        uint64_t ticket;
+        double vclock;                  /* vtime of the client served last */
+        double avg;                     /* seconds per build, moving average */
+        client_t clients[SCHEDCLIENTS];
+        job_t running[SCHEDMAXSLOTS];
+        job_t waiting[SCHEDWAIT];
+} sched_t;
+
+static sched_t *sched;
+static uint64_t me;                     /* the client of this process */
+static int weight = 1;
+static __thread int held = -1;          /* slot of the build of this thread */
+static __thread double since;
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* set up the shared state, before any process is forked: 0 on success, -1 on error */
+int sched_init(void)
+{
+        pthread_mutexattr_t mattr;
+        pthread_condattr_t cattr;
+        long ncpu;
+
+        sched = mmap(NULL, sizeof(sched_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (sched == MAP_FAILED) {
+                sched = NULL;
+                return -1;
+        }
+
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&sched->lock, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_cond_init(&sched->freed, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        sched->nslots = ncpu > 1 ? ncpu / 2 : 1;
+        if (sched->nslots > SCHEDMAXSLOTS)
+                sched->nslots = SCHEDMAXSLOTS;
+        sched->avg = 1;
+        return 0;
+}
+
+
+/**
+ * @brief Name the client the builds of this process are for, with the
+ * weight WEIGHTFILE gives it. Called in each child after the fork.
+ *
+ * @param host : the host the client connected from
+ */
+void sched_client(const char *host)
+{
+        char line[256], name[256];
+        FILE *fp;
+        int w;
+
+        me = hash_buf(host, strlen(host), 0) | 1;
+        weight = 1;
+
+        if (!(fp = fopen(WEIGHTFILE, "r")))
+                return;
+        while (fgets(line, sizeof(line), fp)) {
+                if (sscanf(line, "%255s %d", name, &w) == 2 && w > 0 && !strcmp(name, host))
+                        weight = w;
+        }
+        fclose(fp);
+}
+
+
+/* give back what processes that died without leaving held */
+static void reap(void)
+{
+        job_t *j;
+
+        for (int i = 0; i < SCHEDMAXSLOTS; ++i) {
+                j = &sched->running[i];
+                if (j->pid && kill(j->pid, 0) < 0 && errno == ESRCH) {
+                        --sched->clients[j->client].running;
+                        --sched->busy;
+                        j->pid = 0;
+                }
+        }
+        for (int i = 0; i < SCHEDWAIT; ++i) {
+                j = &sched->waiting[i];
+                if (j->pid && kill(j->pid, 0) < 0 && errno == ESRCH) {
+                        --sched->clients[j->client].queued;
+                        --sched->nwait;
+                        j->pid = 0;
+                }
+        }
+}
+
+
+/*
+ * The lock came back from a process that died holding it, with counters
+ * it may have left half updated: count them again from the jobs of the
+ * processes still alive.
+ */
+static void recount(void)
+{
+        job_t *j;
+
+        sched->busy = sched->nwait = 0;
+        for (int i = 0; i < SCHEDCLIENTS; ++i)
+                sched->clients[i].queued = sched->clients[i].running = 0;
+
+        for (int i = 0; i < SCHEDMAXSLOTS; ++i) {
+                j = &sched->running[i];
+                if (j->pid && (j->client < 0 || j->client >= SCHEDCLIENTS || (kill(j->pid, 0) < 0 && errno == ESRCH)))
+                        j->pid = 0;
+                if (j->pid) {
+                        ++sched->clients[j->client].running;
+                        ++sched->busy;
+                }
+        }
+        for (int i = 0; i < SCHEDWAIT; ++i) {
+                j = &sched->waiting[i];
+                if (j->pid && (j->client < 0 || j->client >= SCHEDCLIENTS || (kill(j->pid, 0) < 0 && errno == ESRCH)))
+                        j->pid = 0;
+                if (j->pid) {
+                        ++sched->clients[j->client].queued;
+                        ++sched->nwait;
+                }
+        }
+        pthread_mutex_consistent(&sched->lock);
+}
+
+
+static void lock(void)
+{
+        if (pthread_mutex_lock(&sched->lock) == EOWNERDEAD)
+                recount();
+}
+
+
+/* the entry of this client, made if need be: -1 when the table is full */
+static int client(void)
+{
+        client_t *c;
+        int free = -1;
+
+        for (int i = 0; i < SCHEDCLIENTS; ++i) {
+                c = &sched->clients[i];
+                if (c->key == me)
+                        return i;
+                if (free < 0 && (!c->key || (!c->queued && !c->running)))
+                        free = i;
+        }
+        if (free >= 0) {
+                c = &sched->clients[free];
+                c->key = me;
+                c->weight = weight;
+                c->queued = c->running = 0;
+                c->vtime = sched->vclock;
+        }
+        return free;
+}
+
+
+/* the waiting build due next: of the client with the least vtime, the oldest */
+static int next(void)
+{
+        job_t *j, *best = NULL;
+        int k = -1;
+
+        for (int i = 0; i < SCHEDWAIT; ++i) {
+                j = &sched->waiting[i];
+                if (!j->pid)
+                        continue;
+                if (!best || sched->clients[j->client].vtime < sched->clients[best->client].vtime ||
+                    (sched->clients[j->client].vtime == sched->clients[best->client].vtime &&
+                     j->ticket < best->ticket)) {
+                        best = j;
+                        k = i;
+                }
+        }
+        return k;
+}
+
+
+/**
+ * @brief Take a build slot, waiting for one in the queue of the client.
+ *
+ * @return int : 0 once the slot is held, or the seconds to wait before
+ * trying again when too many builds are queued already
+ */
+int sched_enter(void)
+{
+        struct timespec ts;
+        client_t *c;
+        job_t *j;
+        int k, w = -1;
+
+        if (!sched)
+                return 0;
+
+        lock();
+        reap();
+        if (sched->nwait == SCHEDWAIT || (k = client()) < 0) {
+                w = (int) (sched->avg * (sched->nwait / sched->nslots + 1)) + 1;
+                pthread_mutex_unlock(&sched->lock);
+                return w;
+        }
+
+        /* a client that was idle starts from where the others are */
+        c = &sched->clients[k];
+        if (!c->queued && !c->running && c->vtime < sched->vclock)
+                c->vtime = sched->vclock;
+
+        while (sched->waiting[++w].pid)
+                ;
+        j = &sched->waiting[w];
+        j->pid = getpid();
+        j->client = k;
+        j->ticket = ++sched->ticket;
+        ++sched->nwait;
+        ++c->queued;
+
+        /* look again now and then: a holder may have died */
+        while (sched->busy >= sched->nslots || next() != w) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ++ts.tv_sec;
+                if (pthread_cond_timedwait(&sched->freed, &sched->lock, &ts) == EOWNERDEAD)
+                        recount();
+                reap();
+        }
+
+        j->pid = 0;
+        --sched->nwait;
+        --c->queued;
+        ++c->running;
+        ++sched->busy;
+        sched->vclock = c->vtime;
+
+        for (held = 0; sched->running[held].pid; ++held)
+                ;
+        sched->running[held].pid = getpid();
+        sched->running[held].client = k;
+        since = now();
+
+        /* the next in line may fit in another free slot */
+        pthread_cond_broadcast(&sched->freed);
+        pthread_mutex_unlock(&sched->lock);
+        return 0;
+}
+
+
+/* give back the slot sched_enter() took, charging its client the time used */
+void sched_leave(void)
+{
+        double t;
+        client_t *c;
+
+        if (!sched || held < 0)
+                return;
+
+        t = now() - since;
+        lock();
+        if (sched->running[held].pid) {
+                c = &sched->clients[sched->running[held].client];
+                --c->running;
+                c->vtime += t / c->weight;
+                --sched->busy;
+                sched->running[held].pid = 0;
+        }
+        sched->avg = 0.8 * sched->avg + 0.2 * t;
+        pthread_cond_broadcast(&sched->freed);
+        pthread_mutex_unlock(&sched->lock);
+        held = -1;
+}
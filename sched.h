@@ -0,0 +1,33 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+/*
+ * Admission control for the archives a node builds.
+ *
+ * Building an archive runs tar and gzip over every matched file, so only
+ * a few builds may run at once across all the processes of a node: one
+ * per two cores, at least one. A build that finds every slot taken waits
+ * in the queue of its client, the host the connection came from. When a
+ * slot frees up it goes to the client that has had the least build time
+ * for its weight, so a client asking for many archives does not starve
+ * one asking for a single archive. Once SCHEDWAIT builds are waiting, new
+ * ones are turned away with an estimate of when to try again, instead of
+ * slowing down everyone already queued.
+ *
+ * Lookups never get here: only cache misses build anything.
+ *
+ * Weights are read from WEIGHTFILE, one "host weight" line per client.
+ * Clients that are not listed weigh 1.
+ */
+
+#define SCHEDWAIT       32              /* builds queued before new ones are refused */
+#define SCHEDCLIENTS    64              /* clients with builds queued or running */
+#define SCHEDMAXSLOTS   64
+#define WEIGHTFILE      "weights"
+
+int sched_init(void);
+void sched_client(const char *host);
+int sched_enter(void);
+void sched_leave(void);
+
+#endif
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include "search.h"
+
+#define MAXRUNS         32
+
+/* the matcher of a search, for the walk without an index */
+typedef struct {
+        const char *glob;               /* either this */
+        regex_t *re;                    /* or that */
+        plist_t *out;
+} matcher_t;
+
+static __thread matcher_t *walking;
+
+
+/* does path match the glob? patterns without '/' are matched against the file name */
+static int globmatch(const char *glob, const char *path)
+{
+        const char *name = strrchr(path, '/');
+
+        if (!strchr(glob, '/') && name)
+                path = name + 1;
+        return !fnmatch(glob, path, 0);
+}
+
+
+static int test(const matcher_t *m, const char *path)
+{
+        if (m->glob)
+                return globmatch(m->glob, path);
+        return !regexec(m->re, path, 0, NULL, 0);
+}
+
+
+/* add a run of literal bytes, if it can narrow anything */
+static int addrun(char *runs[], int *nruns, const char *start, size_t len)
+{
+        if (len < 3 || *nruns == MAXRUNS)
+                return 0;
+        if (!(runs[*nruns] = strndup(start, len)))
+                return -1;
+        ++*nruns;
+        return 0;
+}
+
+
+/* literal runs of a glob: everything but *, ? and [...] */
+static int globruns(const char *glob, char *runs[], int *nruns)
+{
+        char run[FILENAME_MAX];
+        size_t len = 0;
+
+        for (const char *p = glob; *p; ++p) {
+                if (*p == '*' || *p == '?' || *p == '[') {
+                        if (addrun(runs, nruns, run, len) < 0)
+                                return -1;
+                        len = 0;
+                        if (*p == '[') {
+                                /* skip the class; ']' first in it is a member */
+                                p += p[1] == ']' ? 2 : 1;
+                                while (*p && *p != ']')
+                                        ++p;
+                                if (!*p)
+                                        break;
+                        }
+                        continue;
+                }
+                if (*p == '\\' && p[1])
+                        ++p;
+                if (len < sizeof(run))
+                        run[len++] = *p;
+        }
+        return addrun(runs, nruns, run, len);
+}
+
+
+/*
+ * Literal runs of an extended regex. Only the part before any group or
+ * alternation is used, and a byte made optional by a quantifier ends the
+ * run before it: what is left must appear in every match.
+ */
+static int reruns(const char *re, char *runs[], int *nruns)
+{
+        char run[FILENAME_MAX];
+        size_t len = 0;
+
+        if (strchr(re, '|'))
+                return 0;
+
+        for (const char *p = re; *p && *p != '('; ++p) {
+                switch (*p) {
+                case '*':
+                case '?':
+                case '{':
+                        if (len)
+                                --len;  /* the byte before may not be there */
+                        /* fall through */
+                case '+':
+                case '.':
+                case '^':
+                case '$':
+                case '[':
+                case ')':
+                        if (addrun(runs, nruns, run, len) < 0)
+                                return -1;
+                        len = 0;
+                        if (*p == '[') {
+                                p += p[1] == ']' ? 2 : 1;
+                                while (*p && *p != ']')
+                                        ++p;
+                        } else if (*p == '{') {
+                                while (*p && *p != '}')
+                                        ++p;
+                        }
+                        if (!*p)
+                                return addrun(runs, nruns, run, 0);
+                        break;
+                case '\\':
+                        /* an escaped punctuation mark is itself; \w and friends are classes */
+                        if (p[1] && !strchr("wWsSdDbB<>`'", p[1])) {
+                                if (len < sizeof(run))
+                                        run[len++] = *++p;
+                                break;
+                        }
+                        if (addrun(runs, nruns, run, len) < 0)
+                                return -1;
+                        len = 0;
+                        if (p[1])
+                                ++p;
+                        break;
+                default:
+                        if (len < sizeof(run))
+                                run[len++] = *p;
+                }
+        }
+
+        /* a quantifier may follow the group we stopped at */
+        if (strchr(re, '('))
+                return 0;
+        return addrun(runs, nruns, run, len);
+}
+
+
+static int visit(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+        if (type != FTW_F || !test(walking, fpath))
+                return 0;
+        return plist_add(walking->out, fpath);
+}
+
+
+/* match the candidates the runs leave, from the index or from the tree */
+static int run(const index_t *ix, const char *root, matcher_t *m, char *runs[], int nruns)
+{
+        uint32_t *ids = NULL, n = 0;
+        const char *path;
+        int ret;
+
+        if (!ix->map) {
+                walking = m;
+                ret = nftw(root, visit, 32, FTW_PHYS);
+                walking = NULL;
+                return ret < 0 ? -1 : 0;
+        }
+
+        if ((ret = index_grams(ix, runs, nruns, &ids, &n)) < 0)
+                return -1;
+
+        /* ret 1: no trigram to go by, every record is a candidate */
+        for (uint32_t i = 0; i < (ret ? ix->n : n); ++i) {
+                path = index_path(ix, ret ? i : ids[i]);
+                if (test(m, path) && plist_add(m->out, path) < 0) {
+                        free(ids);
+                        return -1;
+                }
+        }
+        free(ids);
+        return 0;
+}
+
+
+/**
+ * @brief Find the files matching a shell pattern, in path order.
+ *
+ * @param ix : the index, or an empty one to walk the tree
+ * @param root : the tree
+ * @param pattern : a glob; without '/' it applies to the file name
+ * @param out : the matching paths are added here
+ * @return int : 0 on success, -1 on error
+ */
+int search_glob(const index_t *ix, const char *root, const char *pattern, plist_t *out)
+{
+        matcher_t m = { pattern, NULL, out };
+        char *runs[MAXRUNS];
+        int nruns = 0, ret = -1;
+
+        if (globruns(pattern, runs, &nruns) == 0)
+                ret = run(ix, root, &m, runs, nruns);
+
+        for (int i = 0; i < nruns; ++i)
+                free(runs[i]);
+        return ret;
+}
+
+
+/**
+ * @brief Find the files whose path matches an extended regular
+ * expression, in path order.
+ *
+ * @param err : set to the reason when the expression does not compile
+ * @return int : 0 on success, -1 on error, -2 on a bad expression
+ */
+int search_re(const index_t *ix, const char *root, const char *regex, plist_t *out,
+              char *err, size_t errlen)
+{
+        regex_t re;
+        matcher_t m = { NULL, &re, out };
+        char *runs[MAXRUNS];
+        int nruns = 0, ret = -1, rc;
+
+        if ((rc = regcomp(&re, regex, REG_EXTENDED | REG_NOSUB))) {
+                regerror(rc, &re, err, errlen);
+                return -2;
+        }
+
+        if (reruns(regex, runs, &nruns) == 0)
+                ret = run(ix, root, &m, runs, nruns);
+
+        for (int i = 0; i < nruns; ++i)
+                free(runs[i]);
+        regfree(&re);
+        return ret;
+}
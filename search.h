@@ -0,0 +1,23 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+#include "cache.h"
+#include "index.h"
+
+/*
+ * Pattern search over the paths of the served tree.
+ *
+ * The literal parts of a pattern are strings every matching path must
+ * contain, so their trigrams pick the candidates from the index; only
+ * those are matched against the pattern itself. A pattern without three
+ * literal bytes in a row, or a node without an index, falls back to
+ * matching every path.
+ */
+
+int search_glob(const index_t *ix, const char *root, const char *pattern, plist_t *out);
+int search_re(const index_t *ix, const char *root, const char *regex, plist_t *out,
+              char *err, size_t errlen);
+
+#endif
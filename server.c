@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
+#include <poll.h>
 
 #include <ftw.h>
 #include <stdlib.h>
@@ -11,9 +12,29 @@
 #include <dirent.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "proto.h"
+#include "net.h"
+#include "cache.h"
+#include "hash.h"
+#include "index.h"
+#include "search.h"
+#include "query.h"
+#include "sched.h"
+#include "throttle.h"
+#include "metrics.h"
+#include "trace.h"
+#include "tune.h"
+#include "tls.h"
+#include "tar.h"
 
 
 #define ERR             -1
@@ -22,76 +43,255 @@
 #define QUIT            12
 #define MIRROR          13
 #define BUSY            14
-#define QLEN            5
+#define META            15
+#define LIST            16
+#define RETRY           17
+#define STORED          18
 #define MAXARG          8
 #define REQCNT          4
 #define MAXLINE         128
 #define MAXFILESIZE     4096
+#define REGLINE         (3 * MAXLINE)   /* "host port unixpath" the child passes to the parent */
+#define SUNPATHLEN      sizeof(((struct sockaddr_un *) 0)->sun_path)
+#define DATACHUNK       (256 * 1024)    /* bytes of archive per OP_DATA frame */
+#define LISTCHUNK       (64 * 1024)     /* bytes of entries per OP_ENTRIES frame */
+#define MAXINFLIGHT     64              /* concurrent requests per client */
+#define NWORKERS        2               /* archive requests built at once per client */
 
 #define PATH            "data"
+#define INDEXFILE       CACHEDIR "/index"
+#define INDEXPERIOD     60              /* seconds between two walks of the indexer */
 
 
 typedef struct {
-        int nclient;
+        int *nclient;                   /* shared with the children, counted at HELLO */
         int listenfd;
+        char port[NI_MAXSERV];          /* where data connections reach this node */
+        double started;                 /* when this node started */
+        int *queried;                   /* shared: the first query was answered */
         char mirror_hostname[MAXLINE];
         char mirror_port[MAXLINE];
+        char mirror_unixpath[MAXLINE];  /* set when the mirror runs on this host */
         int pipefd[2];
-        int dirty;
+        int dirty;                      /* no mirror has registered yet */
+        int mirror;                     /* this node is the mirror of another */
+        int unixfd;                     /* -1 unless co-located with the server */
+        char unixpath[MAXLINE];
 } socketfd_t;
 
 socketfd_t socketfd;
+index_t fileindex;                      /* read-only, shared by the request threads */
+index_t noindex;                        /* empty: the tree is walked instead */
+pthread_rwlock_t indexlock = PTHREAD_RWLOCK_INITIALIZER;       /* fileindex is remapped under it */
 
 char client_hostname[MAXLINE];
 char client_port[MAXLINE];
-char **extr_arg;
-char message[MAXLINE];
-
-int status;
-
-static int open_listenfd(char *port);
-static int server_init(int type, const struct sockaddr *addr, socklen_t alen, int backlog);
-static void send_file(int fd, int connfd);
+char mirror_unixpath[MAXLINE];
+/*
+ * Everything one request needs. Every request of a session runs in its
+ * own thread with a context of its own, taken from a pool and given back
+ * when the response is out; the memory the request needs along the way
+ * comes from the context's arena, which is reset in one step.
+ */
+typedef struct ctx {
+        request_t req;
+        int connfd;                     /* the connection it came in on */
+        int status;
+        char message[MAXLINE];
+        char archive[PATH_MAX];
+        char content[CIDLEN + 1];       /* content id of archive */
+        struct stat *members;           /* of each match, for a stored archive */
+        off_t stored;                   /* bytes of the stored archive */
+        off_t range_off;
+        off_t range_len;                /* -1: to the end of the archive */
+        plist_t matches;                /* files the walk selected */
+        char *manifest;                 /* files the client already holds, or NULL */
+        char *output;                   /* results too long for message, or NULL */
+        int listmode;                   /* stream the matches instead of answering */
+        long listlimit;                 /* entries per page, -1 for all */
+        char *listcursor;               /* hex path the page starts after, or NULL */
+        double started;                 /* when it was read */
+        double began;                   /* when its evaluation began */
+        arena_t arena;
+        unsigned long seq;              /* order it was read in */
+        int slot;                       /* in active[] */
+        struct ctx *next;               /* in the pool or the queue */
+} ctx_t;
+
+__thread ctx_t *cur;                    /* the request of this thread, for the ftw() callbacks */
+
+ctx_t *pool;                            /* contexts not in use */
+pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_mutex_t sendlock = PTHREAD_MUTEX_INITIALIZER;  /* one frame at a time */
+pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobdone = PTHREAD_COND_INITIALIZER;
+int inflight;
+unsigned long active[MAXINFLIGHT];      /* seq of each request in flight, 0 for a free slot */
+unsigned long nextseq;
+ctx_t *queue, *queuetail;               /* archive requests waiting for a worker */
+pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+int nworkers;
+
+static void recv_files(int clientfd, char *port);
+static int open_unixfd(char *path);
+static int recv_fd(int unixfd);
+static void send_file(ctx_t *ctx, int fd, off_t off, off_t len);
+static void send_tar(ctx_t *ctx);
 static void send_text(char *msg, int connfd);
+static void reply(request_t *req, int op, char *msg, int connfd);
 static void processclient(int listenfd);
-static int set_cloexec(int fd);
 static void sigchld_handler(int signum);
 static void sigusr1_handler(int signum);
-static void process(int connfd);
-static int parse(char *buf, char *argv[MAXARG]);
-static int eval(char *msg, int size);
+static void process(rbuf_t *rb);
+static ctx_t *ctx_get(void);
+static void ctx_put(ctx_t *ctx);
+static void serve(ctx_t *ctx);
+static void *run(void *arg);
+static void *worker(void *arg);
+static int heavy(int op);
+static void spawn(ctx_t *ctx);
+static void drain(void);
+static int eval(ctx_t *ctx);
+static void pack(ctx_t *ctx);
+static void store(ctx_t *ctx);
+static void checksum(ctx_t *ctx);
+static void listing(ctx_t *ctx);
+static int listed(ctx_t *ctx);
+static void entries(ctx_t *ctx);
+static char *join(ctx_t *ctx, char *args[]);
+static int walk(int (*fn)(const char*, const struct stat*, int));
+static int walk_names(int (*fn)(const char*, const struct stat*, int), char *names[]);
+static const index_t *index_get(void);
+static void index_put(void);
+static void indexer(void);
+static void exporter(char *port);
+static void closed(void);
+static void selected(ctx_t *ctx);
+static double now(void);
 static int compare(const struct stat *st, void *c1, void *c2, char *type);
 static int contains(char *args[], char *fname);
 static int get_file_ext(const char *fname, char *ext);
 static int match(char *args[], const char *fname);
-static void transfer(int connfd);
-static int available();
+static void transfer(request_t *req, int connfd);
+static int handoff(int connfd);
+static int available(int nclient);
 
 int findfile(const char *fpath, const struct stat *st, int type);
 int sdgetfiles(const char *fpath, const struct stat *st, int type);
 
 int main(int argc, char *argv[])
 {
-        char *port;
-        
-        if (argc != 2) {
+        char *port, *mport = NULL, *tracefile = NULL, *pem = NULL;
+        char *server_hostname, *server_port;
+        int clientfd, opt, ktls = 1;
+
+        while ((opt = getopt(argc, argv, "m:t:s:k")) != -1) {
+                switch (opt) {
+                case 'm':
+                        mport = optarg;
+                        break;
+                case 't':
+                        tracefile = optarg;
+                        break;
+                case 's':
+                        pem = optarg;
+                        break;
+                case 'k':
+                        ktls = 0;
+                        break;
+                default:
+                        fprintf(stderr, "Invalid arguments!\n");
+                        return 1;
+                }
+        }
+        argc -= optind - 1;
+        argv += optind - 1;
+        if ((argc != 2 && argc != 4 && argc != 5) || strlen(argv[1]) >= NI_MAXSERV) {
                 fprintf(stderr, "Invalid arguments!\n");
                 return 1;
         }
 
         port = argv[1];
+        strcpy(socketfd.port, port);
+
+        /* given a server to copy, this node is its mirror */
+        socketfd.mirror = argc > 2;
+        if (tune_init(socketfd.mirror ? "mirror" : "server") < 0)
+                fprintf(stderr, "some of %s ignored\n", TUNEFILE);
+        if (pem && tls_init(pem, 1, ktls) < 0) {
+                fprintf(stderr, "can't use %s for TLS\n", pem);
+                return 1;
+        }
+        socketfd.unixfd = -1;
+        socketfd.unixpath[0] = '\0';
+        if (socketfd.mirror) {
+                server_hostname = argv[2];
+                server_port = argv[3];
+
+                /* optional UNIX socket for connections handed over by a local server */
+                if (argc == 5) {
+                        strncpy(socketfd.unixpath, argv[4], MAXLINE - 1);
+                        if ((socketfd.unixfd = open_unixfd(socketfd.unixpath)) < 0)
+                                return 3;
+                }
+
+                if ((clientfd = open_clientfd(server_hostname, server_port)) < 0) {
+                        return 2;
+                }
+
+                printf("Ready to ask server for files...\n");
+                recv_files(clientfd, port);
+        }
 
         if ((socketfd.listenfd = open_listenfd(port)) < 0) {
                 return 2;
         }
 
+        /* file hashes are shared by every child */
+        if (hash_init() < 0)
+                fprintf(stderr, "hash cache disabled\n");
+        if (sched_init() < 0)
+                fprintf(stderr, "admission control disabled\n");
+        if (throttle_init() < 0)
+                fprintf(stderr, "per-host rate limits disabled\n");
+        if (metrics_init() < 0)
+                fprintf(stderr, "metrics disabled\n");
+        if (tracefile && trace_open(tracefile) < 0)
+                fprintf(stderr, "cannot open trace log %s\n", tracefile);
+
+        /* map the index left by the last run; the indexer brings it up to date */
+        socketfd.started = now();
+        socketfd.queried = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (socketfd.queried == MAP_FAILED) {
+                perror("mmap");
+                return 2;
+        }
+        *socketfd.queried = 0;
+        mkdir(CACHEDIR, 0755);
+        if (!index_open(&fileindex, INDEXFILE)) {
+                printf("Index: %u files mapped in %.3f ms\n", fileindex.n, (now() - socketfd.started) * 1e3);
+        } else
+                printf("Index: none yet, walking the tree until it is built\n");
+        indexer();
+        if (mport)
+                exporter(mport);
+
         fprintf(stdout, "Ready to listen for connections...\n");
 
         /* set up signal handler */
         signal(SIGCHLD, sigchld_handler);
 
-        socketfd.nclient = -1;
-        socketfd.dirty = 1;
+        /* children count the clients as they say HELLO; data connections don't */
+        socketfd.nclient = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (socketfd.nclient == MAP_FAILED) {
+                perror("mmap");
+                return 2;
+        }
+        *socketfd.nclient = 0;
+
+        /* a server takes its first client for its mirror, and waits for it */
+        socketfd.dirty = !socketfd.mirror;
 
         /* start listening for events */
         processclient(socketfd.listenfd);
@@ -100,77 +300,141 @@ int main(int argc, char *argv[])
 
 
 /**
- * @brief Create a new listen socket and start listening for connections.
+ * @brief Create the UNIX domain socket on which a server running on the
+ * same host hands client connections over to the mirror.
  * 
- * @param port : port number for the server to connect
+ * @param path : filesystem path of the socket
+ * @return int : the listening socket, or -1 on error.
  */
-static int open_listenfd(char *port)
+static int open_unixfd(char *path)
 {
-        int listenfd, err;
-        struct addrinfo *p, *listp;
-        struct addrinfo hints;
-
-        memset(&hints, 0, sizeof(struct addrinfo));
-        hints.ai_socktype = SOCK_STREAM;                /* TCP connection */
-        hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;    /* Using any IP addr */
-        hints.ai_flags |= AI_NUMERICSERV;               /* Using port number */
-
-        if ((err = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
-                fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(err));
-                exit(1);        
-        }
+        struct sockaddr_un addr;
 
-        /* Walk the list for one that we can successfully connect to */
-        for (p = listp; p; p = p->ai_next) {
-                if ((listenfd = server_init(p->ai_socktype, p->ai_addr, p->ai_addrlen, QLEN)) >= 0)
-                        break;          /* Success */
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "UNIX socket path too long: %s\n", path);
+                return -1;
         }
 
-        freeaddrinfo(listp);
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
 
-        if (!p) /* All connects failed */
-                return -1;
+        unlink(path);   /* stale socket from a previous run */
 
-        return listenfd;
-        
+        return server_init(SOCK_STREAM, (struct sockaddr*)&addr, sizeof(struct sockaddr_un), QLEN);
 }
 
 
 /**
- * @brief Initialize the server.
+ * @brief Accept a handoff from the server and receive the client's socket
+ * passed with SCM_RIGHTS.
  * 
- * @param type : type of the socket (SOCK_STREAM for TCP protocol)
- * @param addr : socket address for the server
- * @param alen : size of addr
- * @param backlog : number of outstanding connect requests that can be enqueued
- * @return int : If the server set up succeeds, zero is returned. 
- * On error, -1 is returned, and errno is set appropriately.
+ * @param unixfd : the listening UNIX domain socket
+ * @return int : the client socket, or -1 on error.
  */
-static int server_init(int type, const struct sockaddr *addr, socklen_t alen, int backlog)
+static int recv_fd(int unixfd)
 {
-        int sockfd;
-        int err = 0;
-        int reuse = 1;
-
-        if ((sockfd = socket(addr->sa_family, type, 0)) < 0)
+        int fd, connfd = -1;
+        char tag;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+
+        if ((fd = accept(unixfd, NULL, NULL)) < 0) {
+                fprintf(stderr, "accept on UNIX socket failed!\n");
                 return -1;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0)
-                goto errout;
-        if (bind(sockfd, addr, alen) < 0)
-                goto errout;
-        if (type == SOCK_STREAM || type == SOCK_SEQPACKET) {
-                if (listen(sockfd, backlog) < 0)
-                        goto errout;
         }
 
-        return sockfd;
+        memset(&msg, 0, sizeof(struct msghdr));
+        iov.iov_base = &tag;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        if (recvmsg(fd, &msg, 0) == 1 && tag == 'H') {
+                cmsg = CMSG_FIRSTHDR(&msg);
+                if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                        memcpy(&connfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        if (connfd < 0)
+                fprintf(stderr, "no descriptor in handoff message\n");
 
-errout:
-        perror("server init failed");
-        err = errno;
-        close(sockfd);
-        errno = err;
-        return -1;
+        close(fd);
+        return connfd;
+}
+
+
+static void recv_files(int clientfd, char *port) 
+{
+        char msg[MAXLINE * 2];
+        sprintf(msg, "MIRROR %s %s\n", port, socketfd.unixpath);
+
+        /* send mirror request to the server */
+        if (send(clientfd, msg, strlen(msg), 0) < 0) {
+                fprintf(stderr, "send failed!\n");
+                close(clientfd);
+                exit(1);
+        }
+
+        int fd, nrecv;
+        char buf[MAXFILESIZE];
+
+        fd = open("files.tar.gz", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        
+        int first = 1;
+
+        char *fp = buf;
+        int fsize = 0;
+
+        while ((nrecv = recv(clientfd, buf, sizeof(buf), 0)) > 0) {
+                fp = buf;
+                if (first && nrecv > 5) {
+                        char *p;
+                        p = strchr(buf, '\n');
+                        if (p && !strncmp(buf, "SIZE:", 5)) {
+                                *p = '\0';
+                                fsize = atoi(buf + 5);
+                                fp = p + 1;
+                                nrecv -= strlen(buf) + 1;
+                                first = 0;
+                        }
+                } else if (!first && nrecv > fsize) {
+                        /* the trailer is not part of the archive */
+                        nrecv = fsize;
+                }
+                
+                write(fd, fp, nrecv);
+                fsize -= nrecv;
+
+                if (!fsize)
+                        break;
+        }
+
+        close(fd);
+
+        if (nrecv < 0) {
+                fprintf(stderr, "recv from server error\n");
+                close(clientfd);
+                exit(1);
+        }
+
+        if (system("tar -xzf files.tar.gz -C .") < 0) {
+                fprintf(stderr, "tar failed!\n");
+                close(clientfd);
+                exit(1);
+        }
+
+        printf("All files received!\n");
+
+        unlink("files.tar.gz");
+        close(clientfd);
 }
 
 
@@ -180,10 +444,14 @@ static void processclient(int listenfd)
         int connfd;
         socklen_t clientlen;
         struct sockaddr_storage clientaddr;     /* Enough room for any addresses */
+        struct pollfd fds[2];
+        int nfds, handed;
         
         /* close-on-exec: child processes will close this fd automatically */
         if (set_cloexec(listenfd) < 0)
                 fprintf(stderr, "Close-on-exec failed!\n");
+        if (socketfd.unixfd >= 0 && set_cloexec(socketfd.unixfd) < 0)
+                fprintf(stderr, "Close-on-exec failed!\n");
 
         if (pipe(socketfd.pipefd) == -1) {
                 perror("pipe");
@@ -193,35 +461,82 @@ static void processclient(int listenfd)
         if (set_cloexec(socketfd.pipefd[0]) < 0)
                 fprintf(stderr, "Close-on-exec failed!\n");
 
+        signal(SIGUSR1, sigusr1_handler); // set up the signal handler for SIGUSR1
+
+        fds[0].fd = listenfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = socketfd.unixfd;
+        fds[1].events = POLLIN;
+        nfds = socketfd.unixfd >= 0 ? 2 : 1;
 
         while (1) {
 
+                if (poll(fds, nfds, -1) < 0) {
+                        if (errno != EINTR)
+                                fprintf(stderr, "poll failed!\n");
+                        continue;
+                }
+
+                handed = nfds == 2 && (fds[1].revents & POLLIN);
+
                 /* connect to a new client */
                 clientlen = sizeof(struct sockaddr_storage);
-                if ((connfd = accept(listenfd, (struct sockaddr*)&clientaddr, &clientlen)) < 0) 
+                if (handed) {
+                        if ((connfd = recv_fd(socketfd.unixfd)) < 0)
+                                continue;
+                        getpeername(connfd, (struct sockaddr*)&clientaddr, &clientlen);
+                } else if ((connfd = accept(listenfd, (struct sockaddr*)&clientaddr, &clientlen)) < 0) {
                         fprintf(stderr, "Connection failed! Error at accept.\n");
+                        continue;
+                }
+                metrics_add(M_CONNECTIONS, 1);
                 
                 /* print the new connection message */
                 getnameinfo((struct sockaddr*)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
                 
                 fprintf(stdout, "-----------------------------------------------------\n");
                 
-                fprintf(stdout, "Connected to (%s, %s)\n", client_hostname, client_port);
-
-                socketfd.nclient++;
+                fprintf(stdout, "Connected to (%s, %s)%s\n", client_hostname, client_port,
+                        handed ? " handed over by the server" : "");
 
                 /* fork a new child for this client*/
                 if ((pid = fork()) < 0) {
                         fprintf(stderr, "fork error\n");
                         exit(1);
                 } else if (pid == 0) {
-                        while(1) process(connfd);
-        
+                        rbuf_t rb;
+
+                        /* system() in the request threads reaps its own child */
+                        signal(SIGCHLD, SIG_DFL);
+
+                        tune_socket(connfd, client_hostname);
+
+                        /* a handed over connection has done its handshake with the server */
+                        if (!handed && (connfd = tls_accept(connfd)) < 0)
+                                exit(1);
+
+                        /* archive builds queue with the others of the same host */
+                        sched_client(client_hostname);
+                        throttle_client(client_hostname);
+                        metrics_gauge(G_SESSIONS, 1);
+                        atexit(closed);
+
+                        /* the latest index the indexer wrote */
+                        index_close(&fileindex);
+                        index_open(&fileindex, INDEXFILE);
+
+                        /* the server has already read HELLO on this connection */
+                        if (handed)
+                                send_text("OK", connfd);
+                        if (rb_init(&rb, connfd) < 0) {
+                                fprintf(stderr, "out of memory\n");
+                                exit(1);
+                        }
+                        while(1) process(&rb);
+                
                 }
                 close(socketfd.pipefd[1]);
 
-                signal(SIGUSR1, sigusr1_handler); // set up the signal handler for SIGUSR1
-
                 while (socketfd.dirty) {
                         pause();        /* waiting for a signal..*/
                 }
@@ -231,19 +546,6 @@ static void processclient(int listenfd)
 }
 
 
-static int set_cloexec(int fd)
-{
-	int val;
-
-	if ((val = fcntl(fd, F_GETFD, 0)) < 0)
-	        return -1;
-
-	val |= FD_CLOEXEC;		/* enable close-on-exec */
-
-	return fcntl(fd, F_SETFD, val);
-}
-
-
 /* signal handler for sigchld to reap all zombie children */
 static void sigchld_handler(int signum) {
         while(waitpid(-1, 0, WNOHANG) > 0) {
@@ -257,64 +559,142 @@ static void sigusr1_handler(int signum) {
         // This function will be called when the child process finishes writing to the pipe
         printf("Received SIGUSR1 signal, reading from pipe...\n");
 
-        char msg[MAXLINE];      
+        char msg[REGLINE];
+        ssize_t n;
 
         /* read pipe from child */
-        if (read(socketfd.pipefd[0], msg, MAXLINE) < 0) {
+        if ((n = read(socketfd.pipefd[0], msg, sizeof(msg) - 1)) < 0) {
                 perror("read from pipe error");
+                return;
         }
+        msg[n] = '\0';
 
         printf("%s\n", msg);
-        char *p = strchr(msg, ' ');
-        *p = '\0';
 
-        strcpy(socketfd.mirror_hostname, msg);
-        strcpy(socketfd.mirror_port, p + 1);
+        /* msg: host port [unixpath] */
+        socketfd.mirror_unixpath[0] = '\0';
+        if (sscanf(msg, "%127s %127s %127s", socketfd.mirror_hostname,
+                   socketfd.mirror_port, socketfd.mirror_unixpath) < 2) {
+                fprintf(stderr, "Bad mirror registration: %s\n", msg);
+                return;
+        }
         socketfd.dirty = 0;
 }
 
 
-static void process(int connfd) {
-        int clientfd;
-        int nrecv = 0;
-        int nbuf = 0;
-        char buf[MAXLINE];
-        char EOM = '\n';
+/**
+ * @brief Read the next request from the client. Frames other than the
+ * session control commands run on their own thread, so a client can
+ * pipeline requests and get the responses back as they complete; text
+ * requests keep being answered one at a time, in order.
+ * 
+ * @param rb : reader over the client connection
+ */
+static void process(rbuf_t *rb) {
+        ctx_t *ctx;
+        int ret;
 
-        memset(buf, 0, MAXLINE);
+        if (!(ctx = ctx_get())) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+        }
+        ctx->connfd = rb->fd;
 
-        while ((nrecv = recv(connfd, buf + nbuf, MAXLINE - nbuf, 0)) > 0) {
-                nbuf += nrecv;
-                if (buf[nbuf-1] == EOM)
-                        break;
+        if ((ret = proto_recv(rb, &ctx->req)) == -2) {
+                /* skipped unread: the session goes on with the next request */
+                reply(&ctx->req, OP_ERR, "ERR:Request too long", ctx->connfd);
+                ctx_put(ctx);
+                return;
+        }
+        if (ret <= 0) {
+                if (ret < 0)
+                        fprintf(stderr, "recv from client error\n");
+                /* the client went away (e.g. an unused speculative connection) */
+                drain();
+                close(ctx->connfd);
+                exit(ret < 0);
         }
 
-        buf[nbuf] = '\0';
+        ctx->started = now();
 
-        if (nrecv < 0) {
-                fprintf(stderr, "recv from client error\n");
-                exit(1);
+        fprintf(stdout, "The command from child is:");
+        for (int i = 0; i < ctx->req.argc; ++i)
+                fprintf(stdout, " %s", ctx->req.argv[i]);
+        fprintf(stdout, ctx->req.text ? "\n" : " (binary, id %u)\n", ctx->req.id);
+
+        switch (ctx->req.text ? 0 : ctx->req.op) {
+                case 0:
+                case OP_HELLO:
+                case OP_MIRROR:
+                        serve(ctx);
+                        break;
+                case OP_QUIT:
+                        drain();
+                        serve(ctx);
+                        break;
+                default:
+                        spawn(ctx);
         }
+}
 
-        fprintf(stdout, "The command from child is: %s", buf);
+
+/**
+ * @brief Evaluate one request and send its response.
+ * 
+ * @param ctx : the request, given back to the pool here
+ */
+static void serve(ctx_t *ctx) {
+        request_t *req = &ctx->req;
+        int connfd = ctx->connfd;
 
         /* have got the full command here */
-        eval(buf, nbuf);
-        switch (status) {
+        cur = ctx;
+        trace_begin(req->id, req->op, ctx->started);
+        eval(ctx);
+
+        if (req->op >= OP_FINDFILE && req->op <= OP_GETTARGZ &&
+            __sync_bool_compare_and_swap(socketfd.queried, 0, 1)) {
+                printf("First query answered %.3f ms after startup, from %s\n",
+                       (now() - socketfd.started) * 1e3, fileindex.map ? "the index" : "a tree walk");
+        }
+        switch (ctx->status) {
                 case OK:    
-                        send_text(message, connfd);
+                        reply(req, OP_OK, ctx->output ? ctx->output : ctx->message, connfd);
                         break;
                 case ERR:
-                        send_text(message, connfd);   
+                        reply(req, OP_ERR, ctx->message, connfd);
+                        break;
+                case META:
+                        reply(req, OP_META, ctx->message, connfd);
+                        break;
+                case RETRY:
+                        reply(req, OP_RETRY, ctx->message, connfd);
+                        break;
+                case LIST:
+                        entries(ctx);
                         break;
                 case BUSY:
-                        transfer(connfd);
+                        /* a relay can't go with the socket */
+                        if (!tls_relayed(connfd) && !handoff(connfd)) {
+                                /* the mirror owns the connection now */
+                                close(connfd);
+                                exit(0);
+                        }
+                        transfer(req, connfd);
                         break;
                 case FILE:
-                        int fd = open("temp.tar.gz", O_RDONLY);
-                        send_file(fd, connfd);
+                        throttle_opens(1);
+                        int fd = open(ctx->archive, O_RDONLY);
+                        if (fd < 0) {
+                                /* trimmed from the cache in the meantime */
+                                reply(req, OP_ERR, "ERR:Archive unavailable", connfd);
+                                break;
+                        }
+                        send_file(ctx, fd, ctx->range_off, ctx->range_len);
                         close(fd);
-                        unlink("temp.tar.gz");
+                        break;
+                case STORED:
+                        send_tar(ctx);
                         break;
                 case MIRROR:
                         char cmd[MAXLINE];
@@ -325,13 +705,14 @@ static void process(int connfd) {
                                 exit(1);
                         }
                         int _fd = open("files.tar.gz", O_RDONLY);
-                        send_file(_fd, connfd);
+                        ctx->content[0] = '\0';
+                        send_file(ctx, _fd, 0, -1);
                         close(_fd);
                         unlink("files.tar.gz");
         
-                        char msg2parent[MAXLINE];
+                        char msg2parent[REGLINE];
 
-                        sprintf(msg2parent, "%s %s", client_hostname, client_port);
+                        snprintf(msg2parent, sizeof(msg2parent), "%s %s %s", client_hostname, client_port, mirror_unixpath);
 
                         write(socketfd.pipefd[1], msg2parent, strlen(msg2parent) + 1);
                         kill(getppid(), SIGUSR1); // send the SIGUSR1 signal to the parent process
@@ -343,37 +724,190 @@ static void process(int connfd) {
                         exit(0);
         }
 
+        metrics_time(req->op, now() - ctx->started);
+        /* a relay's socketpair tells nothing of the client */
+        trace_ack(tls_relayed(connfd) ? -1 : connfd);
+        trace_end();
+        cur = NULL;
+
+        /* zero-copy sends may still read the arena: if so, it is never reused */
+        if (tune_flush(connfd) < 0) {
+                fprintf(stderr, "zero-copy sends unfinished, request %u kept out of the pool\n", req->id);
+                return;
+        }
+        ctx_put(ctx);
 }
 
 
-static int parse(char *buf, char *argv[MAXARG])
+/* a context for a new request, recycled if one is free */
+static ctx_t *ctx_get(void)
 {
-        char *delim;        /* points to the first space delimiter */
-        int argc;           /* number of arguments */
+        ctx_t *ctx;
+
+        pthread_mutex_lock(&poollock);
+        if ((ctx = pool))
+                pool = ctx->next;
+        pthread_mutex_unlock(&poollock);
 
-        /* replace trailing \n with space */
-        buf[strlen(buf) - 1] = ' ';
+        if (!ctx) {
+                if (!(ctx = malloc(sizeof(ctx_t))))
+                        return NULL;
+                arena_init(&ctx->arena);
+        }
 
-        /* skipping leading spaces */
-        while (*buf && (*buf == ' ')) ++buf;
+        ctx->req.arena = &ctx->arena;
+        ctx->matches.paths = NULL;
+        ctx->matches.n = ctx->matches.cap = 0;
+        ctx->matches.arena = &ctx->arena;
+        ctx->output = NULL;
+        ctx->listmode = 0;
+        return ctx;
+}
 
-        /* build the argv list */
-        argc = 0;
-        while ((delim = strchr(buf, ' '))) {
-                /* copy argument */
-                argv[argc++] = buf;
-                *delim = '\0';
-                buf = delim + 1;
 
-                /* skipping leading spaces */
-                while (*buf && (*buf == ' ')) ++buf;
+/* done with a request: everything it allocated goes at once */
+static void ctx_put(ctx_t *ctx)
+{
+        arena_reset(&ctx->arena);
+
+        pthread_mutex_lock(&poollock);
+        ctx->next = pool;
+        pool = ctx;
+        pthread_mutex_unlock(&poollock);
+}
+
+
+static void *run(void *arg)
+{
+        ctx_t *ctx = arg;
+        unsigned long oldest;
+        int slot = ctx->slot;
+
+        /* an ordered request waits for every one read before it */
+        if (ctx->req.flags & FL_ORDERED) {
+                pthread_mutex_lock(&joblock);
+                do {
+                        oldest = ctx->seq;
+                        for (int i = 0; i < MAXINFLIGHT; ++i) {
+                                if (active[i] && active[i] < oldest)
+                                        oldest = active[i];
+                        }
+                        if (oldest < ctx->seq)
+                                pthread_cond_wait(&jobdone, &joblock);
+                } while (oldest < ctx->seq);
+                pthread_mutex_unlock(&joblock);
         }
-        argv[argc] = NULL;
 
-        /* blank line */
-        if (!argc) return -1;
-        
-        return argc;
+        serve(ctx);
+
+        pthread_mutex_lock(&joblock);
+        --inflight;
+        active[slot] = 0;
+        pthread_cond_broadcast(&jobdone);
+        pthread_mutex_unlock(&joblock);
+        return NULL;
+}
+
+
+/* background worker of a session: builds the queued archives one by one */
+static void *worker(void *arg)
+{
+        ctx_t *ctx;
+
+        while (1) {
+                pthread_mutex_lock(&joblock);
+                while (!queue)
+                        pthread_cond_wait(&queued, &joblock);
+                ctx = queue;
+                if (!(queue = ctx->next))
+                        queuetail = NULL;
+                pthread_mutex_unlock(&joblock);
+
+                run(ctx);
+        }
+        return NULL;
+}
+
+
+/* requests that walk, read or send many files */
+static int heavy(int op)
+{
+        switch (op) {
+                case OP_SGETFILES:
+                case OP_DGETFILES:
+                case OP_GETFILES:
+                case OP_GETTARGZ:
+                case OP_GETRANGE:
+                case OP_GETSHARD:
+                case OP_RESUME:
+                case OP_HASHFILE:
+                case OP_GETGLOB:
+                case OP_GETRE:
+                case OP_GETQUERY:
+                        return 1;
+                default:
+                        return 0;
+        }
+}
+
+
+/**
+ * @brief Start a request, waiting while too many are in flight. Archive
+ * requests queue for the few background workers of the session; anything
+ * else gets a thread of its own right away, so that a lookup is never
+ * stuck behind an archive of the whole tree.
+ *
+ * @param ctx : the request
+ */
+static void spawn(ctx_t *ctx)
+{
+        pthread_t tid;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        pthread_mutex_lock(&joblock);
+        while (inflight >= MAXINFLIGHT)
+                pthread_cond_wait(&jobdone, &joblock);
+        ++inflight;
+        for (ctx->slot = 0; active[ctx->slot]; ++ctx->slot)
+                ;
+        active[ctx->slot] = ctx->seq = ++nextseq;
+
+        if (heavy(ctx->req.op)) {
+                while (nworkers < NWORKERS && !pthread_create(&tid, &attr, worker, NULL))
+                        ++nworkers;
+                if (nworkers) {
+                        ctx->next = NULL;
+                        if (queuetail)
+                                queuetail->next = ctx;
+                        else
+                                queue = ctx;
+                        queuetail = ctx;
+                        pthread_cond_signal(&queued);
+                        pthread_mutex_unlock(&joblock);
+                        pthread_attr_destroy(&attr);
+                        return;
+                }
+        }
+        pthread_mutex_unlock(&joblock);
+
+        if (pthread_create(&tid, &attr, run, ctx)) {
+                fprintf(stderr, "pthread_create failed, serving inline\n");
+                run(ctx);
+        }
+        pthread_attr_destroy(&attr);
+}
+
+
+/* wait until every request in flight has been answered */
+static void drain(void)
+{
+        pthread_mutex_lock(&joblock);
+        while (inflight)
+                pthread_cond_wait(&jobdone, &joblock);
+        pthread_mutex_unlock(&joblock);
 }
 
 
@@ -385,8 +919,9 @@ int findfile(const char *fpath, const struct stat *st, int type)
                 break;
         case FTW_F:
                 char *fname = basename((char*)fpath);
-                if (!strcmp(fname, extr_arg[1])) {
-                        sprintf(message, "OK:%s, %lld, %s", fname, (long long) st->st_size, ctime(&st->st_ctime));
+                char date[32];
+                if (!strcmp(fname, cur->req.argv[1])) {
+                        snprintf(cur->message, MAXLINE, "OK:%s, %lld, %s", fname, (long long) st->st_size, ctime_r(&st->st_ctime, date));
                         return 1;
                 }
         default:
@@ -403,10 +938,9 @@ int sdgetfiles(const char *fpath, const struct stat *st, int type)
                 fprintf(stderr, "sgetfiles failed!\n");
                 break;
         case FTW_F:
-                if (compare(st, (void*)extr_arg[1], (void*)extr_arg[2], extr_arg[0])) {
-                        strcat(message, " ");
-                        strcat(message, fpath);
-                        status = OK;
+                if (compare(st, (void*)cur->req.argv[1], (void*)cur->req.argv[2], cur->req.argv[0])) {
+                        if (plist_add(&cur->matches, fpath) < 0)
+                                return -1;      /* out of memory: stop the walk */
                 }
                 break;
         default:
@@ -425,10 +959,9 @@ int getfiles(const char *fpath, const struct stat *st, int type)
         case FTW_F:
                 char *fname = basename((char*)fpath);
 
-                if (contains(extr_arg + 1, fname)) {
-                        strcat(message, " ");
-                        strcat(message, fpath);
-                        status = OK;
+                if (contains(cur->req.argv + 1, fname)) {
+                        if (plist_add(&cur->matches, fpath) < 0)
+                                return -1;      /* out of memory: stop the walk */
                 }
                 break;
         default:
@@ -444,10 +977,9 @@ int gettargz(const char *fpath, const struct stat *st, int type)
                 fprintf(stderr, "sgetfiles failed!\n");
                 break;
         case FTW_F:
-                if (match(extr_arg + 1, fpath)) {
-                        strcat(message, " ");
-                        strcat(message, fpath);
-                        status = OK;
+                if (match(cur->req.argv + 1, fpath)) {
+                        if (plist_add(&cur->matches, fpath) < 0)
+                                return -1;      /* out of memory: stop the walk */
                 }
                 break;
         default:
@@ -457,115 +989,1028 @@ int gettargz(const char *fpath, const struct stat *st, int type)
 }
 
 
-static int eval(char *msg, int size) {
-        int i, argc;
-        char *argv[MAXARG];
+static int eval(ctx_t *ctx) {
+        request_t *req = &ctx->req;
+        int argc = req->argc;
+        char **argv = req->argv;
+        int n;
 
-        if ((argc = parse(msg, argv)) < 0) {
-                fprintf(stderr, "parse from the server: command not found.\n");
-                exit(1);
+        /* the manifest rides as an extra last argument */
+        ctx->manifest = NULL;
+        if (req->flags & FL_MANIFEST && argc > 1) {
+                ctx->manifest = argv[--argc];
+                argv[argc] = NULL;
+                req->argc = argc;
         }
 
-        status = ERR;
-
-        strcpy(message, "tar -czf temp.tar.gz");
+        ctx->began = now();
+        ctx->status = ERR;
+        plist_free(&ctx->matches);
+        ctx->matches.arena = &ctx->arena;
+        ctx->range_off = 0;
+        ctx->range_len = -1;
 
-        extr_arg = argv;
-        
         /* check first argument */
         if (!strcmp(*argv, "HELLO")) {
-                printf("Client Number: %d\n", socketfd.nclient);
-                if (available()) {
-                        strcpy(message, "OK");
-                        status = OK;
+                n = __sync_add_and_fetch(socketfd.nclient, 1);
+                printf("Client Number: %d\n", n);
+                /* the mirror never redirects */
+                if (socketfd.mirror || available(n)) {
+                        strcpy(ctx->message, "OK");
+                        ctx->status = OK;
+                        metrics_add(M_LOCAL, 1);
                         printf("Server is available for the incoming connection.\n");
                 } else {
-                        status = BUSY;
+                        ctx->status = BUSY;
+                        metrics_add(M_REDIRECTED, 1);
                         printf("Server is unavailable for the incoming connection, redirect to mirror.\n");
 
                 }
 
         } else if (!strcmp(*argv, "findfile")) {
-                if (ftw(PATH, findfile, 20)) status = OK;
-                else {
-                        status = ERR;
-                        strcpy(message, "ERR:File not found");
+                /* a frame, unlike a client's line, may come with any number of arguments */
+                if (argc != 2) {
+                        strcpy(ctx->message, "ERR:Usage: findfile <filename>");
+                } else {
+                        n = walk_names(findfile, argv + 1);
+                        selected(ctx);
+                        if (n) ctx->status = OK;
+                        else {
+                                ctx->status = ERR;
+                                strcpy(ctx->message, "ERR:File not found");
+                        }
                 }
         
         } else if (!strcmp(*argv, "sgetfiles") || !strcmp(*argv, "dgetfiles")) {
-                ftw(PATH, sdgetfiles, 20);
-                if (status == OK) {
-                        system(message);
+                if (argc != 3) {
+                        strcpy(ctx->message, !strcmp(*argv, "sgetfiles") ? "ERR:Usage: sgetfiles <size1> <size2>" :
+                                                                           "ERR:Usage: dgetfiles <date1> <date2>");
+                } else {
+                        walk(sdgetfiles);
+                        pack(ctx);
                 }
-                status = FILE;
 
         } else if (!strcmp(*argv, "getfiles")) {
-                ftw(PATH, getfiles, 20);
-                if (status == OK) {
-                        system(message);
-                        status = FILE;
+                if (argc < 2) {
+                        strcpy(ctx->message, "ERR:Usage: getfiles <file1> ... <file6>");
                 } else {
-                        status = ERR;
-                        strcpy(message, "ERR:No file found");
+                        walk_names(getfiles, argv + 1);
+                        pack(ctx);
                 }
 
         } else if (!strcmp(*argv, "gettargz")) {
-                ftw(PATH, gettargz, 20);
-                if (status == OK) {
-                        system(message);
-                        status = FILE;
+                if (argc < 2) {
+                        strcpy(ctx->message, "ERR:Usage: gettargz <extension list>");
+                } else {
+                        walk(gettargz);
+                        pack(ctx);
+                }
+
+        } else if (!strcmp(*argv, "getrange")) {
+                /* getrange <cid> <offset> <length>: a piece of a cached archive */
+                if (argc != 4 || cache_lookup(argv[1], ctx->archive)) {
+                        strcpy(ctx->message, "ERR:Unknown content");
+                } else {
+                        strcpy(ctx->content, argv[1]);
+                        ctx->range_off = atoll(argv[2]);
+                        ctx->range_len = atoll(argv[3]);
+                        ctx->status = FILE;
+                }
+
+        } else if (!strcmp(*argv, "getshard")) {
+                /* getshard <cid> <i> <n>: every n-th member from the i-th on */
+                if (argc != 4 || (n = cache_shard(argv[1], atoi(argv[2]), atoi(argv[3]), ctx->archive)) < 0) {
+                        strcpy(ctx->message, "ERR:Unknown content");
+                } else if (n) {
+                        snprintf(ctx->message, MAXLINE, "RETRY-AFTER:%d", n);
+                        metrics_add(M_RETRIES, 1);
+                        ctx->status = RETRY;
+                } else {
+                        strcpy(ctx->content, argv[1]);
+                        ctx->status = FILE;
+                }
+
+        } else if (!strcmp(*argv, "findglob") || !strcmp(*argv, "getglob")) {
+                /* findglob <pattern>: the files matching a shell pattern */
+                int ret;
+
+                if (argc != 2) {
+                        strcpy(ctx->message, "ERR:Usage: findglob <pattern>");
+                } else {
+                        ret = search_glob(index_get(), PATH, argv[1], &ctx->matches);
+                        index_put();
+                        if (ret < 0)
+                                strcpy(ctx->message, "ERR:Search failed");
+                        else if (!strcmp(*argv, "findglob"))
+                                listing(ctx);
+                        else
+                                pack(ctx);
+                }
+
+        } else if (!strcmp(*argv, "findre") || !strcmp(*argv, "getre")) {
+                /* findre <regex>: the files whose path matches an extended regex */
+                char err[MAXLINE - 8];
+                int ret;
+
+                if (argc != 2) {
+                        strcpy(ctx->message, "ERR:Usage: findre <regex>");
+                } else {
+                        ret = search_re(index_get(), PATH, argv[1], &ctx->matches, err, sizeof(err));
+                        index_put();
+                        if (ret == -2)
+                                sprintf(ctx->message, "ERR:%s", err);
+                        else if (ret < 0)
+                                strcpy(ctx->message, "ERR:Search failed");
+                        else if (!strcmp(*argv, "findre"))
+                                listing(ctx);
+                        else
+                                pack(ctx);
+                }
+
+        } else if (!strcmp(*argv, "query") || !strcmp(*argv, "getquery")) {
+                /* query <expression>: the files a boolean query selects */
+                char err[MAXLINE - 8], *text;
+                int ret;
+
+                if (argc < 2) {
+                        strcpy(ctx->message, "ERR:Usage: query <expression>");
+                } else if (!(text = join(ctx, argv + 1))) {
+                        strcpy(ctx->message, "ERR:Out of memory");
+                } else {
+                        ret = query_run(index_get(), PATH, text, &ctx->matches, err, sizeof(err));
+                        index_put();
+                        if (ret == -2)
+                                sprintf(ctx->message, "ERR:%s", err);
+                        else if (ret < 0)
+                                strcpy(ctx->message, "ERR:Search failed");
+                        else if (!strcmp(*argv, "query"))
+                                listing(ctx);
+                        else
+                                pack(ctx);
+                }
+
+        } else if (!strcmp(*argv, "STATS")) {
+                buf_t out;
+
+                buf_init_arena(&out, &ctx->arena);
+                if (buf_put(&out, "OK:", 3) < 0 || metrics_render(&out) < 0 || buf_put(&out, "", 1) < 0) {
+                        strcpy(ctx->message, "ERR:Out of memory");
+                } else {
+                        ctx->output = out.data;
+                        ctx->status = OK;
+                }
+
+        } else if (!strcmp(*argv, "hashfile")) {
+                /* hashfile <file1> ... <file6>: checksums of the files so named */
+                if (argc < 2) {
+                        strcpy(ctx->message, "ERR:Usage: hashfile <file1> ... <file6>");
+                } else {
+                        walk_names(getfiles, argv + 1);
+                        checksum(ctx);
+                }
 
+        } else if (!strcmp(*argv, "resume")) {
+                /* resume <cid> <offset>: the rest of an interrupted transfer */
+                if (argc != 3 || cache_lookup(argv[1], ctx->archive)) {
+                        strcpy(ctx->message, "ERR:Unknown content");
                 } else {
-                        status = ERR;
-                        strcpy(message, "ERR:No file found");
+                        strcpy(ctx->content, argv[1]);
+                        ctx->range_off = atoll(argv[2]);
+                        ctx->status = FILE;
                 }
+        } else if (!strcmp(*argv, "list")) {
+                /* list <-n limit> <-c cursor> <command> <args>: page through what a command selects */
+                int k = 1;
+
+                ctx->listlimit = -1;
+                ctx->listcursor = NULL;
+                for (; k + 1 < argc && argv[k][0] == '-'; k += 2) {
+                        if (!strcmp(argv[k], "-n"))
+                                ctx->listlimit = atol(argv[k + 1]);
+                        else if (!strcmp(argv[k], "-c"))
+                                ctx->listcursor = argv[k + 1];
+                        else
+                                break;
+                }
+
+                if (k == argc || !strcmp(argv[k], "list") || !strcmp(argv[k], "findfile") ||
+                    ctx->listlimit == 0 || ctx->listlimit < -1) {
+                        strcpy(ctx->message, "ERR:Usage: list <-n limit> <-c cursor> <command> <args>");
+                } else {
+                        req->argv += k;
+                        req->argc -= k;
+                        ctx->listmode = 1;
+                        eval(ctx);
+                        ctx->listmode = 0;
+                        req->argv -= k;
+                        req->argc += k;
+                }
+
         } else if (!strcmp(*argv, "quit")) {
-                status = QUIT;
+                ctx->status = QUIT;
         } else if (!strcmp(*argv, "MIRROR")) {
-                strcpy(client_port, argv[1]);
-                status = MIRROR;
+                /* MIRROR <port> [unixpath] */
+                if (argc < 2 || strlen(argv[1]) >= NI_MAXSERV || (argc > 2 && strlen(argv[2]) >= SUNPATHLEN)) {
+                        strcpy(ctx->message, "ERR:Usage: MIRROR <port> [unixpath]");
+                } else {
+                        strcpy(client_port, argv[1]);
+                        if (argc > 2)
+                                strcpy(mirror_unixpath, argv[2]);
+                        ctx->status = MIRROR;
+                }
         } else {
                 fprintf(stderr, "eval from the server: command not found.\n");
-                status = ERR;
+                strcpy(ctx->message, "ERR:Command not found");
+                ctx->status = ERR;
+        }
+
+}
+
+
+/* the words of a command put back together, the way the client split them */
+static char *join(ctx_t *ctx, char *args[])
+{
+        size_t len = 1;
+        char *s;
+
+        for (int i = 0; args[i]; ++i)
+                len += strlen(args[i]) + 1;
+        if (!(s = arena_alloc(&ctx->arena, len)))
+                return NULL;
+
+        s[0] = '\0';
+        for (int i = 0; args[i]; ++i) {
+                if (i)
+                        strcat(s, " ");
+                strcat(s, args[i]);
         }
+        return s;
+}
 
+
+/* under list, the matches are paged through by entries() rather than answered */
+static int listed(ctx_t *ctx)
+{
+        if (!ctx->listmode)
+                return 0;
+        ctx->status = LIST;
+        return 1;
 }
 
 
-static void send_file(int fd, int connfd)
-{       
+static int cmpstr(const void *a, const void *b)
+{
+        return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+
+/**
+ * @brief Answer a list request: the matched files in path order, from the
+ * one after the cursor on and up to the limit, one "path size ctime" line
+ * each, separated by tabs. Binary clients get the lines in OP_ENTRIES frames
+ * as they are formatted, then an OP_OK with the counts and the cursor of
+ * the next page, so a listing never has to fit in memory at once. Text
+ * clients get one reply.
+ *
+ * @param ctx : the list request
+ */
+static void entries(ctx_t *ctx)
+{
+        request_t *req = &ctx->req;
+        int connfd = ctx->connfd;
+        struct stat st;
+        struct tm tm;
+        buf_t out;
+        char line[PATH_MAX + 64], date[32], *after, *hex;
+        int first = 0, lo, hi, mid, i, n;
+        long sent = 0;
+
+        buf_init_arena(&out, &ctx->arena);
+        qsort(ctx->matches.paths, ctx->matches.n, sizeof(char*), cmpstr);
+
+        /* the cursor is the hex of the last path of the previous page */
+        if (ctx->listcursor) {
+                n = strlen(ctx->listcursor) / 2;
+                if (!(after = arena_alloc(&ctx->arena, n + 1)))
+                        goto nomem;
+                for (i = 0; i < n && sscanf(ctx->listcursor + 2 * i, "%2hhx", &after[i]) == 1; ++i)
+                        ;
+                after[i] = '\0';
+
+                for (lo = 0, hi = ctx->matches.n; lo < hi; ) {
+                        mid = lo + (hi - lo) / 2;
+                        if (strcmp(ctx->matches.paths[mid], after) <= 0)
+                                lo = mid + 1;
+                        else
+                                hi = mid;
+                }
+                first = lo;
+        }
+
+        if (req->text && buf_put(&out, "OK:", 3) < 0)
+                goto nomem;
+
+        for (i = first; i < ctx->matches.n && (ctx->listlimit < 0 || sent < ctx->listlimit); ++i) {
+                if (stat(ctx->matches.paths[i], &st) < 0)
+                        continue;       /* gone since the index was built */
+                localtime_r(&st.st_ctime, &tm);
+                strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+                n = snprintf(line, sizeof(line), "%s\t%lld\t%s\n", ctx->matches.paths[i],
+                             (long long) st.st_size, date);
+                if (buf_put(&out, line, n) < 0)
+                        goto nomem;
+                ++sent;
+
+                if (!req->text && out.len >= LISTCHUNK) {
+                        if (buf_put(&out, "", 1) < 0)
+                                goto nomem;
+                        reply(req, OP_ENTRIES, out.data, connfd);
+                        if (tune_zerocopy(connfd))
+                                buf_init_arena(&out, &ctx->arena);
+                        else
+                                out.len = 0;
+                }
+        }
+
+        if (!req->text && out.len) {
+                if (buf_put(&out, "", 1) < 0)
+                        goto nomem;
+                reply(req, OP_ENTRIES, out.data, connfd);
+                if (tune_zerocopy(connfd))
+                        buf_init_arena(&out, &ctx->arena);
+                else
+                        out.len = 0;
+        }
+
+        /* what is left, and where it starts */
+        n = snprintf(line, sizeof(line), "%s%ld of %d entries", req->text ? "" : "OK:", sent, ctx->matches.n);
+        if (buf_put(&out, line, n) < 0)
+                goto nomem;
+        if (i < ctx->matches.n) {
+                if (!(hex = arena_alloc(&ctx->arena, 2 * strlen(ctx->matches.paths[i - 1]) + 1)))
+                        goto nomem;
+                for (n = 0; ctx->matches.paths[i - 1][n]; ++n)
+                        sprintf(hex + 2 * n, "%02x", (unsigned char) ctx->matches.paths[i - 1][n]);
+                if (buf_put(&out, ", next page: -c ", 16) < 0 || buf_put(&out, hex, 2 * n) < 0)
+                        goto nomem;
+        }
+        if (buf_put(&out, "\n", 2) < 0)
+                goto nomem;
+
+        reply(req, OP_OK, out.data, connfd);
+        return;
+
+nomem:
+        reply(req, OP_ERR, "ERR:Out of memory", connfd);
+}
+
+
+/* answer a search with the paths it matched, one per line */
+static void listing(ctx_t *ctx)
+{
+        buf_t out;
+
+        selected(ctx);
+        if (listed(ctx))
+                return;
+        if (!ctx->matches.n) {
+                strcpy(ctx->message, "ERR:No file found");
+                return;
+        }
+
+        buf_init_arena(&out, &ctx->arena);
+        if (buf_put(&out, "OK:", 3) < 0)
+                goto nomem;
+        for (int i = 0; i < ctx->matches.n; ++i) {
+                if (buf_put(&out, ctx->matches.paths[i], strlen(ctx->matches.paths[i])) < 0 ||
+                    buf_put(&out, "\n", 1) < 0)
+                        goto nomem;
+        }
+        if (buf_put(&out, "", 1) < 0)
+                goto nomem;
+
+        ctx->output = out.data;
+        ctx->status = OK;
+        return;
+
+nomem:
+        buf_free(&out);
+        strcpy(ctx->message, "ERR:Out of memory");
+}
+
+
+/**
+ * @brief Answer a hashfile request with the XXH64 of every file the walk
+ * matched, one "hash  path" line each, as sha256sum prints them, or
+ * "ERR  path" for a file that could not be read.
+ */
+static void checksum(ctx_t *ctx)
+{
+        const index_t *ix;
+        struct stat st;
+        uint64_t *h;
+        buf_t out;
+        char line[PATH_MAX + 32], *bad;
+        int n;
+
+        selected(ctx);
+        if (listed(ctx))
+                return;
+        if (!ctx->matches.n) {
+                strcpy(ctx->message, "ERR:No file found");
+                return;
+        }
+
+        buf_init_arena(&out, &ctx->arena);
+        if (!(h = arena_alloc(&ctx->arena, ctx->matches.n * sizeof(uint64_t))) ||
+            !(bad = arena_alloc(&ctx->arena, ctx->matches.n)) || buf_put(&out, "OK:", 3) < 0)
+                goto nomem;
+
+        /* the table starts empty with the node: what it has lost, the index may still have */
+        ix = index_get();
+        for (int i = 0; i < ctx->matches.n; ++i) {
+                if (!stat(ctx->matches.paths[i], &st) && hash_known(&st, &h[i]) &&
+                    !index_hash(ix, ctx->matches.paths[i], &st, &h[i]))
+                        hash_remember(&st, h[i]);
+        }
+        index_put();
+
+        throttle_opens(ctx->matches.n);
+        hash_files(ctx->matches.paths, ctx->matches.n, h, bad);
+        for (int i = 0; i < ctx->matches.n; ++i) {
+                if (bad[i])
+                        n = snprintf(line, sizeof(line), "ERR  %s\n", ctx->matches.paths[i]);
+                else
+                        n = snprintf(line, sizeof(line), "%016llx  %s\n", (unsigned long long) h[i],
+                                     ctx->matches.paths[i]);
+                if (buf_put(&out, line, n) < 0)
+                        goto nomem;
+        }
+        if (buf_put(&out, "", 1) < 0)
+                goto nomem;
+
+        ctx->output = out.data;
+        ctx->status = OK;
+        return;
+
+nomem:
+        buf_free(&out);
+        strcpy(ctx->message, "ERR:Out of memory");
+}
+
+
+/**
+ * @brief Answer an archive request with the files the walk matched,
+ * less those the client listed in its manifest as already held. The
+ * archive comes from the cache, built on a miss. Requests flagged
+ * FL_PREPARE get only its description, "cid size nfiles port", and the
+ * client then fetches it with getrange or getshard over as many
+ * connections as it likes. Requests flagged FL_STORED, and not
+ * FL_PREPARE, get an uncompressed tar made as it is sent instead.
+ * 
+ * @param ctx : the archive request
+ */
+static void pack(ctx_t *ctx)
+{
+        request_t *req = &ctx->req;
+        struct stat st;
+        int nskip = 0, wait;
+
+        selected(ctx);
+        if (listed(ctx))
+                return;
+        if (!ctx->matches.n) {
+                strcpy(ctx->message, "ERR:No file found");
+                return;
+        }
+
+        /* leave out what the client already has */
+        if (ctx->manifest && (nskip = plist_skip(&ctx->matches, ctx->manifest)) < 0) {
+                strcpy(ctx->message, "ERR:Out of memory");
+                return;
+        }
+        if (!ctx->matches.n) {
+                sprintf(ctx->message, "OK:Up to date, %d files unchanged\n", nskip);
+                ctx->status = OK;
+                return;
+        }
+
+        /* nothing to build: ranges and shards need the cached archive */
+        if (req->flags & FL_STORED && !(req->flags & FL_PREPARE)) {
+                store(ctx);
+                return;
+        }
+
+        if ((wait = cache_archive(&ctx->matches, ctx->content, ctx->archive)) > 0) {
+                snprintf(ctx->message, MAXLINE, "RETRY-AFTER:%d", wait);
+                metrics_add(M_RETRIES, 1);
+                ctx->status = RETRY;
+                return;
+        }
+        if (wait < 0 || stat(ctx->archive, &st) < 0) {
+                /* the files the index knew of may all be gone */
+                strcpy(ctx->message, ctx->matches.n ? "ERR:Archive failed" : "ERR:No file found");
+                return;
+        }
+
+        if (req->flags & FL_PREPARE) {
+                snprintf(ctx->message, MAXLINE, "OK:%s %lld %d %s", ctx->content, (long long) st.st_size,
+                         ctx->matches.n, socketfd.port);
+                ctx->status = META;
+        } else {
+                ctx->status = FILE;
+        }
+}
+
+
+/**
+ * @brief Get ready to stream the matches as an uncompressed tar: the
+ * files are looked at once, and the archive is sent as they were then,
+ * so that its size is known before the first byte goes out.
+ *
+ * @param ctx : the archive request, its matches less the files gone
+ */
+static void store(ctx_t *ctx)
+{
+        int n = 0;
+
+        if (!(ctx->members = arena_alloc(&ctx->arena, ctx->matches.n * sizeof(struct stat)))) {
+                strcpy(ctx->message, "ERR:Out of memory");
+                return;
+        }
+
+        ctx->stored = TAREND;
+        for (int i = 0; i < ctx->matches.n; ++i) {
+                if (stat(ctx->matches.paths[i], &ctx->members[n]) < 0 || !S_ISREG(ctx->members[n].st_mode))
+                        continue;
+                ctx->matches.paths[n] = ctx->matches.paths[i];
+                ctx->stored += tar_member(ctx->matches.paths[n], &ctx->members[n]);
+                ++n;
+        }
+        if (!(ctx->matches.n = n)) {
+                strcpy(ctx->message, "ERR:No file found");
+                return;
+        }
+
+        ctx->content[0] = '\0';        /* made anew every time, so not resumable */
+        ctx->status = STORED;
+}
+
+
+/**
+ * @brief Send an archive, or a byte range of it, to the client. Text
+ * clients get a SIZE:n line followed by the raw bytes; binary clients get
+ * an OP_FILE frame with the 64-bit size and the content id followed by
+ * OP_DATA frames, so a transfer is not limited by the 32-bit frame
+ * length, and an OP_SUM trailer with the XXH64 of the bytes sent. The
+ * bytes always go out with sendfile().
+ * 
+ * @param ctx : the request being answered
+ * @param fd : the archive
+ * @param off : first byte to send
+ * @param len : number of bytes, -1 for the rest of the archive
+ */
+static void send_file(ctx_t *ctx, int fd, off_t off, off_t len)
+{
+        request_t *req = &ctx->req;
+        int connfd = ctx->connfd;
         struct stat stat_buf;
+        char hdr[MAXLINE];
+        uint64_t size, sum;
+        off_t end, first;
+        long nsend, chunk, cidlen = strlen(ctx->content);
 
         fstat(fd, &stat_buf);
 
-        int nsend;
-        
-        char size[MAXLINE];
+        /* clamp the range to the archive */
+        if (off < 0 || off > stat_buf.st_size)
+                off = stat_buf.st_size;
+        end = len < 0 || len > stat_buf.st_size - off ? stat_buf.st_size : off + len;
+        first = off;
+
+        /* the header and the first data share a segment */
+        tune_cork(connfd, 1);
+
+        if (req->text) {
+                sprintf(hdr, "SIZE:%lld\n", (long long) (end - off));
+                nsend = send(connfd, hdr, strlen(hdr), MSG_MORE);
+        } else {
+                size = htobe64(end - off);
+                frame_pack(hdr, OP_FILE, 0, req->id, sizeof(uint64_t) + cidlen);
+                memcpy(hdr + FRAME_HDRLEN, &size, sizeof(uint64_t));
+                memcpy(hdr + FRAME_HDRLEN + sizeof(uint64_t), ctx->content, cidlen);
+                pthread_mutex_lock(&sendlock);
+                nsend = send(connfd, hdr, FRAME_HDRLEN + sizeof(uint64_t) + cidlen, MSG_MORE);
+                pthread_mutex_unlock(&sendlock);
+        }
+        if (nsend < 0)
+                goto errout;
+        trace_sent(nsend);
+
+        /*
+         * Send the archive itself. Each OP_DATA frame goes out whole under
+         * sendlock; other responses are interleaved between the frames.
+         */
+        while (off < end) {
+                chunk = end - off;
+                if (chunk > DATACHUNK)
+                        chunk = DATACHUNK;
+                throttle_bytes(chunk);          /* before sendlock: the other responses go on meanwhile */
+                metrics_add(M_BYTES, chunk);
+                if (!req->text) {
+                        frame_pack(hdr, OP_DATA, 0, req->id, chunk);
+                        pthread_mutex_lock(&sendlock);
+                        if (send(connfd, hdr, FRAME_HDRLEN, MSG_MORE) < 0)
+                                goto errout;
+                }
+                /* sendfile() may stop short of chunk */
+                for (long left = chunk; left > 0; left -= nsend) {
+                        if ((nsend = sendfile(connfd, fd, &off, left)) <= 0)
+                                goto errout;
+                }
+                trace_sent(chunk);
+                if (!req->text)
+                        pthread_mutex_unlock(&sendlock);
+        }
+
+        if (req->text) {
+                tune_cork(connfd, 0);
+                return;
+        }
+
+        /* the trailer lets the client check what it wrote to disk */
+        if (hash_fd(fd, first, end - first, &sum) < 0) {
+                tune_cork(connfd, 0);
+                reply(req, OP_ERR, "ERR:Checksum failed", connfd);
+                return;
+        }
+        sum = htobe64(sum);
+        frame_pack(hdr, OP_SUM, 0, req->id, sizeof(uint64_t));
+        memcpy(hdr + FRAME_HDRLEN, &sum, sizeof(uint64_t));
+        pthread_mutex_lock(&sendlock);
+        nsend = send(connfd, hdr, FRAME_HDRLEN + sizeof(uint64_t), 0);
+        pthread_mutex_unlock(&sendlock);
+        tune_cork(connfd, 0);
+        if (nsend < 0)
+                goto errout;
+        trace_sent(nsend);
+        return;
+
+errout:
+        close(connfd);
+        fprintf(stderr, "sendfile failed!\n");
+        exit(1);
+}
+
+
+/*
+ * Send bytes [pos, pos + len) of a member of a stored archive, adding
+ * them to the running hash: its header from memory, its body with
+ * sendfile(), then zeros to the end of the block. A file that has shrunk
+ * since it was announced is made up with zeros too.
+ */
+static int send_member(int connfd, int fd, const char *th, long hlen, off_t body,
+                       off_t pos, long len, hash_state_t *sum)
+{
+        static const char zeros[TARBLOCK];
+        off_t off;
+        long n, got;
+
+        if (pos < hlen) {
+                n = hlen - pos < len ? hlen - pos : len;
+                if (send(connfd, th + pos, n, MSG_MORE) < 0)
+                        return -1;
+                hash_update(sum, th + pos, n);
+                pos += n;
+                len -= n;
+        }
+
+        while (len > 0) {
+                n = pos < hlen + body ? hlen + body - pos : TARBLOCK;
+                if (n > len)
+                        n = len;
+                off = pos - hlen;
+                got = 0;
+                if (pos < hlen + body && fd >= 0 && (got = sendfile(connfd, fd, &off, n)) < 0)
+                        return -1;
+                if (got > 0) {
+                        /* hashed from the page cache the bytes were just sent from */
+                        if (hash_update_fd(sum, fd, off - got, got) < 0)
+                                return -1;
+                        n = got;
+                } else {
+                        if (n > TARBLOCK)
+                                n = TARBLOCK;
+                        if (send(connfd, zeros, n, MSG_MORE) < 0)
+                                return -1;
+                        hash_update(sum, zeros, n);
+                }
+                pos += n;
+                len -= n;
+        }
+        return 0;
+}
+
+
+/**
+ * @brief Send the archive store() got ready, in the frames send_file()
+ * uses. Only the tar headers and padding are made here, in memory; the
+ * bodies go from the page cache to the socket with sendfile(), and are
+ * read once more, through a mapping, for the OP_SUM trailer. Text clients
+ * can't ask for one, as they send no flags.
+ *
+ * @param ctx : the request being answered
+ */
+static void send_tar(ctx_t *ctx)
+{
+        static const char zeros[TAREND];
+        request_t *req = &ctx->req;
+        int connfd = ctx->connfd, fd;
+        char hdr[FRAME_HDRLEN + sizeof(uint64_t)], th[TARHDRMAX];
+        hash_state_t sum;
+        uint64_t size;
+        off_t pos, total;
+        long hlen, chunk, nsend;
+
+        tune_cork(connfd, 1);
+
+        size = htobe64(ctx->stored);
+        frame_pack(hdr, OP_FILE, 0, req->id, sizeof(uint64_t));
+        memcpy(hdr + FRAME_HDRLEN, &size, sizeof(uint64_t));
+        pthread_mutex_lock(&sendlock);
+        nsend = send(connfd, hdr, FRAME_HDRLEN + sizeof(uint64_t), MSG_MORE);
+        pthread_mutex_unlock(&sendlock);
+        if (nsend < 0)
+                goto errout;
+        trace_sent(nsend);
+
+        hash_reset(&sum, 0);
+        for (int i = 0; i < ctx->matches.n; ++i) {
+                hlen = tar_header(th, ctx->matches.paths[i], &ctx->members[i]);
+                total = tar_member(ctx->matches.paths[i], &ctx->members[i]);
+
+                /* gone since store(): zeros in its place */
+                throttle_opens(1);
+                fd = open(ctx->matches.paths[i], O_RDONLY);
+
+                for (pos = 0; pos < total; pos += chunk) {
+                        chunk = total - pos < DATACHUNK ? total - pos : DATACHUNK;
+                        throttle_bytes(chunk);
+                        metrics_add(M_BYTES, chunk);
+                        frame_pack(hdr, OP_DATA, 0, req->id, chunk);
+                        pthread_mutex_lock(&sendlock);
+                        if (send(connfd, hdr, FRAME_HDRLEN, MSG_MORE) < 0 ||
+                            send_member(connfd, fd, th, hlen, ctx->members[i].st_size, pos, chunk, &sum) < 0)
+                                goto errout;
+                        pthread_mutex_unlock(&sendlock);
+                        trace_sent(FRAME_HDRLEN + chunk);
+                }
+                if (fd >= 0)
+                        close(fd);
+        }
+
+        /* the end of the archive, then the trailer */
+        hash_update(&sum, zeros, TAREND);
+        frame_pack(hdr, OP_DATA, 0, req->id, TAREND);
+        pthread_mutex_lock(&sendlock);
+        if (send(connfd, hdr, FRAME_HDRLEN, MSG_MORE) < 0 || send(connfd, zeros, TAREND, MSG_MORE) < 0)
+                goto errout;
+        size = htobe64(hash_digest(&sum));
+        frame_pack(hdr, OP_SUM, 0, req->id, sizeof(uint64_t));
+        memcpy(hdr + FRAME_HDRLEN, &size, sizeof(uint64_t));
+        nsend = send(connfd, hdr, FRAME_HDRLEN + sizeof(uint64_t), 0);
+        pthread_mutex_unlock(&sendlock);
+        tune_cork(connfd, 0);
+        if (nsend < 0)
+                goto errout;
+        metrics_add(M_BYTES, TAREND);
+        trace_sent(2 * FRAME_HDRLEN + TAREND + sizeof(uint64_t));
+        return;
+
+errout:
+        close(connfd);
+        fprintf(stderr, "sendfile failed!\n");
+        exit(1);
+}
 
-        sprintf(size, "SIZE:%d\n", stat_buf.st_size);
-        if ((nsend = send(connfd, size, strlen(size), 0)) < 0) {
-                close(connfd);
-                fprintf(stderr, "sendfile failed!\n");
-                exit(1);
-        }    
 
-        /* send files.tar.gz to the mirror */
-        if ((nsend = sendfile(connfd, fd, NULL, stat_buf.st_size)) < 0) {
+static void send_text(char *msg, int connfd) 
+{
+        if (tune_send(connfd, msg, strlen(msg) + 1, 0) < 0) {
+                fprintf(stderr, "send failed!\n");
                 close(connfd);
-                fprintf(stderr, "sendfile failed!\n");
                 exit(1);
         }
-        
 }
 
 
-static void send_text(char *msg, int connfd) 
+/**
+ * @brief Send a text result in the protocol the request came in. The
+ * "OK:"/"ERR:" prefix of text replies is carried by the opcode in a frame.
+ * 
+ * @param op : OP_OK, OP_ERR, OP_BUSY, OP_META or OP_ENTRIES
+ * @param msg : the reply as a text client would get it
+ */
+static void reply(request_t *req, int op, char *msg, int connfd)
 {
-        if (send(connfd, msg, strlen(msg) + 1, 0) < 0) {
+        char hdr[FRAME_HDRLEN];
+        char *colon;
+        size_t len;
+
+        throttle_bytes(strlen(msg));
+        metrics_add(M_BYTES, strlen(msg));
+        if (req->text) {
+                send_text(msg, connfd);
+                trace_sent(strlen(msg));
+                return;
+        }
+
+        if ((colon = strchr(msg, ':')) && (!strncmp(msg, "OK:", 3) || !strncmp(msg, "ERR:", 4) ||
+                                           !strncmp(msg, "BUSY:", 5) || !strncmp(msg, "RETRY-AFTER:", 12)))
+                msg = colon + 1;
+        len = strlen(msg);
+
+        frame_pack(hdr, op, 0, req->id, len);
+        pthread_mutex_lock(&sendlock);
+        if (send(connfd, hdr, FRAME_HDRLEN, MSG_MORE) < 0 || tune_send(connfd, msg, len, 0) < 0) {
                 fprintf(stderr, "send failed!\n");
                 close(connfd);
                 exit(1);
         }
+        pthread_mutex_unlock(&sendlock);
+        trace_sent(FRAME_HDRLEN + len);
+}
+
+
+/**
+ * @brief The index a request can answer from, held until index_put().
+ * The mapped one is trusted as long as no directory of the tree has
+ * changed since it was built; otherwise the latest one the indexer wrote
+ * is mapped in its place, and if that one is behind too, the request
+ * walks the tree.
+ *
+ * @return const index_t* : the index, or an empty one to walk the tree
+ */
+static const index_t *index_get(void)
+{
+        struct stat st;
+
+        pthread_rwlock_rdlock(&indexlock);
+        if (index_current(&fileindex))
+                return &fileindex;
+        pthread_rwlock_unlock(&indexlock);
+
+        /* replaced with rename(): a new inode */
+        pthread_rwlock_wrlock(&indexlock);
+        if (!stat(INDEXFILE, &st) && (st.st_ino != fileindex.ino || st.st_dev != fileindex.dev)) {
+                index_close(&fileindex);
+                index_open(&fileindex, INDEXFILE);
+        }
+        pthread_rwlock_unlock(&indexlock);
+
+        pthread_rwlock_rdlock(&indexlock);
+        return index_current(&fileindex) ? &fileindex : &noindex;
+}
+
+
+static void index_put(void)
+{
+        pthread_rwlock_unlock(&indexlock);
+}
+
+
+/**
+ * @brief Run an ftw() callback over every file of the tree: over the
+ * records of the index while it is current, so that no directory is
+ * read, or over the tree itself. Either way the callback gets the file
+ * as stat() finds it now.
+ * 
+ * @param fn : the callback; a non-zero return stops the walk
+ * @return int : the last value fn returned
+ */
+static int walk(int (*fn)(const char*, const struct stat*, int))
+{
+        const index_t *ix = index_get();
+        struct stat st;
+        int ret = 0;
+
+        if (!ix->map) {
+                index_put();
+                return ftw(PATH, fn, 20);
+        }
+
+        for (uint32_t i = 0; i < ix->n && !ret; ++i) {
+                if (!stat(index_path(ix, i), &st) && S_ISREG(st.st_mode))
+                        ret = fn(index_path(ix, i), &st, FTW_F);
+        }
+        index_put();
+        return ret;
+}
+
+
+/* run fn over the files named like one of names, looked up in the index */
+static int walk_names(int (*fn)(const char*, const struct stat*, int), char *names[])
+{
+        const index_t *ix = index_get();
+        struct stat st;
+        uint32_t first, n, rec;
+        int ret = 0;
+
+        if (!ix->map) {
+                index_put();
+                return ftw(PATH, fn, 20);
+        }
+
+        for (int i = 0; names[i] && !ret; ++i) {
+                n = index_lookup(ix, names[i], &first);
+                for (uint32_t k = first; k < first + n && !ret; ++k) {
+                        rec = ix->byname[k];
+                        if (!stat(index_path(ix, rec), &st) && S_ISREG(st.st_mode))
+                                ret = fn(index_path(ix, rec), &st, FTW_F);
+                }
+        }
+        index_put();
+        return ret;
+}
+
+
+/**
+ * @brief Fork the indexer: a process that walks the tree and rewrites
+ * the index file every INDEXPERIOD seconds. Requests map the latest
+ * index when the one they have no longer matches the tree, and walk the
+ * tree themselves when that one is behind too.
+ */
+static void indexer(void)
+{
+        double t;
+        int n;
+
+        fflush(stdout);         /* or the child prints it again */
+        if (fork())
+                return;
+
+        /* go away with the node */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGCHLD, SIG_DFL);
+        close(socketfd.listenfd);
+
+        while (1) {
+                t = now();
+                if ((n = index_build(PATH, INDEXFILE)) < 0)
+                        fprintf(stderr, "Index: build failed\n");
+                else
+                        printf("Index: %d files indexed in %.3f ms\n", n, (now() - t) * 1e3);
+                fflush(stdout);
+                sleep(INDEXPERIOD);
+        }
+}
+
+
+/* serve the metrics on port of the loopback interface, in a process of its own */
+static void exporter(char *port)
+{
+        int fd;
+
+        if ((fd = metrics_listen(port)) < 0) {
+                fprintf(stderr, "Metrics: cannot listen on port %s\n", port);
+                return;
+        }
+        printf("Metrics: http://localhost:%s/metrics\n", port);
+
+        fflush(stdout);
+        if (fork()) {
+                close(fd);
+                return;
+        }
+
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGCHLD, SIG_DFL);
+        close(socketfd.listenfd);
+        metrics_export(fd);
+}
+
+
+/* atexit() handler of a session */
+static void closed(void)
+{
+        metrics_gauge(G_SESSIONS, -1);
+}
+
+
+/* the files of a request are known: account for the time it took to find them */
+static void selected(ctx_t *ctx)
+{
+        metrics_time(H_WALK, now() - ctx->began);
+        trace_mark(TR_MATCH, ctx->matches.n);
+}
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 
@@ -633,29 +2078,89 @@ static int match(char *args[], const char *fname)
         return 0;
 }
 
-static void transfer(int connfd) 
+static void transfer(request_t *req, int connfd) 
 {
-        char msg[MAXLINE];
+        char msg[MAXLINE * 2 + 8];
 
         sprintf(msg, "BUSY:%s %s", socketfd.mirror_hostname, socketfd.mirror_port);
 
         /* send command to the client to request to the mirror */
-        if (send(connfd, msg, strlen(msg) + 1, 0) < 0) {
-                fprintf(stderr, "send failed!\n");
-                close(connfd);
-                exit(1);
-        }
+        reply(req, OP_BUSY, msg, connfd);
+}
+
+
+/**
+ * @brief Hand the client's socket over to a mirror running on this host.
+ * The descriptor is passed over the mirror's UNIX domain socket together
+ * with a one byte tag telling the mirror that HELLO has already been read,
+ * so the client is served without a second TCP handshake or DNS lookup.
+ * 
+ * @param connfd : the connected client socket
+ * @return int : 0 if the mirror took the connection, -1 otherwise.
+ */
+static int handoff(int connfd)
+{
+        int fd;
+        char tag = 'H';
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        struct sockaddr_un addr;
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+
+        if (!socketfd.mirror_unixpath[0] || strlen(socketfd.mirror_unixpath) >= SUNPATHLEN)
+                return -1;
+
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, socketfd.mirror_unixpath, strlen(socketfd.mirror_unixpath));
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+                return -1;
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) < 0)
+                goto errout;
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        memset(&ctl, 0, sizeof(ctl));
+        iov.iov_base = &tag;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &connfd, sizeof(int));
+
+        if (sendmsg(fd, &msg, 0) != 1)
+                goto errout;
+
+        printf("Handed the connection to the local mirror.\n");
+        close(fd);
+        return 0;
+
+errout:
+        fprintf(stderr, "handoff to %s failed (%s), redirecting instead.\n",
+                socketfd.mirror_unixpath, strerror(errno));
+        close(fd);
+        return -1;
 }
 
 
-static int available()
+static int available(int nclient)
 {
-        if (socketfd.nclient <= 4)
+        if (nclient <= 4)
                 return 1;
-        else if (socketfd.nclient <= 8)
+        else if (nclient <= 8)
                 return 0;
         else {
-                if (socketfd.nclient % 2 == 0)
+                if (nclient % 2 == 0)
                         return 0;
                 else    
                         return 1;
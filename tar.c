@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tar.h"
+
+#define NAMELEN         100             /* bytes of the name field */
+#define LONGLINK        "././@LongLink"
+
+
+/* an octal field with its NUL, or base 256 when the value doesn't fit */
+static void number(char *field, int width, uint64_t v)
+{
+        if (v < 1ULL << 3 * (width - 1)) {
+                snprintf(field, width, "%0*llo", width - 1, (unsigned long long) v);
+                return;
+        }
+        for (int i = width - 1; i > 0; --i) {
+                field[i] = v & 0xff;
+                v >>= 8;
+        }
+        field[0] = (char) 0x80;
+}
+
+
+/* one header block; the checksum is taken over it with its own field as spaces */
+static void block(char *b, const char *name, size_t namelen, const struct stat *st, uint64_t size, char type)
+{
+        unsigned int sum = 0;
+
+        memset(b, 0, TARBLOCK);
+        memcpy(b, name, namelen < NAMELEN ? namelen : NAMELEN);
+        number(b + 100, 8, st ? st->st_mode & 07777 : 0);
+        number(b + 108, 8, st ? st->st_uid : 0);
+        number(b + 116, 8, st ? st->st_gid : 0);
+        number(b + 124, 12, size);
+        number(b + 136, 12, st && st->st_mtime > 0 ? st->st_mtime : 0);
+        b[156] = type;
+        memcpy(b + 257, "ustar  ", 8);  /* GNU magic and version */
+
+        memset(b + 148, ' ', 8);
+        for (int i = 0; i < TARBLOCK; ++i)
+                sum += (unsigned char) b[i];
+        snprintf(b + 148, 8, "%06o", sum);
+        b[155] = ' ';
+}
+
+
+/**
+ * @brief Build the header of a regular file, as tar -c would write it
+ * without the owner's names.
+ *
+ * @param hdr : TARHDRMAX bytes, or NULL to get the length only
+ * @param path : the member name
+ * @param st : the file, as it is announced
+ * @return long : bytes of header, a multiple of TARBLOCK
+ */
+long tar_header(char *hdr, const char *path, const struct stat *st)
+{
+        size_t len = strlen(path);
+        long n = 0;
+
+        /* the name with its NUL, in blocks after a header of its own */
+        if (len > NAMELEN) {
+                n = TARBLOCK + len + 1 + TARPAD(len + 1);
+                if (hdr) {
+                        block(hdr, LONGLINK, sizeof(LONGLINK) - 1, NULL, len + 1, 'L');
+                        memset(hdr + TARBLOCK, 0, n - TARBLOCK);
+                        memcpy(hdr + TARBLOCK, path, len);
+                }
+        }
+
+        if (hdr)
+                block(hdr + n, path, len, st, st->st_size, '0');
+        return n + TARBLOCK;
+}
+
+
+/* bytes a file takes in an archive: header, body and padding */
+off_t tar_member(const char *path, const struct stat *st)
+{
+        return tar_header(NULL, path, st) + st->st_size + TARPAD(st->st_size);
+}
@@ -0,0 +1,27 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * Tar headers built in memory, for archives streamed straight from the
+ * files they hold.
+ *
+ * A member is its header, its body and zeros up to the next 512-byte
+ * block; the archive ends with two zero blocks. Headers are in the GNU
+ * format, which GNU tar writes by default: names of more than 100 bytes
+ * go in a ././@LongLink member of their own, and numbers too large for
+ * their octal fields in base 256.
+ */
+
+#define TARBLOCK        512
+#define TARPAD(n)       ((TARBLOCK - (n) % TARBLOCK) % TARBLOCK)
+#define TAREND          (2 * TARBLOCK)  /* zeros that close an archive */
+#define TARHDRMAX       (2 * TARBLOCK + PATH_MAX + TARPAD(PATH_MAX))
+
+long tar_header(char *hdr, const char *path, const struct stat *st);
+off_t tar_member(const char *path, const struct stat *st);
+
+#endif
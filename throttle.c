@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "hash.h"
+#include "throttle.h"
+
+#define IDLE            1.0             /* seconds without sending before a host loses its share */
+
+enum { CONNBYTES, CONNOPENS, HOSTBYTES, HOSTOPENS, NODEBYTES, NLIMITS };
+
+static const char *names[NLIMITS] = {
+        "conn_bytes", "conn_opens", "host_bytes", "host_opens", "node_bytes"
+};
+
+typedef struct {
+        double rate;                    /* tokens per second, 0 for no limit */
+        double burst;
+} limit_t;
+
+typedef struct {
+        double tokens;                  /* negative while in debt */
+        double last;                    /* when it was last filled */
+} bucket_t;
+
+typedef struct {
+        uint64_t key;                   /* hash of the host, 0 for a free entry */
+        double active;                  /* when it last sent */
+        bucket_t bytes;
+        bucket_t opens;
+} host_t;
+
+/* shared by every process of the node */
+typedef struct {
+        pthread_mutex_t lock;           /* robust */
+        host_t hosts[THROTTLEHOSTS];
+} table_t;
+
+static limit_t limits[NLIMITS];
+static table_t *table;
+static int me = -1;                     /* entry of the host of this process */
+
+/* the connection of this process, for all its threads */
+static pthread_mutex_t connlock = PTHREAD_MUTEX_INITIALIZER;
+static bucket_t connbytes;
+static bucket_t connopens;
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void pause_for(double sec)
+{
+        struct timespec ts;
+
+        ts.tv_sec = (time_t) sec;
+        ts.tv_nsec = (long) ((sec - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+}
+
+
+/* "10M" to 10485760 */
+static double amount(const char *s)
+{
+        char *end;
+        double v = strtod(s, &end);
+
+        switch (*end) {
+        case 'K': case 'k':
+                return v * 1024;
+        case 'M': case 'm':
+                return v * 1024 * 1024;
+        case 'G': case 'g':
+                return v * 1024 * 1024 * 1024;
+        default:
+                return v;
+        }
+}
+
+
+/* take n tokens at the given rate: the seconds to sleep to pay off the debt */
+static double take(bucket_t *b, double rate, double burst, double n, double t)
+{
+        if (rate <= 0)
+                return 0;
+        if (burst <= 0)
+                burst = rate;
+
+        if (!b->last)
+                b->tokens = burst;
+        else if ((b->tokens += (t - b->last) * rate) > burst)
+                b->tokens = burst;
+        b->last = t;
+
+        b->tokens -= n;
+        return b->tokens < 0 ? -b->tokens / rate : 0;
+}
+
+
+/**
+ * @brief Read the limits and set up the buckets of the hosts, before any
+ * process is forked.
+ *
+ * @return int : 0 on success, -1 if the buckets of the hosts are disabled
+ */
+int throttle_init(void)
+{
+        pthread_mutexattr_t attr;
+        char line[256], name[64], rate[64], burst[64];
+        FILE *fp;
+        int n;
+
+        if ((fp = fopen(LIMITFILE, "r"))) {
+                while (fgets(line, sizeof(line), fp)) {
+                        if (*line == '#' || (n = sscanf(line, "%63s %63s %63s", name, rate, burst)) < 2)
+                                continue;
+                        for (int i = 0; i < NLIMITS; ++i) {
+                                if (!strcmp(name, names[i])) {
+                                        limits[i].rate = amount(rate);
+                                        limits[i].burst = n == 3 ? amount(burst) : 0;
+                                }
+                        }
+                }
+                fclose(fp);
+        }
+
+        table = mmap(NULL, sizeof(table_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+                table = NULL;
+                return -1;
+        }
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&table->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        return 0;
+}
+
+
+/*
+ * Take the table lock. A process that died holding it leaves at worst a
+ * bucket charged without its time moved on, or an entry it was taking
+ * still free: nothing to repair.
+ */
+static void lock(void)
+{
+        if (pthread_mutex_lock(&table->lock) == EOWNERDEAD)
+                pthread_mutex_consistent(&table->lock);
+}
+
+
+/**
+ * @brief Charge what this process sends and opens to a client host from
+ * now on. Called in each child after the fork, which also gives it fresh
+ * buckets for its connection.
+ *
+ * @param host : the host the client connected from
+ */
+void throttle_client(const char *host)
+{
+        uint64_t key = hash_buf(host, strlen(host), 0) | 1;
+        double t = now();
+        int spare = -1;
+
+        memset(&connbytes, 0, sizeof(connbytes));
+        memset(&connopens, 0, sizeof(connopens));
+        if (!table)
+                return;
+
+        lock();
+        for (me = 0; me < THROTTLEHOSTS && table->hosts[me].key != key; ++me) {
+                /* a host quiet for a while can give up its entry */
+                if (spare < 0 && (!table->hosts[me].key || t - table->hosts[me].active > 60 * IDLE))
+                        spare = me;
+        }
+        if (me == THROTTLEHOSTS && (me = spare) >= 0) {
+                memset(&table->hosts[me], 0, sizeof(host_t));
+                table->hosts[me].key = key;
+        }
+        pthread_mutex_unlock(&table->lock);
+}
+
+
+/* the share of the node rate left for each host that is sending */
+static double share(double t)
+{
+        int n = 0;
+
+        for (int i = 0; i < THROTTLEHOSTS; ++i) {
+                if (table->hosts[i].key && t - table->hosts[i].active < IDLE)
+                        ++n;
+        }
+        return limits[NODEBYTES].rate / (n ? n : 1);
+}
+
+
+/**
+ * @brief Wait until n more bytes may be sent on this connection. Called
+ * before each piece of a response goes out.
+ */
+void throttle_bytes(size_t n)
+{
+        double t = now(), wait, w, rate;
+        host_t *h;
+
+        pthread_mutex_lock(&connlock);
+        wait = take(&connbytes, limits[CONNBYTES].rate, limits[CONNBYTES].burst, n, t);
+        pthread_mutex_unlock(&connlock);
+
+        if (table && me >= 0) {
+                lock();
+                h = &table->hosts[me];
+                h->active = t;
+                rate = limits[HOSTBYTES].rate;
+                if (limits[NODEBYTES].rate > 0 && (rate <= 0 || share(t) < rate))
+                        rate = share(t);
+                w = take(&h->bytes, rate, limits[HOSTBYTES].burst > 0 ? limits[HOSTBYTES].burst :
+                         limits[NODEBYTES].burst, n, t);
+                pthread_mutex_unlock(&table->lock);
+                if (w > wait)
+                        wait = w;
+        }
+
+        if (wait > 0)
+                pause_for(wait);
+}
+
+
+/* wait until n more files may be opened for this connection */
+void throttle_opens(size_t n)
+{
+        double t = now(), wait, w;
+
+        pthread_mutex_lock(&connlock);
+        wait = take(&connopens, limits[CONNOPENS].rate, limits[CONNOPENS].burst, n, t);
+        pthread_mutex_unlock(&connlock);
+
+        if (table && me >= 0) {
+                lock();
+                w = take(&table->hosts[me].opens, limits[HOSTOPENS].rate, limits[HOSTOPENS].burst, n, t);
+                pthread_mutex_unlock(&table->lock);
+                if (w > wait)
+                        wait = w;
+        }
+
+        if (wait > 0)
+                pause_for(wait);
+}
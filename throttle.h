@@ -0,0 +1,34 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+
+/*
+ * Rate limits on what a node sends and on the files it opens.
+ *
+ * Each limit is a token bucket: tokens come in at a fixed rate up to the
+ * burst size, and every byte sent or file opened takes one. A taker may
+ * run the bucket into debt; it then sleeps until the debt is paid off, so
+ * a large send is slowed down rather than refused. There are buckets per
+ * connection, kept by the session process, and per client host, kept in
+ * memory shared by every process of the node so that opening more
+ * connections does not buy a host more than its share.
+ *
+ * The node itself may have a total rate for bytes. It is split evenly
+ * between the hosts that sent anything in the last second: when a host
+ * goes quiet its share goes to the others, up to their own limit.
+ *
+ * Limits are read from LIMITFILE, one "name rate burst" line each, where
+ * name is conn_bytes, conn_opens, host_bytes, host_opens or node_bytes.
+ * Byte counts take a K, M or G suffix. Anything not listed is unlimited.
+ */
+
+#define LIMITFILE       "limits"
+#define THROTTLEHOSTS   64              /* hosts with a bucket of their own */
+
+int throttle_init(void);
+void throttle_client(const char *host);
+void throttle_bytes(size_t n);
+void throttle_opens(size_t n);
+
+#endif
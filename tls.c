@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+
+#define RELAYBUF        (64 * 1024)     /* bytes in flight each way in a relay */
+#define TLSFDS          1024            /* descriptors that can be told relayed */
+#define DRAINWAIT       5               /* seconds a relay gets to finish at exit */
+
+typedef struct relay {
+        SSL *ssl;
+        int sock;                       /* the TCP connection */
+        int app;                        /* our end of the socketpair */
+        int user;                       /* the caller's end */
+        struct relay *next;
+} relay_t;
+
+static SSL_CTX *srvctx;                 /* for the connections accepted */
+static SSL_CTX *cltctx;                 /* for the connections made */
+static int usektls;
+
+static pthread_mutex_t relaylock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t relaydone = PTHREAD_COND_INITIALIZER;
+static relay_t *relays;                 /* running */
+static unsigned char relayed[TLSFDS];
+
+
+/* wait for the relays to pass on what was written before exit() */
+static void drain(void)
+{
+        struct timespec ts;
+        relay_t *r;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += DRAINWAIT;
+        pthread_mutex_lock(&relaylock);
+        for (r = relays; r; r = r->next)
+                shutdown(r->user, SHUT_WR);
+        while (relays && pthread_cond_timedwait(&relaydone, &relaylock, &ts) != ETIMEDOUT)
+                ;
+        pthread_mutex_unlock(&relaylock);
+}
+
+
+/* take a relay that is done off the list, and free it */
+static void forget(relay_t *r)
+{
+        relay_t **p;
+
+        pthread_mutex_lock(&relaylock);
+        for (p = &relays; *p && *p != r; p = &(*p)->next)
+                ;
+        if (*p)
+                *p = r->next;
+        /* the caller may have closed its end already, and the number gone to a newer relay */
+        for (p = &relays; *p && (*p)->user != r->user; p = &(*p)->next)
+                ;
+        if (r->user < TLSFDS && !*p)
+                relayed[r->user] = 0;
+        pthread_cond_broadcast(&relaydone);
+        pthread_mutex_unlock(&relaylock);
+        free(r);
+}
+
+
+/**
+ * @brief Set up TLS for the connections of this process.
+ *
+ * @param pem : for a node, its certificate and key; for a client, the
+ * certificates it trusts
+ * @param node : 1 for a node, which accepts connections as well
+ * @param ktls : 0 to keep the record layer in user space
+ * @return int : 0 on success, -1 if the PEM file can't be used
+ */
+int tls_init(const char *pem, int node, int ktls)
+{
+        usektls = ktls;
+
+        if (node) {
+                if (!(srvctx = SSL_CTX_new(TLS_server_method())))
+                        goto errout;
+                SSL_CTX_set_min_proto_version(srvctx, TLS1_2_VERSION);
+                if (ktls)
+                        SSL_CTX_set_options(srvctx, SSL_OP_ENABLE_KTLS);
+                /* a ticket after the handshake would reach the kernel as a record it can't read */
+                SSL_CTX_set_num_tickets(srvctx, 0);
+                if (SSL_CTX_use_certificate_chain_file(srvctx, pem) != 1 ||
+                    SSL_CTX_use_PrivateKey_file(srvctx, pem, SSL_FILETYPE_PEM) != 1 ||
+                    SSL_CTX_check_private_key(srvctx) != 1)
+                        goto errout;
+        }
+
+        if (!(cltctx = SSL_CTX_new(TLS_client_method())))
+                goto errout;
+        SSL_CTX_set_min_proto_version(cltctx, TLS1_2_VERSION);
+        if (ktls)
+                SSL_CTX_set_options(cltctx, SSL_OP_ENABLE_KTLS);
+        SSL_CTX_set_verify(cltctx, SSL_VERIFY_PEER, NULL);
+        if (SSL_CTX_load_verify_locations(cltctx, pem, NULL) != 1)
+                goto errout;
+
+        atexit(drain);
+        return 0;
+
+errout:
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(srvctx);
+        SSL_CTX_free(cltctx);
+        srvctx = cltctx = NULL;
+        return -1;
+}
+
+
+/*
+ * Move bytes between the TLS connection and the socketpair until the
+ * caller has closed its end and all it wrote is sent. Both sockets are
+ * non-blocking, and only this thread touches the SSL object.
+ */
+static void *run(void *arg)
+{
+        relay_t *r = arg;
+        char *in, *out;
+        size_t inlen = 0, inoff = 0, outlen = 0, outoff = 0;
+        int eof = 0, closed = 0, progress, n;
+        struct pollfd pfd[2];
+
+        if (!(in = malloc(2 * RELAYBUF)))
+                goto out;
+        out = in + RELAYBUF;
+
+        while (!closed || outoff < outlen) {
+                progress = 0;
+                pfd[0].events = pfd[1].events = 0;
+
+                /* from the peer to the caller */
+                if (!eof && inoff == inlen) {
+                        if ((n = SSL_read(r->ssl, in, RELAYBUF)) > 0) {
+                                inlen = n;
+                                inoff = 0;
+                                progress = 1;
+                        } else switch (SSL_get_error(r->ssl, n)) {
+                        case SSL_ERROR_WANT_READ:
+                                pfd[0].events |= POLLIN;
+                                break;
+                        case SSL_ERROR_WANT_WRITE:
+                                pfd[0].events |= POLLOUT;
+                                break;
+                        default:
+                                /* the caller reads EOF, and may still answer */
+                                eof = progress = 1;
+                                shutdown(r->app, SHUT_WR);
+                        }
+                }
+                if (inoff < inlen) {
+                        if ((n = send(r->app, in + inoff, inlen - inoff, MSG_NOSIGNAL)) > 0) {
+                                inoff += n;
+                                progress = 1;
+                        } else if (n < 0 && errno == EAGAIN) {
+                                pfd[1].events |= POLLOUT;
+                        } else {
+                                inoff = inlen;          /* nobody is reading */
+                        }
+                }
+
+                /* from the caller to the peer */
+                if (!closed && outoff == outlen) {
+                        if ((n = recv(r->app, out, RELAYBUF, 0)) > 0) {
+                                outlen = n;
+                                outoff = 0;
+                                progress = 1;
+                        } else if (n < 0 && errno == EAGAIN) {
+                                pfd[1].events |= POLLIN;
+                        } else {
+                                closed = progress = 1;
+                        }
+                }
+                if (outoff < outlen) {
+                        if ((n = SSL_write(r->ssl, out + outoff, outlen - outoff)) > 0) {
+                                outoff += n;
+                                progress = 1;
+                        } else switch (SSL_get_error(r->ssl, n)) {
+                        case SSL_ERROR_WANT_READ:
+                                pfd[0].events |= POLLIN;
+                                break;
+                        case SSL_ERROR_WANT_WRITE:
+                                pfd[0].events |= POLLOUT;
+                                break;
+                        default:
+                                goto out;       /* the peer is gone */
+                        }
+                }
+
+                if (progress)
+                        continue;
+
+                /* a hung up socket would wake poll() up even when nothing is asked of it */
+                pfd[0].fd = pfd[0].events ? r->sock : -1;
+                pfd[1].fd = pfd[1].events ? r->app : -1;
+                if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+                        break;
+        }
+
+        SSL_shutdown(r->ssl);
+out:
+        free(in);
+        SSL_free(r->ssl);
+        close(r->sock);
+        close(r->app);
+        forget(r);
+        return NULL;
+}
+
+
+/*
+ * Finish a connection once its handshake is done: give back the socket
+ * if the kernel has the keys of both directions, otherwise the caller's
+ * end of a relay.
+ */
+static int attach(SSL *ssl, int fd)
+{
+        pthread_t tid;
+        relay_t *r;
+        int sv[2];
+
+        if (usektls && BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+                SSL_free(ssl);          /* leaves the socket open */
+                return fd;
+        }
+
+        if (!(r = malloc(sizeof(relay_t))))
+                goto errout;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+                free(r);
+                goto errout;
+        }
+
+        r->ssl = ssl;
+        r->sock = fd;
+        r->app = sv[0];
+        r->user = sv[1];
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(r->app, F_SETFL, fcntl(r->app, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(r->app, F_SETFD, FD_CLOEXEC);
+        SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+        /* listed first: the relay takes itself off the list when it is done */
+        pthread_mutex_lock(&relaylock);
+        r->next = relays;
+        relays = r;
+        if (r->user < TLSFDS)
+                relayed[r->user] = 1;
+        pthread_mutex_unlock(&relaylock);
+
+        if (pthread_create(&tid, NULL, run, r)) {
+                close(sv[0]);
+                close(sv[1]);
+                forget(r);
+                goto errout;
+        }
+        pthread_detach(tid);
+        return sv[1];
+
+errout:
+        fprintf(stderr, "can't start a TLS relay\n");
+        SSL_free(ssl);
+        close(fd);
+        return -1;
+}
+
+
+/**
+ * @brief Do the server side of the handshake on a connection just
+ * accepted. Without tls_init(), the connection is plaintext.
+ *
+ * @param fd : the connected socket, owned by this function from now on
+ * @return int : the descriptor to use for the connection, or -1
+ */
+int tls_accept(int fd)
+{
+        SSL *ssl;
+
+        if (!srvctx)
+                return fd;
+
+        if (!(ssl = SSL_new(srvctx)) || !SSL_set_fd(ssl, fd) || SSL_accept(ssl) != 1) {
+                fprintf(stderr, "TLS handshake failed\n");
+                ERR_print_errors_fp(stderr);
+                SSL_free(ssl);
+                close(fd);
+                return -1;
+        }
+        return attach(ssl, fd);
+}
+
+
+/**
+ * @brief Do the client side of the handshake, and check the certificate
+ * of the peer against the host it was reached by.
+ *
+ * @param fd : the connected socket, owned by this function from now on
+ * @param host : the host name or numeric address connected to
+ * @return int : the descriptor to use for the connection, or -1
+ */
+int tls_connect(int fd, const char *host)
+{
+        unsigned char addr[16];
+        SSL *ssl;
+        int numeric;
+
+        if (!cltctx)
+                return fd;
+
+        numeric = inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1;
+        if (!(ssl = SSL_new(cltctx)) || !SSL_set_fd(ssl, fd))
+                goto errout;
+        if (numeric) {
+                if (!X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host))
+                        goto errout;
+        } else if (!SSL_set1_host(ssl, host) || !SSL_set_tlsext_host_name(ssl, host)) {
+                goto errout;
+        }
+        if (SSL_connect(ssl) != 1)
+                goto errout;
+
+        return attach(ssl, fd);
+
+errout:
+        fprintf(stderr, "TLS handshake with %s failed\n", host);
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        close(fd);
+        return -1;
+}
+
+
+/* the descriptor is the end of a relay, not a socket of its own */
+int tls_relayed(int fd)
+{
+        return fd >= 0 && fd < TLSFDS && relayed[fd];
+}
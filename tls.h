@@ -0,0 +1,26 @@
+#ifndef TLS_H
+#define TLS_H
+
+/*
+ * Optional TLS on every connection, with the record layer in the kernel.
+ *
+ * OpenSSL does the handshake. When the kernel then takes over both
+ * directions (kTLS), the socket is handed back as it is: send(),
+ * sendfile() and recv() on it are encrypted and decrypted by the kernel,
+ * and archives still go out without a copy. Otherwise, or with kTLS
+ * turned off, a relay thread runs SSL_read() and SSL_write() between the
+ * socket and one end of a socketpair, and the caller gets the other end.
+ * Either way the rest of the code does plain socket I/O.
+ *
+ * A node has a PEM file with its certificate and key; the certificates
+ * in it are also what it trusts, as the mirror of another node. A client
+ * has a PEM file of the certificates it trusts. Certificates are checked
+ * against the host name or address that was connected to.
+ */
+
+int tls_init(const char *pem, int node, int ktls);
+int tls_accept(int fd);
+int tls_connect(int fd, const char *host);
+int tls_relayed(int fd);
+
+#endif
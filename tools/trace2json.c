@@ -0,0 +1,158 @@
+/*
+ * Turn the trace log of a node (server -t <log>) into Chrome trace JSON,
+ * for chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Each request is one track, in the row of the process that served it:
+ * a "request" slice from the time it was read to the last byte sent or
+ * acknowledged, cut into the phases it went through. A track is named by
+ * the request id; text requests, which all have id 0, are numbered in the
+ * order their process wrote them, from TEXTTRACK up.
+ *
+ * Build from the repository root with ``make``, or:
+ *      gcc -O2 -iquote . -o trace2json tools/trace2json.c proto.c arena.c
+ *
+ * (-iquote rather than -I: the sched.h of this tree would hide the system one.)
+ *
+ * Usage: trace2json <log> > trace.json
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+#include "trace.h"
+
+#define TEXTTRACK       0x80000000u     /* tid of the first text request of a process */
+
+/* the phase that ends at each boundary */
+static const char *phases[TR_NPHASES] = {
+        [TR_EVAL] = "queue",            /* waiting for a thread or a worker */
+        [TR_MATCH] = "match",           /* selecting the files */
+        [TR_ARCHIVE_START] = "admit",   /* the member list, rate limits and a build slot */
+        [TR_ARCHIVE_END] = "archive",   /* reading, compressing and writing the archive */
+        [TR_FIRST_BYTE] = "prepare",    /* whatever else comes before the response */
+        [TR_LAST_BYTE] = "send",
+        [TR_ACK] = "ack",               /* the rest of the response crossing the network */
+};
+
+static uint64_t origin;                 /* the first record, at time 0 */
+static int events;
+
+/* text requests seen so far, per process */
+static struct {
+        uint32_t pid;
+        uint32_t n;
+} *texts;
+static int ntexts;
+
+
+static int by_time(const void *a, const void *b)
+{
+        const trace_rec_t *x = a, *y = b;
+
+        return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+
+/* the track of a request: its id, or the next text track of its process */
+static uint32_t track(const trace_rec_t *r)
+{
+        int i;
+
+        if (r->id)
+                return r->id;
+        for (i = 0; i < ntexts && texts[i].pid != r->pid; ++i)
+                ;
+        if (i == ntexts) {
+                if (!(texts = realloc(texts, (ntexts + 1) * sizeof(*texts)))) {
+                        fprintf(stderr, "out of memory\n");
+                        exit(1);
+                }
+                texts[ntexts].pid = r->pid;
+                texts[ntexts++].n = 0;
+        }
+        return TEXTTRACK + texts[i].n++;
+}
+
+
+static void slice(const trace_rec_t *r, uint32_t tid, const char *name, uint64_t from, uint64_t to,
+                  const char *args)
+{
+        printf("%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f%s%s}",
+               events++ ? "," : "", name, r->pid, tid, (from - origin) / 1e3, (to - from) / 1e3,
+               *args ? ",\"args\":" : "", args);
+}
+
+
+/* the slices of one request, its n records sorted by time */
+static void request(trace_rec_t *recs, int n)
+{
+        const char *op = proto_opname(recs[0].op);
+        uint32_t tid = track(&recs[0]);
+        char args[256];
+        uint64_t bytes = 0, files = 0;
+
+        for (int i = 0; i < n; ++i) {
+                if (recs[i].phase == TR_LAST_BYTE)
+                        bytes = recs[i].arg;
+                else if (recs[i].phase == TR_MATCH)
+                        files = recs[i].arg;
+        }
+        snprintf(args, sizeof(args), "{\"op\":\"%s\",\"files\":%llu,\"bytes\":%llu}", op ? op : "unknown",
+                 (unsigned long long) files, (unsigned long long) bytes);
+        slice(&recs[0], tid, op ? op : "request", recs[0].ns, recs[n - 1].ns, args);
+
+        for (int i = 1; i < n; ++i) {
+                if (recs[i].phase < TR_NPHASES && phases[recs[i].phase] && recs[i].ns > recs[i - 1].ns)
+                        slice(&recs[i], tid, phases[recs[i].phase], recs[i - 1].ns, recs[i].ns, "");
+        }
+}
+
+
+int main(int argc, char *argv[])
+{
+        char magic[sizeof(TRACE_MAGIC) - 1];
+        trace_rec_t *recs = NULL;
+        size_t n = 0, cap = 0, first;
+        FILE *fp;
+
+        if (argc != 2) {
+                fprintf(stderr, "Usage: %s <log>\n", argv[0]);
+                return 1;
+        }
+        if (!(fp = fopen(argv[1], "rb"))) {
+                perror(argv[1]);
+                return 1;
+        }
+        if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+                fprintf(stderr, "%s: not a trace log\n", argv[1]);
+                return 1;
+        }
+        while (1) {
+                if (n == cap && !(recs = realloc(recs, (cap = cap ? cap * 2 : 4096) * sizeof(trace_rec_t)))) {
+                        fprintf(stderr, "out of memory\n");
+                        return 1;
+                }
+                if (fread(&recs[n], sizeof(trace_rec_t), 1, fp) != 1)
+                        break;
+                if (!origin || recs[n].ns < origin)
+                        origin = recs[n].ns;
+                ++n;
+        }
+        fclose(fp);
+
+        /* the records of a request were appended together, starting with TR_READ */
+        printf("{\"traceEvents\":[");
+        for (size_t i = 0; i < n; i = first) {
+                first = i + 1;
+                while (first < n && recs[first].phase != TR_READ &&
+                       recs[first].pid == recs[i].pid && recs[first].id == recs[i].id)
+                        ++first;
+                qsort(&recs[i], first - i, sizeof(trace_rec_t), by_time);
+                request(&recs[i], first - i);
+        }
+        printf("\n],\"displayTimeUnit\":\"ms\"}\n");
+        free(recs);
+        free(texts);
+        return 0;
+}
@@ -0,0 +1,250 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/sockios.h>
+
+#include "trace.h"
+
+#define ACKWAIT         2.0             /* seconds to wait for the client to acknowledge */
+
+static int logfd = -1;
+
+/* the request of this thread */
+static __thread struct {
+        int on;
+        uint32_t id;
+        uint8_t op;
+        int n;
+        int ackfd;                      /* -1 unless its acknowledgement is wanted */
+        uint64_t sent;
+        uint64_t last;                  /* when the last byte went out */
+        trace_rec_t recs[TRACE_MAXREC];
+} cur;
+
+/* the records of a request, held until the client has acknowledged its last byte */
+typedef struct pending {
+        struct pending *next;
+        int fd;
+        uint64_t upto;                  /* bytes of the process that must have been acknowledged */
+        uint64_t until;                 /* when to give up */
+        int n;
+        trace_rec_t recs[TRACE_MAXREC];
+} pending_t;
+
+static uint64_t written;                /* bytes sent by every request of the process */
+static pending_t *pending;
+static int watching;
+static pthread_mutex_t acklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ackcond = PTHREAD_COND_INITIALIZER;
+
+
+static uint64_t clock_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * @brief Append the traces of this node to a log, made if need be. Called
+ * once before any process is forked; they all inherit the descriptor.
+ *
+ * @return int : 0 on success, -1 on error
+ */
+int trace_open(const char *path)
+{
+        struct stat st;
+
+        if ((logfd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+                return -1;
+        if (!fstat(logfd, &st) && !st.st_size &&
+            write(logfd, TRACE_MAGIC, strlen(TRACE_MAGIC)) != (ssize_t) strlen(TRACE_MAGIC)) {
+                close(logfd);
+                logfd = -1;
+                return -1;
+        }
+        return 0;
+}
+
+
+static void record(int phase, uint64_t ns, uint64_t arg)
+{
+        trace_rec_t *r;
+
+        if (cur.n == TRACE_MAXREC)
+                return;
+        r = &cur.recs[cur.n++];
+        memset(r, 0, sizeof(*r));
+        r->ns = ns;
+        r->arg = arg;
+        r->pid = getpid();
+        r->id = cur.id;
+        r->op = cur.op;
+        r->phase = phase;
+}
+
+
+/**
+ * @brief Start tracing the request this thread serves.
+ *
+ * @param read : when it was read, in seconds of CLOCK_MONOTONIC
+ */
+void trace_begin(uint32_t id, int op, double read)
+{
+        if (logfd < 0)
+                return;
+        cur.on = 1;
+        cur.id = id;
+        cur.op = op;
+        cur.n = 0;
+        cur.ackfd = -1;
+        cur.sent = cur.last = 0;
+        record(TR_READ, (uint64_t) (read * 1e9), 0);
+        record(TR_EVAL, clock_ns(), 0);
+}
+
+
+void trace_mark(int phase, uint64_t arg)
+{
+        if (cur.on)
+                record(phase, clock_ns(), arg);
+}
+
+
+/* n more bytes of the response went out */
+void trace_sent(uint64_t n)
+{
+        if (!cur.on)
+                return;
+        cur.last = clock_ns();
+        if (!cur.sent)
+                record(TR_FIRST_BYTE, cur.last, 0);
+        cur.sent += n;
+        __sync_fetch_and_add(&written, n);
+}
+
+
+/* have the request of this thread record when the client acknowledged its response on fd */
+void trace_ack(int fd)
+{
+        if (cur.on)
+                cur.ackfd = fd;
+}
+
+
+/* write out the records of a request, with its acknowledgement at ns unless 0 */
+static void flush(trace_rec_t *recs, int n, uint64_t ns)
+{
+        if (ns && n < TRACE_MAXREC) {
+                recs[n] = recs[0];
+                recs[n].ns = ns;
+                recs[n].arg = 0;
+                recs[n++].phase = TR_ACK;
+        }
+        /* one write with O_APPEND: the records of a request stay together */
+        write(logfd, recs, n * sizeof(trace_rec_t));
+}
+
+
+/*
+ * Thread that watches the sockets of the requests that wait for their
+ * acknowledgement. The send queue of a socket may also hold responses
+ * sent after the one waited for: a request is acknowledged once the
+ * bytes of the process that left the queue cover its own.
+ */
+static void *watch(void *arg)
+{
+        struct timespec ts = { 0, 1000000 };
+        pending_t **p, *q;
+        uint64_t w;
+        int queued, ret;
+
+        pthread_mutex_lock(&acklock);
+        while (1) {
+                while (!pending)
+                        pthread_cond_wait(&ackcond, &acklock);
+
+                for (p = &pending; (q = *p); ) {
+                        w = __sync_fetch_and_add(&written, 0);
+                        ret = ioctl(q->fd, SIOCOUTQ, &queued);
+                        if (!ret && (uint64_t) queued <= w && w - queued >= q->upto)
+                                flush(q->recs, q->n, clock_ns());
+                        else if (ret < 0 || clock_ns() >= q->until)
+                                flush(q->recs, q->n, 0);
+                        else {
+                                p = &q->next;
+                                continue;
+                        }
+                        *p = q->next;
+                        free(q);
+                }
+
+                pthread_mutex_unlock(&acklock);
+                nanosleep(&ts, NULL);
+                pthread_mutex_lock(&acklock);
+        }
+        return NULL;
+}
+
+
+/* atexit() handler: what still waits for its acknowledgement is written without it */
+static void drain(void)
+{
+        pending_t *q;
+
+        pthread_mutex_lock(&acklock);
+        while ((q = pending)) {
+                pending = q->next;
+                flush(q->recs, q->n, 0);
+                free(q);
+        }
+        pthread_mutex_unlock(&acklock);
+}
+
+
+/* write out the records of the request of this thread, once acknowledged if trace_ack() asked for it */
+void trace_end(void)
+{
+        pthread_t tid;
+        pending_t *q;
+
+        if (!cur.on)
+                return;
+        cur.on = 0;
+        if (cur.sent)
+                record(TR_LAST_BYTE, cur.last, cur.sent);
+
+        if (cur.ackfd < 0 || !cur.sent || !(q = malloc(sizeof(pending_t)))) {
+                flush(cur.recs, cur.n, 0);
+                return;
+        }
+        q->fd = cur.ackfd;
+        q->upto = __sync_fetch_and_add(&written, 0);
+        q->until = clock_ns() + (uint64_t) (ACKWAIT * 1e9);
+        q->n = cur.n;
+        memcpy(q->recs, cur.recs, cur.n * sizeof(trace_rec_t));
+
+        pthread_mutex_lock(&acklock);
+        if (!watching) {
+                if (pthread_create(&tid, NULL, watch, NULL)) {
+                        pthread_mutex_unlock(&acklock);
+                        flush(q->recs, q->n, 0);
+                        free(q);
+                        return;
+                }
+                pthread_detach(tid);
+                atexit(drain);
+                watching = 1;
+        }
+        q->next = pending;
+        pending = q;
+        pthread_cond_signal(&ackcond);
+        pthread_mutex_unlock(&acklock);
+}
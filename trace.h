@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Per-request phase tracing.
+ *
+ * When a trace log is open, each request records the monotonic time at
+ * which it crosses each phase boundary below. The records of a request
+ * are collected by the thread serving it and appended to the log in one
+ * write() when it is done, so the processes of a node can share a log.
+ * The log is a TRACE_MAGIC header followed by trace_rec_t records in host
+ * byte order; tools/trace2json turns it into Chrome trace JSON. A request
+ * that waits for its acknowledgement hands its records to a thread of the
+ * process, which writes them once the client has acknowledged the last
+ * byte, so the request itself does not wait.
+ *
+ * Without a log every call returns at once.
+ */
+
+#define TRACE_MAGIC     "FTPTRACE"
+#define TRACE_MAXREC    64              /* records kept per request */
+
+/* phase boundaries */
+enum {
+        TR_READ,                        /* the request was read and parsed */
+        TR_EVAL,                        /* a thread started on it */
+        TR_MATCH,                       /* its files were selected, arg: how many */
+        TR_ARCHIVE_START,               /* tar started, arg: members */
+        TR_ARCHIVE_END,                 /* tar is done, arg: archive bytes */
+        TR_FIRST_BYTE,                  /* the first byte of the response was sent */
+        TR_LAST_BYTE,                   /* the last one, arg: bytes sent */
+        TR_ACK,                         /* the client acknowledged all of them */
+        TR_NPHASES
+};
+
+typedef struct {
+        uint64_t ns;                    /* CLOCK_MONOTONIC */
+        uint64_t arg;
+        uint32_t pid;
+        uint32_t id;                    /* request id */
+        uint8_t op;
+        uint8_t phase;
+        uint8_t pad[6];
+} trace_rec_t;
+
+int trace_open(const char *path);
+void trace_begin(uint32_t id, int op, double read);
+void trace_mark(int phase, uint64_t arg);
+void trace_sent(uint64_t n);
+void trace_ack(int fd);
+void trace_end(void);
+
+#endif
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "tune.h"
+
+#define TUNERULES       64              /* lines of TUNEFILE kept */
+#define TUNEFDS         1024            /* sockets with cork and zero-copy state */
+#define MINBUF          (64 * 1024)
+#define MAXBUF          (256 * 1024 * 1024)
+#define ZCWAIT          2000            /* ms to wait for zero-copy completions */
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY     60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
+
+enum { NODELAY, CORK, CC, BANDWIDTH, SNDBUF, RCVBUF, ZEROCOPY, NOPTS };
+
+static const char *names[NOPTS] = {
+        "nodelay", "cork", "cc", "bandwidth", "sndbuf", "rcvbuf", "zerocopy"
+};
+
+typedef struct {
+        char peer[64];
+        int opt;
+        double value;                   /* -1 for auto */
+        char cc[16];
+} rule_t;
+
+/* what a socket gets, once the rules are applied */
+typedef struct {
+        double value[NOPTS];
+        char cc[16];
+} settings_t;
+
+typedef struct {
+        unsigned char cork;
+        unsigned char zerocopy;
+        int corked;                     /* responses under way with the cork in */
+        uint32_t zcsent;                /* zero-copy sends made */
+        uint32_t zcdone;                /* and completed */
+} sock_t;
+
+static rule_t rules[TUNERULES];
+static int nrules;
+
+static pthread_mutex_t socklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flushlock = PTHREAD_MUTEX_INITIALIZER;
+static sock_t socks[TUNEFDS];
+
+
+/* "10M" to 10485760, "auto" to -1 */
+static double amount(const char *s)
+{
+        char *end;
+        double v;
+
+        if (!strcmp(s, "auto"))
+                return -1;
+
+        v = strtod(s, &end);
+        switch (*end) {
+        case 'K': case 'k':
+                return v * 1024;
+        case 'M': case 'm':
+                return v * 1024 * 1024;
+        case 'G': case 'g':
+                return v * 1024 * 1024 * 1024;
+        default:
+                return v;
+        }
+}
+
+
+/**
+ * @brief Read the rules of this role. The client calls it at startup, a
+ * node before it makes or takes any connection.
+ *
+ * @param role : server, mirror or client
+ * @return int : 0 on success, -1 if TUNEFILE has a line it can't use
+ */
+int tune_init(const char *role)
+{
+        char line[256], r[32], peer[64], name[32], value[64];
+        FILE *fp;
+        int err = 0, i;
+
+        /* by default the node answers at once and corks its archives */
+        rules[0] = (rule_t) { "*", NODELAY, 1, "" };
+        rules[1] = (rule_t) { "*", CORK, 1, "" };
+        nrules = 2;
+
+        if (!(fp = fopen(TUNEFILE, "r")))
+                return 0;
+
+        while (fgets(line, sizeof(line), fp)) {
+                if (*line == '#' || sscanf(line, "%31s %63s %31s %63s", r, peer, name, value) < 4)
+                        continue;
+                if (strcmp(r, "*") && strcmp(r, role))
+                        continue;
+
+                for (i = 0; i < NOPTS && strcmp(name, names[i]); ++i)
+                        ;
+                /* a congestion control name cut short would be another one, or none */
+                if (i == NOPTS || nrules == TUNERULES || (i == CC && strlen(value) >= sizeof(rules[0].cc))) {
+                        fprintf(stderr, "%s: can't use %s", TUNEFILE, line);
+                        err = -1;
+                        continue;
+                }
+
+                strcpy(rules[nrules].peer, peer);
+                rules[nrules].opt = i;
+                rules[nrules].value = i == CC ? 0 : amount(value);
+                rules[nrules].cc[0] = '\0';
+                if (i == CC)
+                        memcpy(rules[nrules].cc, value, strlen(value) + 1);
+                ++nrules;
+        }
+
+        fclose(fp);
+        return err;
+}
+
+
+/* a send or receive buffer of n bytes, past the sysctl limit if allowed */
+static void set_buffer(int fd, int force, int opt, double n)
+{
+        int size;
+
+        if (n < MINBUF)
+                n = MINBUF;
+        if (n > MAXBUF)
+                n = MAXBUF;
+        size = (int) n;
+
+        if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof(int)) < 0)
+                setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(int));
+}
+
+
+/**
+ * @brief Set the options of a connected socket for the host at the other
+ * end. Buffers set to auto are sized to the bandwidth-delay product of
+ * the link, from the RTT the kernel measured during the handshake.
+ *
+ * @param fd : the connected socket
+ * @param peer : the host it is connected to
+ */
+void tune_socket(int fd, const char *peer)
+{
+        static int warned;
+        settings_t s;
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        double bdp = 0;
+        int one = 1;
+
+        memset(&s, 0, sizeof(s));
+        for (int i = 0; i < nrules; ++i) {
+                if (strcmp(rules[i].peer, "*") && fnmatch(rules[i].peer, peer, 0))
+                        continue;
+                s.value[rules[i].opt] = rules[i].value;
+                if (rules[i].opt == CC)
+                        strcpy(s.cc, rules[i].cc);
+        }
+
+        if (s.value[NODELAY] > 0)
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+
+        if (s.cc[0] && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, s.cc, strlen(s.cc)) < 0 && !warned++)
+                fprintf(stderr, "congestion control %s unavailable: %s\n", s.cc, strerror(errno));
+
+        if (s.value[BANDWIDTH] > 0 && !getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) && ti.tcpi_rtt)
+                bdp = s.value[BANDWIDTH] * ti.tcpi_rtt / 1e6;
+
+        /* auto without a bandwidth leaves the kernel's autotuning alone */
+        if (s.value[SNDBUF] > 0 || (s.value[SNDBUF] < 0 && bdp > 0))
+                set_buffer(fd, SO_SNDBUFFORCE, SO_SNDBUF, s.value[SNDBUF] > 0 ? s.value[SNDBUF] : bdp);
+        if (s.value[RCVBUF] > 0 || (s.value[RCVBUF] < 0 && bdp > 0))
+                set_buffer(fd, SO_RCVBUFFORCE, SO_RCVBUF, s.value[RCVBUF] > 0 ? s.value[RCVBUF] : bdp);
+
+        if (fd < 0 || fd >= TUNEFDS)
+                return;
+
+        pthread_mutex_lock(&socklock);
+        memset(&socks[fd], 0, sizeof(sock_t));
+        socks[fd].cork = s.value[CORK] > 0;
+        socks[fd].zerocopy = s.value[ZEROCOPY] > 0 &&
+                             !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(int));
+        pthread_mutex_unlock(&socklock);
+}
+
+
+/**
+ * @brief Put the cork in before a response made of a header and a file,
+ * and take it out after. Nested and concurrent responses on the socket
+ * are counted: the last one out takes the cork out.
+ */
+void tune_cork(int fd, int on)
+{
+        int val;
+
+        if (fd < 0 || fd >= TUNEFDS || !socks[fd].cork)
+                return;
+
+        pthread_mutex_lock(&socklock);
+        if (on ? socks[fd].corked++ == 0 : --socks[fd].corked == 0) {
+                val = on;
+                setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(int));
+        }
+        pthread_mutex_unlock(&socklock);
+}
+
+
+/* large sends on this socket are zero-copy: their buffers must be kept */
+int tune_zerocopy(int fd)
+{
+        return fd >= 0 && fd < TUNEFDS && socks[fd].zerocopy;
+}
+
+
+/**
+ * @brief send() that leaves large buffers in place for the NIC to read
+ * instead of copying them, when the socket has zerocopy set. The buffer
+ * must not change until tune_flush() returns.
+ */
+ssize_t tune_send(int fd, const void *buf, size_t len, int flags)
+{
+        ssize_t n;
+
+        if (!tune_zerocopy(fd) || len < TUNEZCMIN)
+                return send(fd, buf, len, flags);
+
+        /* ENOBUFS: out of the memory to pin pages with, copy instead */
+        if ((n = send(fd, buf, len, flags | MSG_ZEROCOPY)) < 0 && errno == ENOBUFS)
+                return send(fd, buf, len, flags);
+
+        /* kTLS encrypts into buffers of its own anyway */
+        if (n < 0 && errno == EOPNOTSUPP) {
+                socks[fd].zerocopy = 0;
+                return send(fd, buf, len, flags);
+        }
+
+        if (n >= 0)
+                __sync_add_and_fetch(&socks[fd].zcsent, 1);
+        return n;
+}
+
+
+/**
+ * @brief Wait until the kernel is done with the buffers of every
+ * zero-copy send made so far, reading its completions off the error
+ * queue. Gives up after ZCWAIT ms without one, or when the socket is
+ * gone; later sends on the socket are then copied.
+ *
+ * @return int : 0 once the buffers can be reused, -1 if they may still
+ * be read and must be left alone for good
+ */
+int tune_flush(int fd)
+{
+        char ctl[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct sock_extended_err *ee;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct pollfd pfd;
+        uint32_t want;
+
+        int ret;
+
+        if (!tune_zerocopy(fd))
+                return 0;
+
+        pthread_mutex_lock(&flushlock);
+        want = socks[fd].zcsent;
+        pfd.fd = fd;
+        pfd.events = 0;                 /* POLLERR is always reported */
+        while ((int32_t) (want - socks[fd].zcdone) > 0) {
+                if (poll(&pfd, 1, ZCWAIT) != 1 || !(pfd.revents & POLLERR))
+                        break;
+
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = ctl;
+                msg.msg_controllen = sizeof(ctl);
+                if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+                        break;
+
+                for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                        ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+                        /* ee_info to ee_data: the sends completed, numbered from 0 */
+                        if (ee->ee_errno == 0 && ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY &&
+                            (int32_t) (ee->ee_data + 1 - socks[fd].zcdone) > 0)
+                                socks[fd].zcdone = ee->ee_data + 1;
+                }
+        }
+        if ((ret = (int32_t) (want - socks[fd].zcdone) > 0 ? -1 : 0))
+                socks[fd].zerocopy = 0;
+        pthread_mutex_unlock(&flushlock);
+        return ret;
+}
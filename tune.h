@@ -0,0 +1,38 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Socket options for bulk transfers.
+ *
+ * Settings are read from TUNEFILE, one "role peer option value" line
+ * each. role is server, mirror or client; peer is a pattern for the host
+ * at the other end, as fnmatch() takes it; either may be "*". Later lines
+ * override earlier ones. The options are:
+ *
+ *      nodelay 0|1     TCP_NODELAY, so small replies go out at once (1)
+ *      cork 0|1        TCP_CORK around each archive sent, so its headers
+ *                      share segments with the data behind them (1)
+ *      cc name         congestion control, e.g. bbr or cubic
+ *      bandwidth n     bytes per second the link can carry
+ *      sndbuf n|auto   SO_SNDBUF; auto is bandwidth times the RTT measured
+ *      rcvbuf n|auto   at connect, and left to the kernel without bandwidth
+ *      zerocopy 0|1    MSG_ZEROCOPY for sends of TUNEZCMIN bytes or more
+ *
+ * Byte counts take a K, M or G suffix. Anything not set keeps the kernel's
+ * default.
+ */
+
+#define TUNEFILE        "tuning"
+#define TUNEZCMIN       (16 * 1024)     /* smaller sends are cheaper copied */
+
+int tune_init(const char *role);
+void tune_socket(int fd, const char *peer);
+void tune_cork(int fd, int on);
+int tune_zerocopy(int fd);
+ssize_t tune_send(int fd, const void *buf, size_t len, int flags);
+int tune_flush(int fd);
+
+#endif